@@ -0,0 +1,774 @@
+#include "bvh.hpp"
+#include "lbvh.hpp"
+#include "sbvh.hpp"
+#include <chrono>
+
+long long rayTriangleChecks = 0;
+long long rayBoxChecks = 0;
+long long rayTriangleIntersections = 0;
+long long rayBoxIntersections = 0;
+
+
+//===========================================================================
+//========================== Median split builder ===========================
+//===========================================================================
+
+BoundingBox createBox(const std::vector<face>& mesh) {
+
+  BoundingBox currentBox;
+
+  for (int i = 0; i < mesh.size(); i++) {
+
+    face currentFace = mesh[i];
+
+    vectorThree vertex1 = currentFace.vertex1;
+    vectorThree vertex2 = currentFace.vertex2;
+    vectorThree vertex3 = currentFace.vertex3;
+
+    currentBox.xMax = std::max(currentBox.xMax, vertex1.x);
+    currentBox.xMax = std::max(currentBox.xMax, vertex2.x);
+    currentBox.xMax = std::max(currentBox.xMax, vertex3.x);
+
+    currentBox.xMin = std::min(currentBox.xMin, vertex1.x);
+    currentBox.xMin = std::min(currentBox.xMin, vertex2.x);
+    currentBox.xMin = std::min(currentBox.xMin, vertex3.x);
+
+    currentBox.yMax = std::max(currentBox.yMax, vertex1.y);
+    currentBox.yMax = std::max(currentBox.yMax, vertex2.y);
+    currentBox.yMax = std::max(currentBox.yMax, vertex3.y);
+
+    currentBox.yMin = std::min(currentBox.yMin, vertex1.y);
+    currentBox.yMin = std::min(currentBox.yMin, vertex2.y);
+    currentBox.yMin = std::min(currentBox.yMin, vertex3.y);
+
+    currentBox.zMax = std::max(currentBox.zMax, vertex1.z);
+    currentBox.zMax = std::max(currentBox.zMax, vertex2.z);
+    currentBox.zMax = std::max(currentBox.zMax, vertex3.z);
+
+    currentBox.zMin = std::min(currentBox.zMin, vertex1.z);
+    currentBox.zMin = std::min(currentBox.zMin, vertex2.z);
+    currentBox.zMin = std::min(currentBox.zMin, vertex3.z);
+
+    currentBox.faces.push_back(currentFace);
+  }
+
+  //std::cout << currentBox.xMin << " " <<  currentBox.xMin << " " << currentBox.yMin << " " << currentBox.yMax << " " << currentBox.zMin << " " << currentBox.zMax << std::endl;
+  return currentBox;
+}
+
+bool sorterX(face i, face j) {
+  return i.vertex1.x < j.vertex1.x;
+}
+
+bool sorterY(face i, face j) {
+  return i.vertex1.y < j.vertex1.y;
+}
+
+bool sorterZ(face i, face j) {
+  return i.vertex1.z < j.vertex1.z;
+}
+
+BoundingBox splitBox(BoundingBox& rootBox, int faceNum) {
+
+  std::vector<face> faces = rootBox.faces;
+
+
+  if (faces.size() > faceNum) {
+
+    float x = rootBox.getX();
+    float y = rootBox.getY();
+    float z = rootBox.getZ();
+
+    std::size_t const half_size = faces.size() / 2;
+    std::size_t const third_size = faces.size() / 3;
+    std::size_t const two_third_size = 2 * faces.size() / 3;
+
+    if(x > y && x > z) {
+      
+      std::sort(faces.begin(), faces.end(), sorterX);
+    } 
+    else if(y > x && y > z) {
+
+      std::sort(faces.begin(), faces.end(), sorterY);
+    }
+    else {
+
+      std::sort(faces.begin(), faces.end(), sorterZ);
+    }
+
+    
+    std::vector<face> split_first_left(faces.begin(), faces.begin() + third_size);
+    std::vector<face> split_first_right(faces.begin() + third_size, faces.end());
+
+    std::vector<face> split_second_left(faces.begin(), faces.begin() + half_size);
+    std::vector<face> split_second_right(faces.begin() + half_size, faces.end());
+
+    std::vector<face> split_third_left(faces.begin(), faces.begin() + two_third_size);
+    std::vector<face> split_third_right(faces.begin() + two_third_size, faces.end());
+
+
+    float first_cost = 1 + 1.0f/3.0f * split_first_left.size() * 2 + 2.0f/3.0f * split_first_right.size() * 2;
+    float second_cost = 1 + 1.0f/2.0f * split_second_left.size() * 2 + 1.0f/2.0f * split_second_right.size() * 2;
+    float third_cost = 1 + 2.0f/3.0f * split_third_left.size() * 2 + 1.0f/3.0f * split_third_right.size() * 2;
+
+    BoundingBox lo_split;
+    BoundingBox hi_split;
+
+    if(first_cost > second_cost && first_cost > third_cost) {
+
+      lo_split = createBox(split_first_left);
+      hi_split = createBox(split_first_right);
+    } 
+    else if(second_cost > first_cost && second_cost > third_cost) {
+
+      lo_split = createBox(split_second_left);
+      hi_split = createBox(split_second_right);
+    }
+    else {
+
+      lo_split = createBox(split_third_left);
+      hi_split = createBox(split_third_right);
+    }
+
+
+    BoundingBox first_box = splitBox(lo_split, faceNum);
+    BoundingBox second_box = splitBox(hi_split, faceNum);
+
+    rootBox.addChild(first_box);
+    rootBox.addChild(second_box);
+
+  }
+
+  return rootBox;
+}
+
+//===========================================================================
+//============================ Binned SAH builder ===========================
+//===========================================================================
+
+struct BuildPrimitive {
+  Bounds bounds;
+  vectorThree centroid;
+  int index;
+};
+
+struct SAHBin {
+  Bounds bounds;
+  int count = 0;
+};
+
+// Bins of all three axes for one range of primitives
+struct SAHBins {
+  SAHBin axes[3][SAH_BINS];
+
+  void merge(const SAHBins& other) {
+    for (int axis = 0; axis < 3; axis++) {
+      for (int i = 0; i < SAH_BINS; i++) {
+        axes[axis][i].bounds.grow(other.axes[axis][i].bounds);
+        axes[axis][i].count += other.axes[axis][i].count;
+      }
+    }
+  }
+};
+
+struct SAHSplit {
+  int axis = -1;
+  int bin = 0;
+  float cost = FLT_MAX;
+};
+
+static int binIndex(const vectorThree& centroid, const Bounds& centroidBounds, int axis) {
+
+  float extent = centroidBounds.max[axis] - centroidBounds.min[axis];
+  int bin = int(SAH_BINS * (centroid[axis] - centroidBounds.min[axis]) / extent);
+
+  return std::min(std::max(bin, 0), SAH_BINS - 1);
+}
+
+static void growRange(const std::vector<BuildPrimitive>& prims, int begin, int end, Bounds& bounds, Bounds& centroidBounds) {
+
+  for (int i = begin; i < end; i++) {
+    bounds.grow(prims[i].bounds);
+    centroidBounds.grow(prims[i].centroid);
+  }
+}
+
+static void binRange(const std::vector<BuildPrimitive>& prims, int begin, int end, const Bounds& centroidBounds, SAHBins& bins) {
+
+  for (int axis = 0; axis < 3; axis++) {
+
+    if (centroidBounds.max[axis] - centroidBounds.min[axis] <= 0.0f) {
+      continue;
+    }
+
+    for (int i = begin; i < end; i++) {
+      SAHBin& bin = bins.axes[axis][binIndex(prims[i].centroid, centroidBounds, axis)];
+      bin.bounds.grow(prims[i].bounds);
+      bin.count++;
+    }
+  }
+}
+
+// Evaluates the SAH on every bin boundary of every axis, returns false when
+// the centroids can not be separated
+static bool findSAHSplit(const SAHBins& bins, const Bounds& bounds, const Bounds& centroidBounds, SAHSplit& best) {
+
+  float area = bounds.surfaceArea();
+
+  for (int axis = 0; axis < 3; axis++) {
+
+    if (centroidBounds.max[axis] - centroidBounds.min[axis] <= 0.0f) {
+      continue;
+    }
+
+    const SAHBin* axisBins = bins.axes[axis];
+
+    // sweep from the right so every boundary knows the area and count above it
+    float rightArea[SAH_BINS];
+    int rightCount[SAH_BINS];
+    Bounds right;
+    int count = 0;
+    for (int i = SAH_BINS - 1; i > 0; i--) {
+      right.grow(axisBins[i].bounds);
+      count += axisBins[i].count;
+      rightArea[i] = right.surfaceArea();
+      rightCount[i] = count;
+    }
+
+    Bounds left;
+    count = 0;
+    for (int i = 0; i < SAH_BINS - 1; i++) {
+      left.grow(axisBins[i].bounds);
+      count += axisBins[i].count;
+
+      if (count == 0 || rightCount[i + 1] == 0) {
+        continue;
+      }
+
+      float cost = SAH_TRAVERSAL_COST + SAH_INTERSECTION_COST *
+        (left.surfaceArea() * count + rightArea[i + 1] * rightCount[i + 1]) / area;
+
+      if (cost < best.cost) {
+        best.cost = cost;
+        best.axis = axis;
+        best.bin = i;
+      }
+    }
+  }
+
+  return best.axis != -1;
+}
+
+// Either fills the node as a leaf and returns -1, or partitions the range
+// and returns where the second child starts
+static int splitSAHNode(std::vector<BuildPrimitive>& prims, int begin, int end, const std::vector<face>& faces,
+  BoundingBox& node, int depth, const Bounds& bounds, const Bounds& centroidBounds, const SAHBins& bins) {
+
+  node.setBounds(bounds);
+
+  int count = end - begin;
+  SAHSplit split;
+  bool canSplit = count > 1 && findSAHSplit(bins, bounds, centroidBounds, split);
+  float leafCost = SAH_INTERSECTION_COST * count;
+
+  bool forceLeaf = depth >= BVH_MAX_DEPTH - 1;
+
+  if (forceLeaf || (count <= SAH_MAX_LEAF_SIZE && (!canSplit || split.cost >= leafCost))) {
+
+    for (int i = begin; i < end; i++) {
+      node.faces.push_back(faces[prims[i].index]);
+    }
+    return -1;
+  }
+
+  node.children.resize(2);
+
+  if (!canSplit) {
+    // all centroids coincide but the leaf would be too large, split in the middle
+    return begin + count / 2;
+  }
+
+  auto middle = std::partition(prims.begin() + begin, prims.begin() + end, [&](const BuildPrimitive& prim) {
+    return binIndex(prim.centroid, centroidBounds, split.axis) <= split.bin;
+  });
+  return int(middle - prims.begin());
+}
+
+static void buildSAHNode(std::vector<BuildPrimitive>& prims, int begin, int end, const std::vector<face>& faces,
+  BoundingBox& node, int depth) {
+
+  Bounds bounds;
+  Bounds centroidBounds;
+  growRange(prims, begin, end, bounds, centroidBounds);
+
+  SAHBins bins;
+  binRange(prims, begin, end, centroidBounds, bins);
+
+  int mid = splitSAHNode(prims, begin, end, faces, node, depth, bounds, centroidBounds, bins);
+  if (mid < 0) {
+    return;
+  }
+
+  buildSAHNode(prims, begin, mid, faces, node.children[0], depth + 1);
+  buildSAHNode(prims, mid, end, faces, node.children[1], depth + 1);
+}
+
+static void initPrimitives(const std::vector<face>& faces, std::vector<BuildPrimitive>& prims, int begin, int end) {
+
+  for (int i = begin; i < end; i++) {
+
+    BuildPrimitive& prim = prims[i];
+    prim.bounds = Bounds();
+    prim.bounds.grow(faces[i].vertex1);
+    prim.bounds.grow(faces[i].vertex2);
+    prim.bounds.grow(faces[i].vertex3);
+    prim.centroid = (prim.bounds.min + prim.bounds.max) * 0.5f;
+    prim.index = i;
+  }
+}
+
+BoundingBox buildSAH(const std::vector<face>& faces) {
+
+  std::vector<BuildPrimitive> prims(faces.size());
+  initPrimitives(faces, prims, 0, int(faces.size()));
+
+  BoundingBox root;
+  if (!prims.empty()) {
+    buildSAHNode(prims, 0, int(prims.size()), faces, root, 0);
+  }
+
+  return root;
+}
+
+//===========================================================================
+//======================== Parallel binned SAH builder ======================
+//===========================================================================
+
+static double secondsSince(std::chrono::high_resolution_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+// Same decisions as buildSAHNode, but large ranges reduce their bounds and bins
+// in parallel chunks and smaller ranges become independent subtree tasks.
+// Work done on the calling thread outside of tasks adds to serialSeconds.
+static void buildSAHNodeParallel(std::vector<BuildPrimitive>& prims, int begin, int end, const std::vector<face>& faces,
+  BoundingBox& node, int depth, int taskSize, ThreadPool& pool, TaskGroup& subtrees, double& serialSeconds) {
+
+  int count = end - begin;
+
+  if (count <= taskSize) {
+    pool.submit(subtrees, [&prims, begin, end, &faces, &node, depth] {
+      buildSAHNode(prims, begin, end, faces, node, depth);
+    });
+    return;
+  }
+
+  Bounds bounds;
+  Bounds centroidBounds;
+  SAHBins bins;
+
+  if (count < BUILD_PARALLEL_REDUCTION_SIZE) {
+
+    auto t1 = std::chrono::high_resolution_clock::now();
+    growRange(prims, begin, end, bounds, centroidBounds);
+    binRange(prims, begin, end, centroidBounds, bins);
+    serialSeconds += secondsSince(t1);
+  }
+  else {
+
+    int chunks = (count + BUILD_PARALLEL_CHUNK_SIZE - 1) / BUILD_PARALLEL_CHUNK_SIZE;
+    std::vector<Bounds> chunkBounds(chunks);
+    std::vector<Bounds> chunkCentroids(chunks);
+
+    pool.parallelFor(begin, end, BUILD_PARALLEL_CHUNK_SIZE, [&](int chunkBegin, int chunkEnd) {
+      int chunk = (chunkBegin - begin) / BUILD_PARALLEL_CHUNK_SIZE;
+      growRange(prims, chunkBegin, chunkEnd, chunkBounds[chunk], chunkCentroids[chunk]);
+    });
+    for (int i = 0; i < chunks; i++) {
+      bounds.grow(chunkBounds[i]);
+      centroidBounds.grow(chunkCentroids[i]);
+    }
+
+    // min, max and counts do not depend on the order of the chunks, so the
+    // merged bins are exactly the ones of the serial builder
+    std::vector<SAHBins> chunkBins(chunks);
+    pool.parallelFor(begin, end, BUILD_PARALLEL_CHUNK_SIZE, [&](int chunkBegin, int chunkEnd) {
+      int chunk = (chunkBegin - begin) / BUILD_PARALLEL_CHUNK_SIZE;
+      binRange(prims, chunkBegin, chunkEnd, centroidBounds, chunkBins[chunk]);
+    });
+    for (int i = 0; i < chunks; i++) {
+      bins.merge(chunkBins[i]);
+    }
+  }
+
+  auto t1 = std::chrono::high_resolution_clock::now();
+  int mid = splitSAHNode(prims, begin, end, faces, node, depth, bounds, centroidBounds, bins);
+  serialSeconds += secondsSince(t1);
+
+  if (mid < 0) {
+    return;
+  }
+
+  buildSAHNodeParallel(prims, begin, mid, faces, node.children[0], depth + 1, taskSize, pool, subtrees, serialSeconds);
+  buildSAHNodeParallel(prims, mid, end, faces, node.children[1], depth + 1, taskSize, pool, subtrees, serialSeconds);
+}
+
+BoundingBox buildSAHParallel(const std::vector<face>& faces, ThreadPool& pool, float& utilisation) {
+
+  auto t1 = std::chrono::high_resolution_clock::now();
+  double busyStart = pool.busySeconds();
+  double serialSeconds = 0.0;
+
+  std::vector<BuildPrimitive> prims(faces.size());
+  pool.parallelFor(0, int(faces.size()), BUILD_PARALLEL_CHUNK_SIZE, [&](int begin, int end) {
+    initPrimitives(faces, prims, begin, end);
+  });
+
+  BoundingBox root;
+  if (!prims.empty()) {
+
+    // several subtrees per thread so uneven subtrees still balance out
+    int taskSize = std::max(int(prims.size()) / (8 * pool.size()), BUILD_MIN_TASK_SIZE);
+
+    TaskGroup subtrees;
+    buildSAHNodeParallel(prims, 0, int(prims.size()), faces, root, 0, taskSize, pool, subtrees, serialSeconds);
+    pool.wait(subtrees);
+  }
+
+  double busySeconds = pool.busySeconds() - busyStart + serialSeconds;
+  double wallSeconds = secondsSince(t1);
+  utilisation = wallSeconds > 0.0 ? float(busySeconds / (wallSeconds * pool.size())) : 1.0f;
+
+  return root;
+}
+
+static bool samePoint(vectorThree a, vectorThree b) {
+  return a == b;
+}
+
+static bool sameNode(const BoundingBox& a, const BoundingBox& b) {
+
+  if (a.xMin != b.xMin || a.yMin != b.yMin || a.zMin != b.zMin ||
+    a.xMax != b.xMax || a.yMax != b.yMax || a.zMax != b.zMax) {
+    return false;
+  }
+  if (a.faces.size() != b.faces.size() || a.children.size() != b.children.size()) {
+    return false;
+  }
+
+  for (int i = 0; i < a.faces.size(); i++) {
+    if (!samePoint(a.faces[i].vertex1, b.faces[i].vertex1) ||
+      !samePoint(a.faces[i].vertex2, b.faces[i].vertex2) ||
+      !samePoint(a.faces[i].vertex3, b.faces[i].vertex3)) {
+      return false;
+    }
+  }
+  for (int i = 0; i < a.children.size(); i++) {
+    if (!sameNode(a.children[i], b.children[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool sameHierarchy(const BoundingBox& a, const BoundingBox& b) {
+  return sameNode(a, b);
+}
+
+//===========================================================================
+
+static float sahNodeCost(const BoundingBox& node, float rootArea) {
+
+  float probability = node.getSurfaceArea() / rootArea;
+
+  if (node.children.empty()) {
+    return SAH_INTERSECTION_COST * node.faces.size() * probability;
+  }
+
+  float cost = SAH_TRAVERSAL_COST * probability;
+  for (const BoundingBox& child : node.children) {
+    cost += sahNodeCost(child, rootArea);
+  }
+  return cost;
+}
+
+float sahCost(const BoundingBox& root) {
+
+  float rootArea = root.getSurfaceArea();
+  if (rootArea <= 0.0f) {
+    return 0.0f;
+  }
+
+  return sahNodeCost(root, rootArea);
+}
+
+float sahCost(const LinearBVH& bvh) {
+
+  if (bvh.nodes.empty()) {
+    return 0.0f;
+  }
+
+  float rootArea = bvh.nodes[0].getBounds().surfaceArea();
+  if (rootArea <= 0.0f) {
+    return 0.0f;
+  }
+
+  float cost = 0.0f;
+  for (const LinearNode& node : bvh.nodes) {
+
+    float probability = node.getBounds().surfaceArea() / rootArea;
+
+    if (node.isLeaf()) {
+      cost += SAH_INTERSECTION_COST * node.count * probability;
+    }
+    else {
+      cost += SAH_TRAVERSAL_COST * probability;
+    }
+  }
+  return cost;
+}
+
+BoundingBox buildBVH(const std::vector<face>& faces, BuildMode mode) {
+
+  if (mode == BUILD_SAH) {
+    return buildSAH(faces);
+  }
+  if (mode == BUILD_SBVH) {
+    return buildSBVH(faces);
+  }
+  if (mode == BUILD_LBVH) {
+    ThreadPool serial(0);
+    return buildLBVH(faces, serial, LBVH_OPTIMIZE);
+  }
+
+  BoundingBox root = createBox(faces);
+  splitBox(root, SPLIT_FACTOR);
+  return root;
+}
+
+const char* buildModeName(BuildMode mode) {
+
+  switch (mode) {
+  case BUILD_MEDIAN: return "median split";
+  case BUILD_SAH: return "binned SAH";
+  case BUILD_LBVH: return "LBVH";
+  case BUILD_SBVH: return "spatial split SAH";
+  }
+  return "unknown";
+}
+
+float duplicationFactor(const LinearBVH& bvh) {
+
+  if (bvh.faceIds.empty()) {
+    return 1.0f;
+  }
+
+  int unique = 0;
+  std::vector<bool> seen(bvh.faceIds.size());
+  for (int id : bvh.faceIds) {
+    if (id >= seen.size()) {
+      seen.resize(id + 1);
+    }
+    if (!seen[id]) {
+      seen[id] = true;
+      unique++;
+    }
+  }
+  return float(bvh.faceIds.size()) / unique;
+}
+
+//===========================================================================
+//============================ Flattened BVH ================================
+//===========================================================================
+
+static int flattenNode(const BoundingBox& box, LinearBVH& bvh) {
+
+  int index = int(bvh.nodes.size());
+  bvh.nodes.emplace_back();
+
+  LinearNode node;
+  node.min[0] = box.xMin;
+  node.min[1] = box.yMin;
+  node.min[2] = box.zMin;
+  node.max[0] = box.xMax;
+  node.max[1] = box.yMax;
+  node.max[2] = box.zMax;
+
+  if (box.children.empty()) {
+
+    node.offset = int(bvh.faces.size());
+    node.count = int(box.faces.size());
+    bvh.faces.append(box.faces.begin(), box.faces.end());
+    bvh.faceIds.append(box.faceIds.begin(), box.faceIds.end());
+  }
+  else {
+
+    flattenNode(box.children[0], bvh);
+    node.offset = flattenNode(box.children[1], bvh);
+    node.count = 0;
+  }
+
+  // the recursion may have reallocated the array, so write the node last
+  bvh.nodes[index] = node;
+  return index;
+}
+
+LinearBVH flattenBVH(const BoundingBox& root) {
+
+  LinearBVH bvh;
+  bvh.spheres = root.spheres;
+
+  if (!root.faces.empty() || !root.children.empty()) {
+    flattenNode(root, bvh);
+  }
+
+  return bvh;
+}
+
+//===========================================================================
+//============================== Refitting ==================================
+//===========================================================================
+
+void transformFaces(const face* objectFaces, const Eigen::Affine3f& model, face* faces, int count, ThreadPool& pool) {
+
+  // normals follow the inverse transpose so they stay perpendicular under scaling
+  Eigen::Matrix3f normalMatrix = model.linear().inverse().transpose();
+
+  auto transform = [&model](const vectorThree& v) {
+    Eigen::Vector3f p = model * Eigen::Vector3f(v.x, v.y, v.z);
+    return vectorThree{ p[0], p[1], p[2] };
+  };
+
+  pool.parallelFor(0, count, BUILD_PARALLEL_CHUNK_SIZE, [&](int begin, int end) {
+    for (int i = begin; i < end; i++) {
+      const face& objectFace = objectFaces[i];
+      faces[i].vertex1 = transform(objectFace.vertex1);
+      faces[i].vertex2 = transform(objectFace.vertex2);
+      faces[i].vertex3 = transform(objectFace.vertex3);
+
+      Eigen::Vector3f normal = (normalMatrix * Eigen::Vector3f(objectFace.normal.x, objectFace.normal.y, objectFace.normal.z)).normalized();
+      faces[i].normal = { normal[0], normal[1], normal[2] };
+    }
+  });
+}
+
+static void refitNode(LinearBVH& bvh, int index) {
+
+  LinearNode& node = bvh.nodes[index];
+  Bounds bounds;
+
+  if (node.isLeaf()) {
+    for (int i = node.offset; i < node.offset + node.count; i++) {
+      bounds.grow(bvh.faces[i].vertex1);
+      bounds.grow(bvh.faces[i].vertex2);
+      bounds.grow(bvh.faces[i].vertex3);
+    }
+  }
+  else {
+    bounds = bvh.nodes[index + 1].getBounds();
+    bounds.grow(bvh.nodes[node.offset].getBounds());
+  }
+
+  node.setBounds(bounds);
+}
+
+// In depth first order a subtree is a contiguous range ending at the leaf
+// reached by always taking the second child
+static int subtreeEnd(const LinearBVH& bvh, int index) {
+
+  while (!bvh.nodes[index].isLeaf()) {
+    index = bvh.nodes[index].offset;
+  }
+  return index + 1;
+}
+
+// Children always come after their parent, so walking backwards refits bottom up
+static void refitRange(LinearBVH& bvh, int begin, int end) {
+
+  for (int i = end - 1; i >= begin; i--) {
+    refitNode(bvh, i);
+  }
+}
+
+// Collects the nodes above depth in preorder and the subtrees rooted at depth
+static void cutTopLevels(const LinearBVH& bvh, int index, int depth, int* top, int& topCount, int* roots, int& rootCount) {
+
+  if (depth == 0 || bvh.nodes[index].isLeaf()) {
+    roots[rootCount++] = index;
+    return;
+  }
+
+  top[topCount++] = index;
+  cutTopLevels(bvh, index + 1, depth - 1, top, topCount, roots, rootCount);
+  cutTopLevels(bvh, bvh.nodes[index].offset, depth - 1, top, topCount, roots, rootCount);
+}
+
+void refitBVH(LinearBVH& bvh, ThreadPool& pool) {
+
+  if (bvh.nodes.empty()) {
+    return;
+  }
+
+  int depth = 0;
+  while (depth < REFIT_TASK_DEPTH && (1 << depth) < 4 * pool.size()) {
+    depth++;
+  }
+
+  int top[1 << REFIT_TASK_DEPTH];
+  int roots[1 << REFIT_TASK_DEPTH];
+  int topCount = 0;
+  int rootCount = 0;
+  cutTopLevels(bvh, 0, depth, top, topCount, roots, rootCount);
+
+  TaskGroup subtrees;
+  for (int i = 0; i < rootCount; i++) {
+    int root = roots[i];
+    pool.submit(subtrees, [&bvh, root] { refitRange(bvh, root, subtreeEnd(bvh, root)); });
+  }
+  pool.wait(subtrees);
+
+  for (int i = topCount - 1; i >= 0; i--) {
+    refitNode(bvh, top[i]);
+  }
+}
+
+//===========================================================================
+//============================== Traversal ==================================
+//===========================================================================
+
+bool rayBoxIntersection(const LinearNode& node, vectorThree& origin, vectorThree& dest) {
+
+  rayBoxChecks++;
+  vectorThree max = { node.max[0], node.max[1], node.max[2] };
+  vectorThree min = { node.min[0], node.min[1], node.min[2] };
+
+  vectorThree e = max - min;
+  vectorThree d = dest - origin;
+  vectorThree m = origin + dest - min - max;
+
+  float adx = std::abs(d.x);
+  if (std::abs(m.x) > e.x + adx) {
+    return false;
+  }
+
+  float ady = std::abs(d.y);
+  if (std::abs(m.y) > e.y + ady) {
+    return false;
+  }
+
+  float adz = std::abs(d.z);
+  if (std::abs(m.z) > e.z + adz) {
+    return false;
+  }
+
+  adx += FLT_EPSILON;
+  ady += FLT_EPSILON;
+  adz += FLT_EPSILON;
+
+  if (std::abs(m.y * d.z - m.z * d.y) > e.y* adz + e.z * ady) { return false; }
+  if (std::abs(m.z * d.x - m.x * d.z) > e.x* adz + e.z * adx) { return false; }
+  if (std::abs(m.x * d.y - m.y * d.x) > e.x* ady + e.y * adx) { return false; }
+  rayBoxIntersections++;
+
+  return true;
+}
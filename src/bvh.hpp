@@ -0,0 +1,587 @@
+#ifndef __BVH__
+#define __BVH__
+
+#include "geometry.hpp"
+#include "threadpool.hpp"
+#include <algorithm>
+#include <memory>
+#include <new>
+#include <xmmintrin.h>
+
+extern long long rayTriangleChecks;
+extern long long rayBoxChecks;
+extern long long rayTriangleIntersections;
+extern long long rayBoxIntersections;
+
+enum BuildMode {
+	BUILD_MEDIAN,
+	BUILD_SAH,
+	BUILD_LBVH,
+	BUILD_SBVH
+};
+
+// Maximum faces per leaf for the median split builder
+static const int SPLIT_FACTOR = 10;
+static const BuildMode BUILD_MODE = BUILD_SAH;
+static const bool BUILD_PARALLEL = true;
+// Also builds the serial SAH hierarchy after a parallel build and checks
+// the two are the same tree
+static const bool BUILD_VERIFY = false;
+// Also times the other fast builders on the scene and prints their cost. Off
+// by default, it runs three more builds every time the BVH is built.
+static const bool BUILD_COMPARE = false;
+
+// Binned SAH builder settings, costs are relative to a single ray-box check
+static const int SAH_BINS = 16;
+static const int SAH_MAX_LEAF_SIZE = 32;
+static const float SAH_TRAVERSAL_COST = 1.0f;
+static const float SAH_INTERSECTION_COST = 2.0f;
+
+// Parallel builder settings, ranges above the reduction size reduce bounds and
+// bins in chunks, subtree tasks never get smaller than the minimum task size
+static const int BUILD_PARALLEL_REDUCTION_SIZE = 65536;
+static const int BUILD_PARALLEL_CHUNK_SIZE = 16384;
+static const int BUILD_MIN_TASK_SIZE = 1024;
+
+// Refitting rebuilds once the SAH cost grew by this factor since the last
+// build, the subtrees below the task depth are refitted in parallel
+static const float REFIT_REBUILD_THRESHOLD = 1.5f;
+static const int REFIT_TASK_DEPTH = 6;
+
+// Faces a Mailbox remembers, must be a power of two
+static const int MAILBOX_SIZE = 16;
+
+// Deepest hierarchy the builders create, bounds the traversal stack
+static const int BVH_MAX_DEPTH = 64;
+
+template <typename T, std::size_t Alignment>
+struct AlignedAllocator {
+	typedef T value_type;
+
+	template <typename U>
+	struct rebind { typedef AlignedAllocator<U, Alignment> other; };
+
+	AlignedAllocator(void) {}
+
+	template <typename U>
+	AlignedAllocator(const AlignedAllocator<U, Alignment>&) {}
+
+	T* allocate(std::size_t n) {
+		void* memory = _mm_malloc(n * sizeof(T), Alignment);
+		if (!memory) {
+			throw std::bad_alloc();
+		}
+		return static_cast<T*>(memory);
+	}
+
+	void deallocate(T* memory, std::size_t) { _mm_free(memory); }
+
+	template <typename U>
+	bool operator== (const AlignedAllocator<U, Alignment>&) const { return true; }
+
+	template <typename U>
+	bool operator!= (const AlignedAllocator<U, Alignment>&) const { return false; }
+};
+
+struct Bounds {
+	vectorThree min;
+	vectorThree max;
+
+	Bounds(void) {
+		min = { FLT_MAX, FLT_MAX, FLT_MAX };
+		max = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+	}
+
+	void grow(const vectorThree& point) {
+		min = { std::min(min.x, point.x), std::min(min.y, point.y), std::min(min.z, point.z) };
+		max = { std::max(max.x, point.x), std::max(max.y, point.y), std::max(max.z, point.z) };
+	}
+
+	void grow(const Bounds& other) {
+		min = { std::min(min.x, other.min.x), std::min(min.y, other.min.y), std::min(min.z, other.min.z) };
+		max = { std::max(max.x, other.max.x), std::max(max.y, other.max.y), std::max(max.z, other.max.z) };
+	}
+
+	bool empty() const { return min.x > max.x; }
+
+	float surfaceArea() const {
+		if (empty()) {
+			return 0.0f;
+		}
+		float x = max.x - min.x;
+		float y = max.y - min.y;
+		float z = max.z - min.z;
+		return 2.0f * (x * y + y * z + z * x);
+	}
+
+	int maxAxis() const {
+		float x = max.x - min.x;
+		float y = max.y - min.y;
+		float z = max.z - min.z;
+		if (x > y && x > z) { return 0; }
+		if (y > z) { return 1; }
+		return 2;
+	}
+};
+
+class BoundingBox {
+public:
+	std::vector<face> faces;
+	// index of every face in the builder input, only set by builders that
+	// reference a face from several leaves
+	std::vector<int> faceIds;
+	std::vector<Sphere> spheres;
+	std::vector<BoundingBox> children;
+	float xMax;
+	float xMin;
+	float yMax;
+	float yMin;
+	float zMax;
+	float zMin;
+
+
+	BoundingBox(void) {
+		xMax = -FLT_MAX;
+		xMin = FLT_MAX;
+		yMax = -FLT_MAX;
+		yMin = FLT_MAX;
+		zMax = -FLT_MAX;
+		zMin = FLT_MAX;
+	}
+
+	void addChild(BoundingBox& newchild) { children.push_back(newchild); }
+
+	float getVolume() { return ((xMax - xMin) * (yMax - yMin) * (zMax - zMin)); }
+
+	float getX() { return (xMax - xMin); }
+
+	float getY() { return (yMax - yMin); }
+
+	float getZ() { return (zMax - zMin); }
+
+	float getSurfaceArea() const { return getBounds().surfaceArea(); }
+
+	Bounds getBounds() const {
+		Bounds bounds;
+		bounds.min = { xMin, yMin, zMin };
+		bounds.max = { xMax, yMax, zMax };
+		return bounds;
+	}
+
+	void setBounds(const Bounds& bounds) {
+		xMin = bounds.min.x;
+		yMin = bounds.min.y;
+		zMin = bounds.min.z;
+		xMax = bounds.max.x;
+		yMax = bounds.max.y;
+		zMax = bounds.max.z;
+	}
+
+	Eigen::Vector3f getCenter() { return Eigen::Vector3f(xMin + getX()/2, yMin + getY()/2, zMin + getZ()/2); }
+};
+
+// A node of the flattened hierarchy, stored in depth first order so the first
+// child of an interior node directly follows it
+struct alignas(32) LinearNode {
+	float min[3];
+	float max[3];
+	// second child for interior nodes, first face for leaves
+	int offset;
+	// number of faces, zero for interior nodes
+	int count;
+
+	bool isLeaf() const { return count > 0; }
+
+	Bounds getBounds() const {
+		Bounds bounds;
+		bounds.min = { min[0], min[1], min[2] };
+		bounds.max = { max[0], max[1], max[2] };
+		return bounds;
+	}
+
+	void setBounds(const Bounds& bounds) {
+		min[0] = bounds.min.x;
+		min[1] = bounds.min.y;
+		min[2] = bounds.min.z;
+		max[0] = bounds.max.x;
+		max[1] = bounds.max.y;
+		max[2] = bounds.max.z;
+	}
+};
+
+static_assert(sizeof(LinearNode) == 32, "LinearNode must fill exactly half a cache line");
+
+// An array that either owns its elements or views the elements of a memory
+// mapped BVH cache. Views are copied into owned storage before they grow,
+// element writes go to the private copy-on-write pages of the mapping.
+template <typename T, typename Allocator = std::allocator<T>>
+class BVHArray {
+public:
+
+	BVHArray(void) : mappedData(nullptr), mappedSize(0) {}
+
+	BVHArray(const BVHArray& other) : owned(other.begin(), other.end()), mappedData(nullptr), mappedSize(0) {}
+
+	BVHArray(BVHArray&& other) : owned(std::move(other.owned)), mappedData(other.mappedData), mappedSize(other.mappedSize) {
+		other.mappedData = nullptr;
+		other.mappedSize = 0;
+	}
+
+	BVHArray& operator= (const BVHArray& other) {
+		if (this != &other) {
+			owned.assign(other.begin(), other.end());
+			mappedData = nullptr;
+			mappedSize = 0;
+		}
+		return *this;
+	}
+
+	BVHArray& operator= (BVHArray&& other) {
+		owned = std::move(other.owned);
+		mappedData = other.mappedData;
+		mappedSize = other.mappedSize;
+		other.mappedData = nullptr;
+		other.mappedSize = 0;
+		return *this;
+	}
+
+	/**
+	 * @brief Views count elements at data, which must outlive the array
+	 */
+	void map(T* data, std::size_t count) {
+		owned.clear();
+		mappedData = data;
+		mappedSize = count;
+	}
+
+	bool mapped() const { return mappedData != nullptr; }
+
+	std::size_t size() const { return mappedData ? mappedSize : owned.size(); }
+
+	bool empty() const { return size() == 0; }
+
+	T* data() { return mappedData ? mappedData : owned.data(); }
+
+	const T* data() const { return mappedData ? mappedData : owned.data(); }
+
+	T& operator[] (std::size_t i) { return data()[i]; }
+
+	const T& operator[] (std::size_t i) const { return data()[i]; }
+
+	T* begin() { return data(); }
+
+	T* end() { return data() + size(); }
+
+	const T* begin() const { return data(); }
+
+	const T* end() const { return data() + size(); }
+
+	template <typename... Args>
+	void emplace_back(Args&&... args) {
+		detach();
+		owned.emplace_back(std::forward<Args>(args)...);
+	}
+
+	template <typename Iterator>
+	void append(Iterator first, Iterator last) {
+		detach();
+		owned.insert(owned.end(), first, last);
+	}
+
+	void clear() {
+		owned.clear();
+		mappedData = nullptr;
+		mappedSize = 0;
+	}
+
+private:
+
+	void detach() {
+		if (mappedData) {
+			owned.assign(mappedData, mappedData + mappedSize);
+			mappedData = nullptr;
+			mappedSize = 0;
+		}
+	}
+
+	std::vector<T, Allocator> owned;
+	T* mappedData;
+	std::size_t mappedSize;
+};
+
+class MappedFile;
+
+struct LinearBVH {
+	BVHArray<LinearNode, AlignedAllocator<LinearNode, 32>> nodes;
+	// faces permuted so every leaf references a contiguous range
+	BVHArray<face> faces;
+	// original index of every face, empty unless faces are duplicated
+	BVHArray<int> faceIds;
+	std::vector<Sphere> spheres;
+	// keeps the cache file alive while the arrays view it
+	std::shared_ptr<MappedFile> mapping;
+};
+
+// Remembers the last faces a ray was tested against, so faces referenced from
+// several leaves are only intersected once. Direct mapped, a collision only
+// costs a repeated test.
+struct Mailbox {
+	int ids[MAILBOX_SIZE];
+
+	Mailbox(void) { std::fill(ids, ids + MAILBOX_SIZE, -1); }
+
+	// returns true when the face was already tested
+	bool visited(int id) {
+		int& slot = ids[id & (MAILBOX_SIZE - 1)];
+		if (slot == id) {
+			return true;
+		}
+		slot = id;
+		return false;
+	}
+};
+
+// Reciprocal that stays finite for axis aligned directions
+static inline float safeInverse(float x) {
+
+	if (std::abs(x) < 1e-20f) {
+		return x < 0.0f ? -1e20f : 1e20f;
+	}
+	return 1.0f / x;
+}
+
+// A segment origin + t * dir prepared for slab tests, set up once per ray
+struct Ray {
+	vectorThree origin;
+	vectorThree dir;
+	vectorThree inverse;
+	// 1 where the direction is negative, the segment then enters the slab of
+	// that axis through the max side of a box
+	int sign[3];
+
+	Ray(const vectorThree& origin, const vectorThree& dir) : origin(origin), dir(dir) {
+		inverse = { safeInverse(dir.x), safeInverse(dir.y), safeInverse(dir.z) };
+		sign[0] = inverse.x < 0.0f;
+		sign[1] = inverse.y < 0.0f;
+		sign[2] = inverse.z < 0.0f;
+	}
+};
+
+// Slab test of the segment, t in [0, tMax], against the node without
+// branches. tNear and tFar are set to where the segment enters and leaves the
+// node, the node is hit when tNear <= tFar.
+static inline bool rayBoxEntry(const LinearNode& node, const Ray& ray, float tMax, float& tNear, float& tFar) {
+
+	rayBoxChecks++;
+	const float* slabs[2] = { node.min, node.max };
+
+	float x0 = (slabs[ray.sign[0]][0] - ray.origin.x) * ray.inverse.x;
+	float y0 = (slabs[ray.sign[1]][1] - ray.origin.y) * ray.inverse.y;
+	float z0 = (slabs[ray.sign[2]][2] - ray.origin.z) * ray.inverse.z;
+	float x1 = (slabs[1 - ray.sign[0]][0] - ray.origin.x) * ray.inverse.x;
+	float y1 = (slabs[1 - ray.sign[1]][1] - ray.origin.y) * ray.inverse.y;
+	float z1 = (slabs[1 - ray.sign[2]][2] - ray.origin.z) * ray.inverse.z;
+
+	tNear = std::max(std::max(x0, y0), std::max(z0, 0.0f));
+	tFar = std::min(std::min(x1, y1), std::min(z1, tMax));
+
+	bool hit = tNear <= tFar;
+	rayBoxIntersections += hit;
+	return hit;
+}
+
+/**
+ * @brief Visits the leaves of the flattened hierarchy entered by the segment
+ * origin + t * dir, t in [0, tMax], near to far. intersectLeaf(leaf) is called
+ * for every leaf and may lower tMax, nodes entered beyond it are skipped.
+ */
+template <typename LeafFunction>
+void traverseNearToFar(const LinearBVH& bvh, const vectorThree& origin, const vectorThree& dir, const float& tMax, LeafFunction intersectLeaf) {
+
+	if (bvh.nodes.empty()) {
+		return;
+	}
+
+	Ray ray(origin, dir);
+
+	// every node keeps the distance it was entered at, so it can be dropped
+	// once a closer hit was found
+	struct Entry {
+		int node;
+		float tNear;
+	};
+	Entry stack[BVH_MAX_DEPTH + 1];
+	int stackSize = 0;
+
+	float tRoot, tExit;
+	if (!rayBoxEntry(bvh.nodes[0], ray, tMax, tRoot, tExit)) {
+		return;
+	}
+	stack[stackSize++] = { 0, tRoot };
+
+	while (stackSize > 0) {
+
+		Entry entry = stack[--stackSize];
+		if (entry.tNear > tMax) {
+			continue;
+		}
+
+		const LinearNode& node = bvh.nodes[entry.node];
+		if (node.isLeaf()) {
+			intersectLeaf(entry.node);
+			continue;
+		}
+
+		Entry near = { entry.node + 1, 0.0f };
+		Entry far = { node.offset, 0.0f };
+		bool hitNear = rayBoxEntry(bvh.nodes[near.node], ray, tMax, near.tNear, tExit);
+		bool hitFar = rayBoxEntry(bvh.nodes[far.node], ray, tMax, far.tNear, tExit);
+
+		if (hitNear && hitFar) {
+			if (far.tNear < near.tNear) {
+				std::swap(near, far);
+			}
+			stack[stackSize++] = far;
+			stack[stackSize++] = near;
+		}
+		else if (hitNear) {
+			stack[stackSize++] = near;
+		}
+		else if (hitFar) {
+			stack[stackSize++] = far;
+		}
+	}
+}
+
+/**
+ * @brief Visits the leaves of the flattened hierarchy entered by the segment
+ * origin + t * dir, t in [0, tMax], until intersectLeaf(leaf) returns true.
+ * Any hit ends the query, so instead of near to far the child the segment
+ * spends the longest part in is opened first, it is the most likely to block
+ * it. Returns whether a leaf reported a hit.
+ */
+template <typename LeafFunction>
+bool traverseAnyHit(const LinearBVH& bvh, const vectorThree& origin, const vectorThree& dir, float tMax, LeafFunction intersectLeaf) {
+
+	if (bvh.nodes.empty()) {
+		return false;
+	}
+
+	Ray ray(origin, dir);
+
+	int stack[BVH_MAX_DEPTH + 1];
+	int stackSize = 0;
+
+	float tNear, tFar;
+	if (!rayBoxEntry(bvh.nodes[0], ray, tMax, tNear, tFar)) {
+		return false;
+	}
+	stack[stackSize++] = 0;
+
+	while (stackSize > 0) {
+
+		int index = stack[--stackSize];
+		const LinearNode& node = bvh.nodes[index];
+
+		if (node.isLeaf()) {
+			if (intersectLeaf(index)) {
+				return true;
+			}
+			continue;
+		}
+
+		int first = index + 1;
+		int second = node.offset;
+		float firstNear, firstFar, secondNear, secondFar;
+		bool hitFirst = rayBoxEntry(bvh.nodes[first], ray, tMax, firstNear, firstFar);
+		bool hitSecond = rayBoxEntry(bvh.nodes[second], ray, tMax, secondNear, secondFar);
+
+		if (hitFirst && hitSecond) {
+			if (secondFar - secondNear > firstFar - firstNear) {
+				std::swap(first, second);
+			}
+			stack[stackSize++] = second;
+			stack[stackSize++] = first;
+		}
+		else if (hitFirst) {
+			stack[stackSize++] = first;
+		}
+		else if (hitSecond) {
+			stack[stackSize++] = second;
+		}
+	}
+
+	return false;
+}
+
+/**
+ * @brief Creates a single box enclosing all given faces
+ */
+BoundingBox createBox(const std::vector<face>& mesh);
+
+/**
+ * @brief Recursively splits a box at the median of the longest axis until
+ * a box holds at most faceNum faces
+ */
+BoundingBox splitBox(BoundingBox& rootBox, int faceNum);
+
+/**
+ * @brief Builds a hierarchy with the binned surface area heuristic, leaves are
+ * created wherever splitting is not cheaper than intersecting all faces
+ */
+BoundingBox buildSAH(const std::vector<face>& faces);
+
+/**
+ * @brief Builds exactly the same hierarchy as buildSAH on all threads of the pool
+ * @param utilisation Set to the fraction of the build time the threads were busy
+ */
+BoundingBox buildSAHParallel(const std::vector<face>& faces, ThreadPool& pool, float& utilisation);
+
+/**
+ * @brief Compares bounds, faces and topology of two hierarchies
+ */
+bool sameHierarchy(const BoundingBox& a, const BoundingBox& b);
+
+/**
+ * @brief Builds a hierarchy over the faces with the given builder
+ */
+BoundingBox buildBVH(const std::vector<face>& faces, BuildMode mode);
+
+/**
+ * @brief Expected cost of tracing a random ray through the hierarchy,
+ * relative to a single ray-box check
+ */
+float sahCost(const BoundingBox& root);
+float sahCost(const LinearBVH& bvh);
+
+/**
+ * @brief Compiles a built hierarchy into a single depth first node array
+ */
+LinearBVH flattenBVH(const BoundingBox& root);
+
+/**
+ * @brief Moves the faces of the hierarchy to their object space positions
+ * transformed by the model matrix, objectFaces must be in the order of faces
+ */
+void transformFaces(const face* objectFaces, const Eigen::Affine3f& model, face* faces, int count, ThreadPool& pool);
+
+/**
+ * @brief Recomputes all node bounds bottom up after the faces moved, keeping
+ * the topology. Runs in linear time without allocating.
+ */
+void refitBVH(LinearBVH& bvh, ThreadPool& pool);
+
+/**
+ * @brief Separating axis test of the segment from origin to dest against the
+ * node. Kept as the reference for rayBoxEntry, which traversals use instead.
+ */
+bool rayBoxIntersection(const LinearNode& node, vectorThree& origin, vectorThree& dest);
+
+const char* buildModeName(BuildMode mode);
+
+/**
+ * @brief Face references per face, above one when faces are duplicated
+ */
+float duplicationFactor(const LinearBVH& bvh);
+
+#endif // BVH
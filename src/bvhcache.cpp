@@ -0,0 +1,307 @@
+#include "bvhcache.hpp"
+#include "lbvh.hpp"
+#include "sbvh.hpp"
+#include "treelet.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Sections start on cache line boundaries, which also satisfies LinearNode
+static const std::uint64_t BVH_CACHE_ALIGNMENT = 64;
+
+struct BVHCacheHeader {
+  char magic[8];
+  std::uint32_t version;
+  std::uint32_t nodeSize;
+  std::uint32_t faceSize;
+  std::uint32_t sphereSize;
+  std::uint64_t key;
+  std::uint64_t fileSize;
+  // of everything after the header
+  std::uint64_t checksum;
+  std::uint64_t nodeOffset;
+  std::uint64_t nodeCount;
+  std::uint64_t faceOffset;
+  std::uint64_t faceCount;
+  std::uint64_t faceIdOffset;
+  std::uint64_t faceIdCount;
+  std::uint64_t sphereOffset;
+  std::uint64_t sphereCount;
+};
+
+static const char BVH_CACHE_MAGIC[8] = { 'F', 'L', 'Y', 'B', 'V', 'H', '\0', '\0' };
+
+//===========================================================================
+//============================= Mapped file =================================
+//===========================================================================
+
+std::shared_ptr<MappedFile> MappedFile::open(const std::string& path) {
+
+  std::shared_ptr<MappedFile> file(new MappedFile());
+
+#ifdef _WIN32
+  HANDLE handle = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (handle == INVALID_HANDLE_VALUE) {
+    return nullptr;
+  }
+
+  LARGE_INTEGER size;
+  HANDLE mapping = NULL;
+  if (GetFileSizeEx(handle, &size) && size.QuadPart > 0) {
+    mapping = CreateFileMappingA(handle, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+  }
+  CloseHandle(handle);
+  if (!mapping) {
+    return nullptr;
+  }
+
+  file->memory = static_cast<char*>(MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0));
+  CloseHandle(mapping);
+  if (!file->memory) {
+    return nullptr;
+  }
+  file->length = std::size_t(size.QuadPart);
+#else
+  int descriptor = ::open(path.c_str(), O_RDONLY);
+  if (descriptor < 0) {
+    return nullptr;
+  }
+
+  struct stat status;
+  void* memory = MAP_FAILED;
+  if (fstat(descriptor, &status) == 0 && status.st_size > 0) {
+    memory = mmap(nullptr, std::size_t(status.st_size), PROT_READ | PROT_WRITE, MAP_PRIVATE, descriptor, 0);
+  }
+  close(descriptor);
+  if (memory == MAP_FAILED) {
+    return nullptr;
+  }
+
+  file->memory = static_cast<char*>(memory);
+  file->length = std::size_t(status.st_size);
+#endif
+
+  return file;
+}
+
+MappedFile::~MappedFile() {
+
+  if (!memory) {
+    return;
+  }
+
+#ifdef _WIN32
+  UnmapViewOfFile(memory);
+#else
+  munmap(memory, length);
+#endif
+}
+
+//===========================================================================
+//=============================== Hashing ===================================
+//===========================================================================
+
+static const std::uint64_t FNV_OFFSET = 14695981039346656037ull;
+static const std::uint64_t FNV_PRIME = 1099511628211ull;
+
+static std::uint64_t hashBytes(const char* data, std::size_t size, std::uint64_t hash = FNV_OFFSET) {
+
+  // eight bytes per step, the tail one byte at a time
+  std::size_t words = size / 8;
+  for (std::size_t i = 0; i < words; i++) {
+    std::uint64_t word;
+    std::memcpy(&word, data + i * 8, 8);
+    hash = (hash ^ word) * FNV_PRIME;
+  }
+  for (std::size_t i = words * 8; i < size; i++) {
+    hash = (hash ^ std::uint8_t(data[i])) * FNV_PRIME;
+  }
+  return hash;
+}
+
+template <typename T>
+static std::uint64_t hashValue(const T& value, std::uint64_t hash) {
+  return hashBytes(reinterpret_cast<const char*>(&value), sizeof(T), hash);
+}
+
+static std::uint64_t hashFile(const std::string& path, std::uint64_t hash) {
+
+  std::ifstream in(path, std::ios::binary);
+  char buffer[1 << 16];
+  while (in) {
+    in.read(buffer, sizeof(buffer));
+    hash = hashBytes(buffer, std::size_t(in.gcount()), hash);
+  }
+  return hash;
+}
+
+std::uint64_t bvhCacheKey(const std::string& meshFile, const Eigen::Affine3f& model, BuildMode mode) {
+
+  std::uint64_t hash = hashFile(meshFile, FNV_OFFSET);
+
+  // material ids and cull modes come from the .mtl files, which the importer
+  // resolves relative to the directory of the mesh
+  std::string directory = meshFile.substr(0, meshFile.find_last_of("/\\") + 1);
+  std::ifstream in(meshFile);
+  std::string line;
+  while (std::getline(in, line)) {
+    if (line.compare(0, 7, "mtllib ") == 0) {
+      std::string materialFile = line.substr(7);
+      materialFile.erase(std::remove(materialFile.begin(), materialFile.end(), '\r'), materialFile.end());
+      hash = hashFile(directory + materialFile, hash);
+    }
+  }
+
+  Eigen::Matrix4f matrix = model.matrix();
+  hash = hashBytes(reinterpret_cast<const char*>(matrix.data()), sizeof(float) * 16, hash);
+
+  int settings[] = { int(mode), SPLIT_FACTOR, SAH_BINS, SAH_MAX_LEAF_SIZE, BVH_MAX_DEPTH,
+    LBVH_LEAF_SIZE, LBVH_OPTIMIZE, SBVH_SPATIAL_BINS, BUILD_RESTRUCTURE, TREELET_SIZE, TREELET_PASSES };
+  float costs[] = { SAH_TRAVERSAL_COST, SAH_INTERSECTION_COST, SBVH_OVERLAP_THRESHOLD, SBVH_MAX_DUPLICATION };
+  hash = hashValue(settings, hash);
+  hash = hashValue(costs, hash);
+
+  return hash;
+}
+
+//===========================================================================
+//============================ Loading, saving ==============================
+//===========================================================================
+
+static std::uint64_t alignOffset(std::uint64_t offset) {
+  return (offset + BVH_CACHE_ALIGNMENT - 1) / BVH_CACHE_ALIGNMENT * BVH_CACHE_ALIGNMENT;
+}
+
+static bool sectionFits(std::uint64_t offset, std::uint64_t count, std::uint64_t size, std::uint64_t fileSize) {
+  return offset % BVH_CACHE_ALIGNMENT == 0 && offset <= fileSize && count <= (fileSize - offset) / size;
+}
+
+// Every child and face range must stay inside the arrays, so a corrupt file
+// can never send traversal out of bounds
+static bool validNodes(const LinearNode* nodes, std::uint64_t nodeCount, std::uint64_t faceCount) {
+
+  for (std::uint64_t i = 0; i < nodeCount; i++) {
+    const LinearNode& node = nodes[i];
+    if (node.count < 0 || node.offset < 0) {
+      return false;
+    }
+    if (node.isLeaf() ? std::uint64_t(node.offset) + node.count > faceCount : (node.offset <= i + 1 || std::uint64_t(node.offset) >= nodeCount)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool loadBVHCache(const std::string& path, std::uint64_t key, LinearBVH& bvh) {
+
+  std::shared_ptr<MappedFile> file = MappedFile::open(path);
+  if (!file) {
+    return false;
+  }
+
+  if (file->size() < sizeof(BVHCacheHeader)) {
+    std::cout << "BVH cache " << path << " is truncated, rebuilding" << std::endl;
+    return false;
+  }
+
+  BVHCacheHeader header;
+  std::memcpy(&header, file->data(), sizeof(header));
+
+  if (std::memcmp(header.magic, BVH_CACHE_MAGIC, sizeof(header.magic)) != 0 || header.version != BVH_CACHE_VERSION ||
+    header.nodeSize != sizeof(LinearNode) || header.faceSize != sizeof(face) || header.sphereSize != sizeof(Sphere)) {
+    std::cout << "BVH cache " << path << " has another format, rebuilding" << std::endl;
+    return false;
+  }
+  if (header.key != key) {
+    std::cout << "BVH cache " << path << " is stale, rebuilding" << std::endl;
+    return false;
+  }
+
+  std::uint64_t fileSize = file->size();
+  bool valid = header.fileSize == fileSize &&
+    sectionFits(header.nodeOffset, header.nodeCount, sizeof(LinearNode), fileSize) &&
+    sectionFits(header.faceOffset, header.faceCount, sizeof(face), fileSize) &&
+    sectionFits(header.faceIdOffset, header.faceIdCount, sizeof(int), fileSize) &&
+    sectionFits(header.sphereOffset, header.sphereCount, sizeof(Sphere), fileSize) &&
+    (header.faceIdCount == 0 || header.faceIdCount == header.faceCount);
+
+  LinearNode* nodes = reinterpret_cast<LinearNode*>(file->data() + header.nodeOffset);
+
+  if (valid && BVH_CACHE_VERIFY) {
+    valid = hashBytes(file->data() + sizeof(header), fileSize - sizeof(header)) == header.checksum &&
+      validNodes(nodes, header.nodeCount, header.faceCount);
+  }
+  if (!valid) {
+    std::cout << "BVH cache " << path << " is corrupt, rebuilding" << std::endl;
+    return false;
+  }
+
+  bvh.nodes.map(nodes, header.nodeCount);
+  bvh.faces.map(reinterpret_cast<face*>(file->data() + header.faceOffset), header.faceCount);
+  bvh.faceIds.map(reinterpret_cast<int*>(file->data() + header.faceIdOffset), header.faceIdCount);
+  // the few spheres are copied, Sphere has no default constructor to map into
+  const Sphere* spheres = reinterpret_cast<const Sphere*>(file->data() + header.sphereOffset);
+  bvh.spheres.assign(spheres, spheres + header.sphereCount);
+  bvh.mapping = file;
+  return true;
+}
+
+bool saveBVHCache(const std::string& path, std::uint64_t key, const LinearBVH& bvh) {
+
+  BVHCacheHeader header;
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.magic, BVH_CACHE_MAGIC, sizeof(header.magic));
+  header.version = BVH_CACHE_VERSION;
+  header.nodeSize = sizeof(LinearNode);
+  header.faceSize = sizeof(face);
+  header.sphereSize = sizeof(Sphere);
+  header.key = key;
+
+  header.nodeCount = bvh.nodes.size();
+  header.faceCount = bvh.faces.size();
+  header.faceIdCount = bvh.faceIds.size();
+  header.sphereCount = bvh.spheres.size();
+  header.nodeOffset = alignOffset(sizeof(header));
+  header.faceOffset = alignOffset(header.nodeOffset + header.nodeCount * sizeof(LinearNode));
+  header.faceIdOffset = alignOffset(header.faceOffset + header.faceCount * sizeof(face));
+  header.sphereOffset = alignOffset(header.faceIdOffset + header.faceIdCount * sizeof(int));
+  header.fileSize = header.sphereOffset + header.sphereCount * sizeof(Sphere);
+
+  std::vector<char> contents(header.fileSize, 0);
+  std::memcpy(contents.data() + header.nodeOffset, bvh.nodes.data(), header.nodeCount * sizeof(LinearNode));
+  std::memcpy(contents.data() + header.faceOffset, bvh.faces.data(), header.faceCount * sizeof(face));
+  std::memcpy(contents.data() + header.faceIdOffset, bvh.faceIds.data(), header.faceIdCount * sizeof(int));
+  std::memcpy(contents.data() + header.sphereOffset, bvh.spheres.data(), header.sphereCount * sizeof(Sphere));
+  header.checksum = hashBytes(contents.data() + sizeof(header), contents.size() - sizeof(header));
+  std::memcpy(contents.data(), &header, sizeof(header));
+
+  std::string temporary = path + ".tmp";
+  {
+    std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+    out.write(contents.data(), std::streamsize(contents.size()));
+    if (!out) {
+      std::cout << "Could not write BVH cache " << temporary << std::endl;
+      std::remove(temporary.c_str());
+      return false;
+    }
+  }
+
+  std::remove(path.c_str());
+  if (std::rename(temporary.c_str(), path.c_str()) != 0) {
+    std::cout << "Could not write BVH cache " << path << std::endl;
+    std::remove(temporary.c_str());
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,57 @@
+#ifndef __BVHCACHE__
+#define __BVHCACHE__
+
+#include "bvh.hpp"
+#include <cstdint>
+#include <string>
+
+// Bump whenever the layout of the cache file, LinearNode, face or Sphere changes
+static const std::uint32_t BVH_CACHE_VERSION = 2;
+static const bool BVH_CACHE = true;
+// Checksums the whole file on load, which touches every page of the mapping
+static const bool BVH_CACHE_VERIFY = true;
+
+// A read only file mapped with private copy-on-write pages
+class MappedFile {
+public:
+
+	/**
+	 * @brief Maps the whole file, returns nullptr when it can not be opened
+	 */
+	static std::shared_ptr<MappedFile> open(const std::string& path);
+
+	~MappedFile();
+
+	char* data() { return memory; }
+
+	std::size_t size() const { return length; }
+
+private:
+
+	MappedFile(void) : memory(nullptr), length(0) {}
+
+	char* memory;
+	std::size_t length;
+};
+
+/**
+ * @brief Hash of everything the BVH of a mesh depends on: the contents of the
+ * mesh file and the material files it names, the model matrix and the build
+ * settings
+ */
+std::uint64_t bvhCacheKey(const std::string& meshFile, const Eigen::Affine3f& model, BuildMode mode);
+
+/**
+ * @brief Maps a cache file written by saveBVHCache into the arrays of bvh
+ * without copying. Returns false and leaves bvh untouched when the file is
+ * missing, written for another key or version, or corrupt.
+ */
+bool loadBVHCache(const std::string& path, std::uint64_t key, LinearBVH& bvh);
+
+/**
+ * @brief Writes the nodes, faces and spheres of the hierarchy next to a temporary
+ * name and renames it into place, so readers never see half a file
+ */
+bool saveBVHCache(const std::string& path, std::uint64_t key, const LinearBVH& bvh);
+
+#endif // BVHCACHE
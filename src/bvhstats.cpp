@@ -0,0 +1,235 @@
+#include "bvhstats.hpp"
+#include "lbvh.hpp"
+#include "sbvh.hpp"
+#include "treelet.hpp"
+#include <fstream>
+#include <iostream>
+
+// Bounds::empty only looks at x, an overlap can be empty on any axis
+static bool validBounds(const Bounds& bounds) {
+  return bounds.min.x <= bounds.max.x && bounds.min.y <= bounds.max.y && bounds.min.z <= bounds.max.z;
+}
+
+static float volume(const Bounds& bounds) {
+
+  if (!validBounds(bounds)) {
+    return 0.0f;
+  }
+  return (bounds.max.x - bounds.min.x) * (bounds.max.y - bounds.min.y) * (bounds.max.z - bounds.min.z);
+}
+
+static Bounds overlapOf(const Bounds& a, const Bounds& b) {
+
+  Bounds result;
+  result.min = { std::max(a.min.x, b.min.x), std::max(a.min.y, b.min.y), std::max(a.min.z, b.min.z) };
+  result.max = { std::min(a.max.x, b.max.x), std::min(a.max.y, b.max.y), std::min(a.max.z, b.max.z) };
+  return result;
+}
+
+static void countAt(std::vector<int>& histogram, int index) {
+
+  if (index >= int(histogram.size())) {
+    histogram.resize(index + 1, 0);
+  }
+  histogram[index]++;
+}
+
+//===========================================================================
+//============================== Analysis ===================================
+//===========================================================================
+
+BVHStats analyzeBVH(const LinearBVH& bvh) {
+
+  BVHStats stats;
+  stats.nodes = int(bvh.nodes.size());
+  stats.faceReferences = int(bvh.faces.size());
+  stats.sahCost = sahCost(bvh);
+
+  if (bvh.faceIds.empty()) {
+    stats.faces = stats.faceReferences;
+  }
+  else {
+    std::vector<char> seen;
+    for (int id : bvh.faceIds) {
+      if (id >= int(seen.size())) {
+        seen.resize(id + 1, 0);
+      }
+      stats.faces += !seen[id];
+      seen[id] = 1;
+    }
+  }
+
+  stats.memory.push_back({ "nodes", bvh.nodes.size() * sizeof(LinearNode) });
+  stats.memory.push_back({ "faces", bvh.faces.size() * sizeof(face) });
+  stats.memory.push_back({ "face ids", bvh.faceIds.size() * sizeof(int) });
+
+  if (bvh.nodes.empty()) {
+    return stats;
+  }
+
+  float overlapArea = 0.0f;
+  float emptyVolume = 0.0f;
+  float interiorArea = 0.0f;
+  long long depthSum = 0;
+
+  std::vector<std::pair<int, int>> stack;
+  stack.push_back({ 0, 0 });
+
+  while (!stack.empty()) {
+
+    int index = stack.back().first;
+    int depth = stack.back().second;
+    stack.pop_back();
+
+    const LinearNode& node = bvh.nodes[index];
+
+    if (node.isLeaf()) {
+      stats.leaves++;
+      countAt(stats.leafSizes, node.count);
+      countAt(stats.leafDepths, depth);
+      stats.maxDepth = std::max(stats.maxDepth, depth);
+      depthSum += depth;
+      continue;
+    }
+
+    Bounds bounds = node.getBounds();
+    Bounds left = bvh.nodes[index + 1].getBounds();
+    Bounds right = bvh.nodes[node.offset].getBounds();
+    Bounds overlap = overlapOf(left, right);
+    float area = bounds.surfaceArea();
+
+    // the fraction of the node volume outside both children
+    float nodeVolume = volume(bounds);
+    if (nodeVolume > 0.0f) {
+      float covered = volume(left) + volume(right) - volume(overlap);
+      emptyVolume += area * std::max(0.0f, 1.0f - covered / nodeVolume);
+    }
+    if (validBounds(overlap)) {
+      overlapArea += overlap.surfaceArea();
+    }
+    interiorArea += area;
+
+    stack.push_back({ index + 1, depth + 1 });
+    stack.push_back({ node.offset, depth + 1 });
+  }
+
+  stats.averageLeafDepth = float(depthSum) / stats.leaves;
+  if (interiorArea > 0.0f) {
+    stats.siblingOverlap = overlapArea / interiorArea;
+    stats.emptySpace = emptyVolume / interiorArea;
+  }
+
+  return stats;
+}
+
+//===========================================================================
+//=============================== Output ====================================
+//===========================================================================
+
+static std::size_t totalMemory(const BVHStats& stats) {
+
+  std::size_t total = 0;
+  for (const auto& entry : stats.memory) {
+    total += entry.second;
+  }
+  return total;
+}
+
+void printBVHStats(const BVHStats& stats) {
+
+  std::cout << "============ BVH ANALYSIS ============" << std::endl;
+  std::cout << "Faces: " << stats.faces << " (" << stats.faceReferences << " references)" << std::endl;
+  std::cout << "Nodes: " << stats.nodes << ", leaves: " << stats.leaves << std::endl;
+  std::cout << "SAH cost: " << stats.sahCost << std::endl;
+  std::cout << "Sibling overlap: " << stats.siblingOverlap * 100.0f << " %" << std::endl;
+  std::cout << "Empty space: " << stats.emptySpace * 100.0f << " %" << std::endl;
+  std::cout << "Depth: max " << stats.maxDepth << ", average leaf " << stats.averageLeafDepth << std::endl;
+
+  std::cout << "--------------------------------------" << std::endl;
+  std::cout << "Leaf size : leaves" << std::endl;
+  for (int size = 0; size < stats.leafSizes.size(); size++) {
+    if (stats.leafSizes[size] > 0) {
+      std::cout << "  " << size << " : " << stats.leafSizes[size] << std::endl;
+    }
+  }
+
+  std::cout << "--------------------------------------" << std::endl;
+  std::cout << "Leaf depth : leaves" << std::endl;
+  for (int depth = 0; depth < stats.leafDepths.size(); depth++) {
+    if (stats.leafDepths[depth] > 0) {
+      std::cout << "  " << depth << " : " << stats.leafDepths[depth] << std::endl;
+    }
+  }
+
+  std::cout << "--------------------------------------" << std::endl;
+  for (const auto& entry : stats.memory) {
+    std::cout << "Memory " << entry.first << ": " << entry.second / 1024 << " KB" << std::endl;
+  }
+  std::cout << "Memory total: " << totalMemory(stats) / 1024 << " KB" << std::endl;
+  std::cout << "======================================" << std::endl;
+}
+
+static void writeHistogram(std::ofstream& out, const std::vector<int>& histogram) {
+
+  out << "[";
+  for (int i = 0; i < histogram.size(); i++) {
+    out << (i > 0 ? ", " : "") << histogram[i];
+  }
+  out << "]";
+}
+
+bool writeBVHStats(const std::string& path, const std::string& scene, BuildMode mode, const BVHStats& stats) {
+
+  std::ofstream out(path);
+  if (!out) {
+    std::cout << "Could not write " << path << std::endl;
+    return false;
+  }
+
+  // scene names are plain paths, only quotes and backslashes need escaping
+  std::string escaped;
+  for (char c : scene) {
+    if (c == '"' || c == '\\') {
+      escaped += '\\';
+    }
+    escaped += c;
+  }
+
+  out << "{" << std::endl;
+  out << "  \"scene\": \"" << escaped << "\"," << std::endl;
+  out << "  \"settings\": {" << std::endl;
+  out << "    \"builder\": \"" << buildModeName(mode) << "\"," << std::endl;
+  out << "    \"split_factor\": " << SPLIT_FACTOR << "," << std::endl;
+  out << "    \"sah_bins\": " << SAH_BINS << "," << std::endl;
+  out << "    \"sah_max_leaf_size\": " << SAH_MAX_LEAF_SIZE << "," << std::endl;
+  out << "    \"sah_traversal_cost\": " << SAH_TRAVERSAL_COST << "," << std::endl;
+  out << "    \"sah_intersection_cost\": " << SAH_INTERSECTION_COST << "," << std::endl;
+  out << "    \"lbvh_leaf_size\": " << LBVH_LEAF_SIZE << "," << std::endl;
+  out << "    \"sbvh_max_duplication\": " << SBVH_MAX_DUPLICATION << "," << std::endl;
+  out << "    \"treelet_restructuring\": " << (BUILD_RESTRUCTURE && mode != BUILD_LBVH ? "true" : "false") << std::endl;
+  out << "  }," << std::endl;
+  out << "  \"faces\": " << stats.faces << "," << std::endl;
+  out << "  \"face_references\": " << stats.faceReferences << "," << std::endl;
+  out << "  \"nodes\": " << stats.nodes << "," << std::endl;
+  out << "  \"leaves\": " << stats.leaves << "," << std::endl;
+  out << "  \"sah_cost\": " << stats.sahCost << "," << std::endl;
+  out << "  \"sibling_overlap\": " << stats.siblingOverlap << "," << std::endl;
+  out << "  \"empty_space\": " << stats.emptySpace << "," << std::endl;
+  out << "  \"max_depth\": " << stats.maxDepth << "," << std::endl;
+  out << "  \"average_leaf_depth\": " << stats.averageLeafDepth << "," << std::endl;
+  out << "  \"leaf_size_histogram\": ";
+  writeHistogram(out, stats.leafSizes);
+  out << "," << std::endl;
+  out << "  \"leaf_depth_histogram\": ";
+  writeHistogram(out, stats.leafDepths);
+  out << "," << std::endl;
+  out << "  \"memory_bytes\": {" << std::endl;
+  for (const auto& entry : stats.memory) {
+    out << "    \"" << entry.first << "\": " << entry.second << "," << std::endl;
+  }
+  out << "    \"total\": " << totalMemory(stats) << std::endl;
+  out << "  }" << std::endl;
+  out << "}" << std::endl;
+
+  return bool(out);
+}
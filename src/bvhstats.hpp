@@ -0,0 +1,47 @@
+#ifndef __BVHSTATS__
+#define __BVHSTATS__
+
+#include "bvh.hpp"
+#include <string>
+#include <utility>
+
+// File the analysis is written to, next to the rendered image
+static const char* const BVH_STATS_FILE = "bvh_stats.json";
+
+struct BVHStats {
+	int faces = 0;
+	// faces stored in the leaves, more than faces when leaves share them
+	int faceReferences = 0;
+	int nodes = 0;
+	int leaves = 0;
+	// number of leaves per face count and per depth
+	std::vector<int> leafSizes;
+	std::vector<int> leafDepths;
+	int maxDepth = 0;
+	float averageLeafDepth = 0.0f;
+	float sahCost = 0.0f;
+	// surface area of the overlap of sibling boxes relative to their parent,
+	// weighted by the area of the parents
+	float siblingOverlap = 0.0f;
+	// volume of interior nodes not covered by their children, weighted the
+	// same way
+	float emptySpace = 0.0f;
+	// bytes per component of the acceleration structures
+	std::vector<std::pair<std::string, std::size_t>> memory;
+};
+
+/**
+ * @brief Measures the quality of a flattened hierarchy. The memory of the
+ * binary hierarchy is filled in, other structures can add their own entries.
+ */
+BVHStats analyzeBVH(const LinearBVH& bvh);
+
+void printBVHStats(const BVHStats& stats);
+
+/**
+ * @brief Writes the statistics together with the scene and the build
+ * settings as JSON, so runs with different settings can be compared
+ */
+bool writeBVHStats(const std::string& path, const std::string& scene, BuildMode mode, const BVHStats& stats);
+
+#endif // BVHSTATS
@@ -28,262 +28,329 @@ void printNodes(BoundingBox &currentBox) {
 
 }
 
-BoundingBox createBox(const std::vector<face>& mesh) {
+Eigen::Vector3f noHitMultiplier = { 1, 1, 1 };
 
-  BoundingBox currentBox;
+// Cull mode a material asks for with the end of its name, MTL files have no
+// statement for it
+static CullMode materialCullMode(Tucano::Material::Mtl& material) {
 
-  for (int i = 0; i < mesh.size(); i++) {
+  std::string name = material.getName();
+  auto endsWith = [&name](const std::string& suffix) {
+    return name.size() >= suffix.size() && name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0;
+  };
 
-    face currentFace = mesh[i];
+  if (endsWith("_cullback")) {
+    return CULL_BACK;
+  }
+  if (endsWith("_cullfront")) {
+    return CULL_FRONT;
+  }
+  return DEFAULT_CULL_MODE;
+}
 
-    vectorThree vertex1 = currentFace.vertex1;
-    vectorThree vertex2 = currentFace.vertex2;
-    vectorThree vertex3 = currentFace.vertex3;
+// Builds with the pool wherever the builder supports it, utilisation is only
+// measured by the parallel SAH builder
+static BoundingBox buildWithPool(const std::vector<face>& faces, BuildMode mode, ThreadPool& pool, float& utilisation) {
 
-    currentBox.xMax = std::max(currentBox.xMax, vertex1.x);
-    currentBox.xMax = std::max(currentBox.xMax, vertex2.x);
-    currentBox.xMax = std::max(currentBox.xMax, vertex3.x);
+  utilisation = -1.0f;
 
-    currentBox.xMin = std::min(currentBox.xMin, vertex1.x);
-    currentBox.xMin = std::min(currentBox.xMin, vertex2.x);
-    currentBox.xMin = std::min(currentBox.xMin, vertex3.x);
+  if (mode == BUILD_SAH && BUILD_PARALLEL) {
+    return buildSAHParallel(faces, pool, utilisation);
+  }
+  if (mode == BUILD_LBVH) {
+    return buildLBVH(faces, pool, LBVH_OPTIMIZE);
+  }
+  return buildBVH(faces, mode);
+}
 
-    currentBox.yMax = std::max(currentBox.yMax, vertex1.y);
-    currentBox.yMax = std::max(currentBox.yMax, vertex2.y);
-    currentBox.yMax = std::max(currentBox.yMax, vertex3.y);
+// Prints build time and expected trace cost of the fast builders side by side
+static void compareBuilders(const std::vector<face>& faces, ThreadPool& pool) {
 
-    currentBox.yMin = std::min(currentBox.yMin, vertex1.y);
-    currentBox.yMin = std::min(currentBox.yMin, vertex2.y);
-    currentBox.yMin = std::min(currentBox.yMin, vertex3.y);
+  const char* names[] = { "binned SAH", "LBVH", "LBVH + treelets" };
 
-    currentBox.zMax = std::max(currentBox.zMax, vertex1.z);
-    currentBox.zMax = std::max(currentBox.zMax, vertex2.z);
-    currentBox.zMax = std::max(currentBox.zMax, vertex3.z);
+  for (int i = 0; i < 3; i++) {
 
-    currentBox.zMin = std::min(currentBox.zMin, vertex1.z);
-    currentBox.zMin = std::min(currentBox.zMin, vertex2.z);
-    currentBox.zMin = std::min(currentBox.zMin, vertex3.z);
+    float utilisation;
+    auto t1 = std::chrono::high_resolution_clock::now();
+    BoundingBox root = i == 0 ? buildSAHParallel(faces, pool, utilisation) : buildLBVH(faces, pool, i == 2);
+    auto t2 = std::chrono::high_resolution_clock::now();
 
-    currentBox.faces.push_back(currentFace);
+    std::cout << "  " << names[i] << ": " << std::chrono::duration_cast<std::chrono::microseconds>( t2 - t1 ).count()/1000.0
+      << " ms, SAH cost " << sahCost(root) << std::endl;
   }
-
-  //std::cout << currentBox.xMin << " " <<  currentBox.xMin << " " << currentBox.yMin << " " << currentBox.yMax << " " << currentBox.zMin << " " << currentBox.zMax << std::endl;
-  return currentBox;
 }
 
-Eigen::Vector3f noHitMultiplier = { 1, 1, 1 };
+// Node memory of a hierarchy, also per face so meshes compare
+static void printNodeMemory(const char* name, std::size_t nodes, std::size_t nodeSize, std::size_t faces) {
 
-bool sorterX(face i, face j) {
-  return i.vertex1.x < j.vertex1.x;
+  std::cout << name << " nodes: " << nodes << " (" << nodes * nodeSize / 1024 << " KB, "
+    << (faces > 0 ? float(nodes * nodeSize) / faces : 0.0f) << " bytes per face)" << std::endl;
 }
 
-bool sorterY(face i, face j) {
-  return i.vertex1.y < j.vertex1.y;
-}
+// End points of TRAVERSAL_COMPARE_RAYS random segments through the bounds of
+// the mesh, the same ones on every call
+static std::vector<vectorThree> randomSegments(const LinearBVH& bvh) {
 
-bool sorterZ(face i, face j) {
-  return i.vertex1.z < j.vertex1.z;
-}
+  Bounds bounds = bvh.nodes[0].getBounds();
+  std::mt19937 generator(1);
+  std::uniform_real_distribution<float> unit(0.0f, 1.0f);
 
-BoundingBox splitBox(BoundingBox& rootBox, int faceNum) {
+  std::vector<vectorThree> points(2 * TRAVERSAL_COMPARE_RAYS);
+  for (vectorThree& point : points) {
+    point.x = bounds.min.x + unit(generator) * (bounds.max.x - bounds.min.x);
+    point.y = bounds.min.y + unit(generator) * (bounds.max.y - bounds.min.y);
+    point.z = bounds.min.z + unit(generator) * (bounds.max.z - bounds.min.z);
+  }
+  return points;
+}
 
-  std::vector<face> faces = rootBox.faces;
+// Times collecting the leaves hit by random segments through the bounds of
+// the mesh, with full precision and with quantized child bounds
+static void compareTraversal(const LinearBVH& bvh, const BVH4& bvh4, const QBVH4& qbvh4) {
 
+  if (bvh.nodes.empty()) {
+    return;
+  }
 
-  if (faces.size() > faceNum) {
+  std::vector<vectorThree> points = randomSegments(bvh);
 
-    float x = rootBox.getX();
-    float y = rootBox.getY();
-    float z = rootBox.getZ();
+  // the kernels count their box tests, which belong to the render statistics
+  long long boxChecks = rayBoxChecks;
+  long long boxIntersections = rayBoxIntersections;
 
-    std::size_t const half_size = faces.size() / 2;
-    std::size_t const third_size = faces.size() / 3;
-    std::size_t const two_third_size = 2 * faces.size() / 3;
+  const char* names[] = { "BVH4", "quantized BVH4" };
+  double raysPerSecond[2];
+  std::vector<int> leaves;
 
-    if(x > y && x > z) {
-      
-      std::sort(faces.begin(), faces.end(), sorterX);
-    } 
-    else if(y > x && y > z) {
+  std::cout << "Traversal of " << TRAVERSAL_COMPARE_RAYS << " random segments:" << std::endl;
+  for (int kernel = 0; kernel < 2; kernel++) {
 
-      std::sort(faces.begin(), faces.end(), sorterY);
-    }
-    else {
+    long long leafCount = 0;
+    long long checks = rayBoxChecks;
 
-      std::sort(faces.begin(), faces.end(), sorterZ);
+    auto t1 = std::chrono::high_resolution_clock::now();
+    for (int i = 0; i < TRAVERSAL_COMPARE_RAYS; i++) {
+      leaves.clear();
+      if (kernel == 0) {
+        intersectingChildren4(bvh4, points[2 * i], points[2 * i + 1], leaves);
+      }
+      else {
+        intersectingChildrenQ4(qbvh4, points[2 * i], points[2 * i + 1], leaves);
+      }
+      leafCount += leaves.size();
     }
+    auto t2 = std::chrono::high_resolution_clock::now();
 
-    
-    std::vector<face> split_first_left(faces.begin(), faces.begin() + third_size);
-    std::vector<face> split_first_right(faces.begin() + third_size, faces.end());
-
-    std::vector<face> split_second_left(faces.begin(), faces.begin() + half_size);
-    std::vector<face> split_second_right(faces.begin() + half_size, faces.end());
-
-    std::vector<face> split_third_left(faces.begin(), faces.begin() + two_third_size);
-    std::vector<face> split_third_right(faces.begin() + two_third_size, faces.end());
-
-
-    float first_cost = 1 + 1.0f/3.0f * split_first_left.size() * 2 + 2.0f/3.0f * split_first_right.size() * 2;
-    float second_cost = 1 + 1.0f/2.0f * split_second_left.size() * 2 + 1.0f/2.0f * split_second_right.size() * 2;
-    float third_cost = 1 + 2.0f/3.0f * split_third_left.size() * 2 + 1.0f/3.0f * split_third_right.size() * 2;
-
-    BoundingBox lo_split;
-    BoundingBox hi_split;
-
-    if(first_cost > second_cost && first_cost > third_cost) {
-
-      lo_split = createBox(split_first_left);
-      hi_split = createBox(split_first_right);
-    } 
-    else if(second_cost > first_cost && second_cost > third_cost) {
+    double seconds = std::chrono::duration_cast<std::chrono::microseconds>( t2 - t1 ).count() / 1000000.0;
+    raysPerSecond[kernel] = seconds > 0.0 ? TRAVERSAL_COMPARE_RAYS / seconds : 0.0;
 
-      lo_split = createBox(split_second_left);
-      hi_split = createBox(split_second_right);
-    }
-    else {
+    std::cout << "  " << names[kernel] << ": " << raysPerSecond[kernel] / 1000000.0 << " Mrays/s, "
+      << float(rayBoxChecks - checks) / TRAVERSAL_COMPARE_RAYS << " box tests and "
+      << float(leafCount) / TRAVERSAL_COMPARE_RAYS << " leaves per ray" << std::endl;
+  }
 
-      lo_split = createBox(split_third_left);
-      hi_split = createBox(split_third_right);
-    }
+  if (raysPerSecond[0] > 0.0) {
+    std::cout << "  quantized speed: " << (raysPerSecond[1] / raysPerSecond[0] - 1.0) * 100.0 << " %" << std::endl;
+  }
 
+  rayBoxChecks = boxChecks;
+  rayBoxIntersections = boxIntersections;
+}
 
-    BoundingBox first_box = splitBox(lo_split, faceNum);
-    BoundingBox second_box = splitBox(hi_split, faceNum);
+// Nodes every random segment is tested against when comparing box tests
+static const int BOX_COMPARE_NODES = 8;
 
-    rootBox.addChild(first_box);
-    rootBox.addChild(second_box);
+// Times the separating axis test against the slab test on random segments
+// and nodes of the binary hierarchy, and counts the boxes they disagree on
+static void compareBoxTests(const LinearBVH& bvh) {
 
+  if (bvh.nodes.empty()) {
+    return;
   }
 
-  return rootBox;
-}
+  std::vector<vectorThree> points = randomSegments(bvh);
 
-bool rayBoxIntersection(const BoundingBox &box, vectorThree& origin, vectorThree& dest) {
+  long long boxChecks = rayBoxChecks;
+  long long boxIntersections = rayBoxIntersections;
 
-  rayBoxChecks++;
-  vectorThree max = { box.xMax, box.yMax, box.zMax };
-  vectorThree min = { box.xMin, box.yMin, box.zMin };
+  int nodeCount = int(bvh.nodes.size());
+  auto nodeOf = [nodeCount](int segment, int k) {
+    return (segment + k * (nodeCount / BOX_COMPARE_NODES + 1)) % nodeCount;
+  };
 
-  vectorThree e = max - min;
-  vectorThree d = dest - origin;
-  vectorThree m = origin + dest - min - max;
+  std::vector<char> separating(TRAVERSAL_COMPARE_RAYS * BOX_COMPARE_NODES);
+  std::vector<char> slab(TRAVERSAL_COMPARE_RAYS * BOX_COMPARE_NODES);
 
-  float adx = abs(d.x);
-  if (abs(m.x) > e.x + adx) {
-    return false;
+  auto t1 = std::chrono::high_resolution_clock::now();
+  for (int i = 0; i < TRAVERSAL_COMPARE_RAYS; i++) {
+    for (int k = 0; k < BOX_COMPARE_NODES; k++) {
+      separating[i * BOX_COMPARE_NODES + k] = rayBoxIntersection(bvh.nodes[nodeOf(i, k)], points[2 * i], points[2 * i + 1]);
+    }
   }
-
-  float ady = abs(d.y);
-  if (abs(m.y) > e.y + ady) {
-    return false;
+  auto t2 = std::chrono::high_resolution_clock::now();
+  for (int i = 0; i < TRAVERSAL_COMPARE_RAYS; i++) {
+    Ray ray(points[2 * i], points[2 * i + 1] - points[2 * i]);
+    float tNear, tFar;
+    for (int k = 0; k < BOX_COMPARE_NODES; k++) {
+      slab[i * BOX_COMPARE_NODES + k] = rayBoxEntry(bvh.nodes[nodeOf(i, k)], ray, 1.0f, tNear, tFar);
+    }
   }
+  auto t3 = std::chrono::high_resolution_clock::now();
 
-  float adz = abs(d.z);
-  if (abs(m.z) > e.z + adz) {
-    return false;
+  int hits = 0;
+  int disagreements = 0;
+  for (int i = 0; i < separating.size(); i++) {
+    hits += separating[i];
+    disagreements += separating[i] != slab[i];
   }
 
-  adx += FLT_EPSILON;
-  ady += FLT_EPSILON;
-  adz += FLT_EPSILON;
-
-  if (abs(m.y * d.z - m.z * d.y) > e.y* adz + e.z * ady) { return false; }
-  if (abs(m.z * d.x - m.x * d.z) > e.x* adz + e.z * adx) { return false; }
-  if (abs(m.x * d.y - m.y * d.x) > e.x* ady + e.y * adx) { return false; }
-  rayBoxIntersections++;
+  double tests = double(separating.size());
+  std::cout << "Box tests of " << TRAVERSAL_COMPARE_RAYS << " random segments against " << BOX_COMPARE_NODES << " nodes each:" << std::endl;
+  std::cout << "  separating axis: " << std::chrono::duration_cast<std::chrono::nanoseconds>( t2 - t1 ).count() / tests << " ns per test" << std::endl;
+  std::cout << "  slab: " << std::chrono::duration_cast<std::chrono::nanoseconds>( t3 - t2 ).count() / tests
+    << " ns per test, including the ray setup" << std::endl;
+  std::cout << "  " << hits << " hits, " << disagreements << " disagreements" << std::endl;
 
-  return true;
+  rayBoxChecks = boxChecks;
+  rayBoxIntersections = boxIntersections;
 }
 
-bool checkFront(vectorThree origin, vectorThree dest, vectorThree point) {
-	vectorThree frontCheck = point - origin;
-	vectorThree direction = dest - origin;
-	
-	if (!((direction.x < 0.000001 && frontCheck.x < 0.000001) || (direction.x > 0.000001 && frontCheck.x > 0.000001) || (direction.x == 0 && frontCheck.x == 0))) {
-		return false;
-	}
-	if (!((direction.y < 0.000001 && frontCheck.y < 0.000001) || (direction.y > 0.000001 && frontCheck.y > 0.000001) || (direction.y == 0 && frontCheck.y == 0))) {
-		return false;
-	}
-	if (!((direction.z < 0.000001 && frontCheck.z < 0.000001) || (direction.z > 0.000001 && frontCheck.z > 0.000001) || (direction.z == 0 && frontCheck.z == 0))) {
-		return false;
-	}
+// Times the scalar and the SIMD triangle kernels on segments from random
+// points of the bounds through random points on the faces of leaves, and
+// counts the hits the SIMD kernels report differently from the scalar one
+static void compareTriangleKernels(const LinearBVH& bvh, const TriangleLeaves& triangles) {
 
-	return true;
-}
+  LeafSegments segments = leafSegments(bvh, TRAVERSAL_COMPARE_RAYS, false);
+  if (segments.leaves.empty()) {
+    return;
+  }
 
-bool rayTriangleIntersection(vectorThree& origin, vectorThree& dest, const face& currentFace, vectorThree& point, bool side) {
+  long long triangleChecks = rayTriangleChecks;
+  long long triangleIntersections = rayTriangleIntersections;
 
-	rayTriangleChecks++;
-	vectorThree uvw = { 0.0 , 0.0, 0.0 };
-	vectorThree v0;
-	vectorThree v1;
-	vectorThree v2;
-	v0 = currentFace.vertex1;
-	v1 = currentFace.vertex2;
-	v2 = currentFace.vertex3;
+  double tests = double(segments.leaves.size());
+  std::cout << "Triangle kernels on " << segments.leaves.size() << " random segments aimed at the faces of their leaves:" << std::endl;
 
-	vectorThree dir = dest - origin;
-	vectorThree originTov0 = v0 - origin;
-	vectorThree originTov1 = v1 - origin;
-	vectorThree originTov2 = v2 - origin;
+  std::vector<RayHit> reference;
+  for (int kernel = TRIANGLE_KERNEL_SCALAR; kernel <= bestTriangleKernel(); kernel++) {
 
-	vectorThree h = dir.cross(v2 - v0);
-	float a = (v1 - v0).dot(h);
+    auto t1 = std::chrono::high_resolution_clock::now();
+    std::vector<RayHit> hits = closestInLeaves(bvh, triangles, segments, TriangleKernel(kernel));
+    auto t2 = std::chrono::high_resolution_clock::now();
 
-	if (a > -FLT_EPSILON && a < FLT_EPSILON) {
-		return false;
-	}
+    if (reference.empty()) {
+      reference = hits;
+    }
 
+    int hitCount = 0;
+    int disagreements = 0;
+    for (int j = 0; j < hits.size(); j++) {
+      hitCount += hits[j].face >= 0;
+      disagreements += !sameHit(hits[j], reference[j]);
+    }
 
-	uvw.x = dir.scalarTripleProduct(originTov2, originTov1);
-	if (uvw.x < 0.0) { return false; }
+    std::cout << "  " << triangleKernelName(TriangleKernel(kernel)) << ": "
+      << std::chrono::duration_cast<std::chrono::nanoseconds>( t2 - t1 ).count() / tests << " ns per leaf, "
+      << hitCount << " hits, " << disagreements << " disagreements" << std::endl;
+  }
 
-	uvw.y = dir.scalarTripleProduct(originTov0, originTov2);
-	if (uvw.y < 0.0) { return false; }
+  rayTriangleChecks = triangleChecks;
+  rayTriangleIntersections = triangleIntersections;
+}
 
-	uvw.z = dir.scalarTripleProduct(originTov1, originTov0);
-	if (uvw.z < 0.0) { return false; }
+// Times closest hits and occlusion queries of random segments on the binary
+// hierarchy, traversed with a stack and through the stackless links, and on
+// the kd-tree and the grid
+static void compareClosestHits(const LinearBVH& bvh, const StacklessLinks& stackless, const TriangleLeaves& triangles, const KdTree& kdtree,
+  const HierarchicalGrid& grid) {
 
-	float denom = 1.0 / (uvw.x + uvw.y + uvw.z);
-	uvw.x *= denom;
-	uvw.y *= denom;
-	uvw.z *= denom;
+  if (bvh.nodes.empty()) {
+    return;
+  }
 
-	point = ((v0 * uvw.x) + (v1 * uvw.y) + (v2 * uvw.z));
+  std::vector<vectorThree> points = randomSegments(bvh);
 
-	
+  long long counters[] = { rayBoxChecks, rayBoxIntersections, rayTriangleChecks, rayTriangleIntersections };
 
-	if (!checkFront(origin, dest, point)) {
-		return false;
-	}
-	
-	rayTriangleIntersections++;
-	//point = point + currentFace.normal * 0.00001;
-	return true;
-}
+  const char* names[] = { "BVH stack", "BVH stackless", "kd-tree", "grid" };
+  bool built[] = { true, true, !kdtree.nodes.empty(), !grid.top.cellStart.empty() };
+  double raysPerSecond[4];
 
-void intersectingChildren(const BoundingBox& currentBox, vectorThree& origin, vectorThree& dest, vector<face>& checkFaces) {
+  std::cout << "Closest hits and occlusion of " << TRAVERSAL_COMPARE_RAYS << " random segments:" << std::endl;
+  for (int kernel = 0; kernel < 4; kernel++) {
 
-  if (currentBox.children.size() == 0) {
+    if (!built[kernel]) {
+      continue;
+    }
 
-    checkFaces.insert(checkFaces.end(), currentBox.faces.begin(), currentBox.faces.end());
-  }
+    long long checks = rayTriangleChecks;
+    int hits = 0;
+    int occluded = 0;
+
+    auto t1 = std::chrono::high_resolution_clock::now();
+    for (int i = 0; i < TRAVERSAL_COMPARE_RAYS; i++) {
+      vectorThree dir = points[2 * i + 1] - points[2 * i];
+      RayHit hit;
+      if (kernel == 0) {
+        closestHit(bvh, triangles, points[2 * i], dir, 0.0f, hit);
+      }
+      else if (kernel == 1) {
+        closestHitStackless(bvh, stackless, triangles, points[2 * i], dir, 0.0f, hit);
+      }
+      else if (kernel == 2) {
+        closestHitKd(kdtree, points[2 * i], dir, 0.0f, hit);
+      }
+      else {
+        closestHitGrid(grid, points[2 * i], dir, 0.0f, hit);
+      }
+      hits += hit.face >= 0;
+    }
+    auto t2 = std::chrono::high_resolution_clock::now();
+    for (int i = 0; i < TRAVERSAL_COMPARE_RAYS; i++) {
+      vectorThree dir = points[2 * i + 1] - points[2 * i];
+      if (kernel == 0) {
+        occluded += anyHit(bvh, triangles, points[2 * i], dir, 0.0f, 1.0f);
+      }
+      else if (kernel == 1) {
+        occluded += anyHitStackless(bvh, stackless, triangles, points[2 * i], dir, 0.0f, 1.0f);
+      }
+      else if (kernel == 2) {
+        occluded += anyHitKd(kdtree, points[2 * i], dir, 0.0f, 1.0f);
+      }
+      else {
+        occluded += anyHitGrid(grid, points[2 * i], dir, 0.0f, 1.0f);
+      }
+    }
+    auto t3 = std::chrono::high_resolution_clock::now();
+
+    double seconds = std::chrono::duration_cast<std::chrono::microseconds>( t2 - t1 ).count() / 1000000.0;
+    double occlusionSeconds = std::chrono::duration_cast<std::chrono::microseconds>( t3 - t2 ).count() / 1000000.0;
+    raysPerSecond[kernel] = seconds > 0.0 ? TRAVERSAL_COMPARE_RAYS / seconds : 0.0;
 
-  for (const BoundingBox& child : currentBox.children) {
+    std::cout << "  " << names[kernel] << ": " << raysPerSecond[kernel] / 1000000.0 << " Mrays/s closest ("
+      << hits << " hits), " << (occlusionSeconds > 0.0 ? TRAVERSAL_COMPARE_RAYS / occlusionSeconds / 1000000.0 : 0.0)
+      << " Mrays/s occlusion (" << occluded << " occluded), "
+      << float(rayTriangleChecks - checks) / TRAVERSAL_COMPARE_RAYS << " triangle tests per ray" << std::endl;
+  }
 
-    if (rayBoxIntersection(child, origin, dest)) {
-      intersectingChildren(child, origin, dest, checkFaces);
+  if (raysPerSecond[0] > 0.0) {
+    std::cout << "  stackless speed: " << (raysPerSecond[1] / raysPerSecond[0] - 1.0) * 100.0 << " %, traversal state "
+      << sizeof(int) * 2 << " instead of " << (BVH_MAX_DEPTH + 1) * (sizeof(int) + sizeof(float)) << " bytes" << std::endl;
+    for (int kernel = 2; kernel < 4; kernel++) {
+      if (built[kernel]) {
+        std::cout << "  " << names[kernel] << " speed: " << (raysPerSecond[kernel] / raysPerSecond[0] - 1.0) * 100.0 << " %" << std::endl;
+      }
     }
   }
 
+  rayBoxChecks = counters[0];
+  rayBoxIntersections = counters[1];
+  rayTriangleChecks = counters[2];
+  rayTriangleIntersections = counters[3];
 }
 
-std::vector<BoundingBox> createBoundingBoxes(Tucano::Mesh& mesh) {
-
-  std::cout << "Creating bounding boxes...\r";
-  std::cout.flush();
+// Faces of the mesh with its shape and model matrix applied
+std::vector<face> meshFaces(Tucano::Mesh& mesh) {
 
   std::vector<face> myMesh;
 
@@ -307,19 +374,62 @@ std::vector<BoundingBox> createBoundingBoxes(Tucano::Mesh& mesh) {
     myMesh.push_back(currentFace);
 
   }
+  return myMesh;
+}
 
-  std::vector<BoundingBox> boxes;
+LinearBVH createBoundingBoxes(Tucano::Mesh& mesh, ThreadPool& pool, BuildMode mode) {
+
+  std::cout << "Creating bounding boxes...\r";
+  std::cout.flush();
+
+  std::vector<face> myMesh = meshFaces(mesh);
+
+  float utilisation;
 
-  BoundingBox currentBox = createBox(myMesh);
-  splitBox(currentBox, SPLIT_FACTOR);
+  auto t1 = std::chrono::high_resolution_clock::now();
+  BoundingBox currentBox = buildWithPool(myMesh, mode, pool, utilisation);
+  auto t2 = std::chrono::high_resolution_clock::now();
+
+  if (BUILD_VERIFY && mode == BUILD_SAH && BUILD_PARALLEL) {
+    bool same = sameHierarchy(currentBox, buildSAH(myMesh));
+    std::cout << "Parallel BVH matches serial BVH: " << (same ? "yes" : "NO") << std::endl;
+  }
+
+  float restructureBefore = 0.0f;
+  auto t3 = t2;
+  bool restructure = BUILD_RESTRUCTURE && mode != BUILD_LBVH;
+  if (restructure) {
+    restructureBefore = sahCost(currentBox);
+    restructureTreelets(currentBox, pool);
+    t3 = std::chrono::high_resolution_clock::now();
+  }
 
   //vectorThree sphereCenter = {1.0, 1.0, 1.0};
   //Sphere sphere(0.5, sphereCenter, 0);
   //currentBox.spheres.push_back(sphere);
   //printNodes(currentBox);
-  boxes.push_back(currentBox);
+  LinearBVH bvh = flattenBVH(currentBox);
   std::cout << "Creating bounding boxes... DONE" << std::endl;
-  return boxes;
+  std::cout << "BVH builder: " << buildModeName(mode) << std::endl;
+  std::cout << "BVH build time: " << std::chrono::duration_cast<std::chrono::milliseconds>( t2 - t1 ).count()/1000.0 << " seconds";
+  if (utilisation >= 0.0f) {
+    std::cout << " on " << pool.size() << " threads, utilisation " << utilisation * 100.0f << " %";
+  }
+  std::cout << std::endl;
+  printNodeMemory("BVH", bvh.nodes.size(), sizeof(LinearNode), myMesh.size());
+  if (restructure) {
+    std::cout << "BVH treelet restructuring: " << std::chrono::duration_cast<std::chrono::microseconds>( t3 - t2 ).count()/1000.0
+      << " ms, SAH cost " << restructureBefore << " -> " << sahCost(bvh) << std::endl;
+  }
+  std::cout << "BVH SAH cost: " << sahCost(bvh) << std::endl;
+  if (!bvh.faceIds.empty()) {
+    std::cout << "BVH face references: " << bvh.faces.size() << " (duplication factor " << duplicationFactor(bvh) << ")" << std::endl;
+  }
+  if (BUILD_COMPARE) {
+    std::cout << "BVH builders on " << myMesh.size() << " faces:" << std::endl;
+    compareBuilders(myMesh, pool);
+  }
+  return bvh;
 }
 
 //===========================================================================
@@ -560,13 +670,19 @@ void Flyscene::initialize(int width, int height) {
   flycamera.setViewport(Eigen::Vector2f((float)width, (float)height));
 
   // load the OBJ file and materials
-  Tucano::MeshImporter::loadObjFile(mesh, materials,
-									"resources/models/colorSceneV2.obj");
+  meshFile = "resources/models/colorSceneV2.obj";
+  Tucano::MeshImporter::loadObjFile(mesh, materials, meshFile);
+  cullModes.clear();
+  for (Tucano::Material::Mtl& material : materials) {
+    cullModes.push_back(materialCullMode(material));
+  }
 
 
   // normalize the model (scale to unit cube and center at origin)
   mesh.normalizeModelMatrix();
-  boxes = createBoundingBoxes(mesh);
+  buildAccelerationStructures(meshFile);
+  traversal = bestTraversalMode();
+  std::cout << "Traversal: " << traversalModeName(traversal) << std::endl;
 
   // pass all the materials to the Phong Shader
   for (int i = 0; i < materials.size(); ++i)
@@ -604,6 +720,242 @@ void Flyscene::initialize(int width, int height) {
 
 }
 
+void Flyscene::buildAccelerationStructures(const std::string& meshFile)
+{
+	if (BVH_CACHE && !meshFile.empty()) {
+
+		std::string cacheFile = meshFile + ".bvh";
+		std::uint64_t key = bvhCacheKey(meshFile, mesh.getShapeModelMatrix(), BUILD_MODE);
+
+		auto t1 = std::chrono::high_resolution_clock::now();
+		bool cached = loadBVHCache(cacheFile, key, bvh);
+		auto t2 = std::chrono::high_resolution_clock::now();
+
+		if (cached) {
+			std::cout << "BVH loaded from " << cacheFile << " in " << std::chrono::duration_cast<std::chrono::microseconds>( t2 - t1 ).count()/1000.0
+				<< " ms (" << bvh.nodes.size() << " nodes, " << bvh.faces.size() << " faces mapped)" << endl;
+		}
+		else {
+			bvh = createBoundingBoxes(mesh, pool, BUILD_MODE);
+			saveBVHCache(cacheFile, key, bvh);
+		}
+	}
+	else {
+		bvh = createBoundingBoxes(mesh, pool, BUILD_MODE);
+	}
+
+	bvhBuildCost = sahCost(bvh);
+
+	// keep the faces in object space so refitting never accumulates errors
+	objectFaces.resize(bvh.faces.size());
+	transformFaces(bvh.faces.data(), mesh.getShapeModelMatrix().inverse(), objectFaces.data(), int(objectFaces.size()), pool);
+
+	triangles = buildTriangleLeaves(bvh);
+	stackless = buildStacklessLinks(bvh);
+	// the kd-tree and the grid are only built once they are traversed
+	kdtreeStale = true;
+	gridStale = true;
+	updateCullModes();
+	spheres = buildSphereBVH(bvh.spheres);
+
+	bvh4 = collapseBVH4(bvh);
+	printNodeMemory("BVH4", bvh4.nodes.size(), sizeof(BVH4Node), objectFaces.size());
+	if (cpuSupportsAVX2()) {
+		bvh8 = collapseBVH8(bvh);
+		printNodeMemory("BVH8", bvh8.nodes.size(), sizeof(BVH8Node), objectFaces.size());
+	}
+	if (BUILD_QUANTIZED) {
+		qbvh4 = quantizeBVH4(bvh4);
+		printNodeMemory("Quantized BVH4", qbvh4.nodes.size(), sizeof(QuantizedNode4), objectFaces.size());
+		if (TRAVERSAL_COMPARE) {
+			compareTraversal(bvh, bvh4, qbvh4);
+		}
+	}
+	if (TRAVERSAL_COMPARE) {
+		rebuildKdTree();
+		rebuildGrid();
+		compareBoxTests(bvh);
+		compareTriangleKernels(bvh, triangles);
+		compareClosestHits(bvh, stackless, triangles, kdtree, grid);
+	}
+	if (SPHERE_BENCHMARK) {
+		benchmarkSpheres();
+	}
+}
+
+void Flyscene::rebuildKdTree(void)
+{
+	if (!BUILD_KDTREE || !kdtreeStale) {
+		return;
+	}
+
+	auto t1 = std::chrono::high_resolution_clock::now();
+	kdtree = buildKdTree(bvh.faces.data(), int(bvh.faces.size()));
+	auto t2 = std::chrono::high_resolution_clock::now();
+
+	std::cout << "kd-tree build time: " << std::chrono::duration_cast<std::chrono::microseconds>( t2 - t1 ).count()/1000.0 << " ms, "
+		<< kdtree.nodes.size() << " nodes, depth " << kdTreeDepth(kdtree) << ", "
+		<< float(kdtree.blocks.size() * TRIANGLE_BLOCK_SIZE) / std::max<std::size_t>(bvh.faces.size(), 1) << " block lanes per face" << endl;
+
+	applyCullModes(kdtree.blocks, bvh.faces.data(), cullModes);
+	kdtreeStale = false;
+}
+
+void Flyscene::rebuildGrid(void)
+{
+	if (!BUILD_GRID || !gridStale) {
+		return;
+	}
+
+	auto t1 = std::chrono::high_resolution_clock::now();
+	grid = buildHierarchicalGrid(bvh.faces.data(), int(bvh.faces.size()), pool);
+	auto t2 = std::chrono::high_resolution_clock::now();
+
+	std::cout << "Grid build time: " << std::chrono::duration_cast<std::chrono::microseconds>( t2 - t1 ).count()/1000.0 << " ms, "
+		<< grid.top.resolution[0] << "x" << grid.top.resolution[1] << "x" << grid.top.resolution[2] << " cells, "
+		<< grid.subgrids.size() << " subgrids, "
+		<< float(gridReferenceCount(grid)) / std::max<std::size_t>(bvh.faces.size(), 1) << " references per face" << endl;
+
+	applyCullModes(grid.faces, bvh.faces.data(), cullModes);
+	gridStale = false;
+}
+
+void Flyscene::updateCullModes(void)
+{
+	applyCullModes(triangles.blocks, bvh.faces.data(), cullModes);
+	if (!kdtreeStale) {
+		applyCullModes(kdtree.blocks, bvh.faces.data(), cullModes);
+	}
+	if (!gridStale) {
+		applyCullModes(grid.faces, bvh.faces.data(), cullModes);
+	}
+	setInstanceCullModes(scene, cullModes);
+}
+
+void Flyscene::setCullMode(int material, CullMode mode)
+{
+	if (material < 0 || material >= int(cullModes.size())) {
+		return;
+	}
+	cullModes[material] = mode;
+	updateCullModes();
+}
+
+void Flyscene::cycleCullModes(void)
+{
+	CullMode mode = cullModes.empty() || cullModes[0] == CULL_FRONT ? CULL_NONE : CullMode(cullModes[0] + 1);
+	for (int i = 0; i < int(cullModes.size()); i++) {
+		cullModes[i] = mode;
+	}
+	updateCullModes();
+	std::cout << "Culling: " << cullModeName(mode) << endl;
+}
+
+void Flyscene::refitAccelerationStructures(void)
+{
+	auto t1 = std::chrono::high_resolution_clock::now();
+	transformFaces(objectFaces.data(), mesh.getShapeModelMatrix(), bvh.faces.data(), int(objectFaces.size()), pool);
+	refitBVH(bvh, pool);
+	auto t2 = std::chrono::high_resolution_clock::now();
+
+	float cost = sahCost(bvh);
+	std::cout << "BVH refit time: " << std::chrono::duration_cast<std::chrono::microseconds>( t2 - t1 ).count()/1000.0 << " ms, SAH cost "
+		<< bvhBuildCost << " -> " << cost << endl;
+
+	if (cost > REFIT_REBUILD_THRESHOLD * bvhBuildCost) {
+		std::cout << "SAH cost grew by more than " << REFIT_REBUILD_THRESHOLD << "x, rebuilding" << endl;
+		buildAccelerationStructures();
+		return;
+	}
+
+	// the leaves keep their faces, only the vertices in the blocks move
+	refitTriangleBlocks(triangles.blocks, bvh.faces.data());
+	refitStacklessLinks(stackless, bvh);
+	// kd-trees split space instead of faces and cannot be refitted, the next
+	// trace with the kd-tree builds it again. The grid is rebuilt the same way.
+	kdtreeStale = true;
+	gridStale = true;
+	refitBVH4(bvh4, bvh);
+	if (cpuSupportsAVX2()) {
+		refitBVH8(bvh8, bvh);
+	}
+	// the frames of the nodes move with the bounds, so quantize again
+	if (BUILD_QUANTIZED) {
+		requantizeBVH4(qbvh4, bvh4);
+	}
+}
+
+void Flyscene::prepareTraversal(void)
+{
+	if (traversal == TRAVERSAL_KDTREE) {
+		rebuildKdTree();
+	}
+	if (traversal == TRAVERSAL_GRID) {
+		rebuildGrid();
+	}
+	prepareMeshes(scene, traversal, pool);
+}
+
+void Flyscene::spinMesh(void)
+{
+	mesh.modelMatrix()->rotate(Eigen::AngleAxisf(float(M_PI) / 12.0f, Eigen::Vector3f::UnitY()));
+	refitAccelerationStructures();
+}
+
+void Flyscene::addMeshInstance(void)
+{
+	// the mesh is shared by all copies, only the top level is rebuilt per copy
+	if (scene.meshes.empty()) {
+		addMesh(scene, meshFaces(mesh));
+	}
+
+	Eigen::Vector3f center = flycamera.getCenter();
+	Eigen::Vector2f viewport = flycamera.getViewportSize().cast<float>();
+	Eigen::Vector3f forward = (flycamera.screenToWorld(viewport / 2.0f) - center).normalized();
+
+	Eigen::Affine3f transform = Eigen::Affine3f::Identity();
+	transform.translate(center + forward * 2.0f);
+
+	int material = materials.empty() ? -1 : int(scene.instances.size() % materials.size());
+	addInstance(scene, 0, transform, material);
+
+	auto t1 = std::chrono::high_resolution_clock::now();
+	buildTopLevel(scene);
+	auto t2 = std::chrono::high_resolution_clock::now();
+
+	std::cout << "Instances: " << scene.instances.size() << ", top level rebuilt in "
+		<< std::chrono::duration_cast<std::chrono::microseconds>( t2 - t1 ).count()/1000.0 << " ms ("
+		<< scene.top.nodes.size() << " nodes), shared mesh BVH "
+		<< scene.meshes[0].bvh.nodes.size() * sizeof(LinearNode) / 1024 << " KB" << endl;
+}
+
+void Flyscene::reportBVH(void)
+{
+	BVHStats stats = analyzeBVH(bvh);
+	stats.memory.push_back({ "bvh4 nodes", bvh4.nodes.size() * sizeof(BVH4Node) });
+	stats.memory.push_back({ "bvh8 nodes", bvh8.nodes.size() * sizeof(BVH8Node) });
+	stats.memory.push_back({ "quantized bvh4 nodes", qbvh4.nodes.size() * sizeof(QuantizedNode4) });
+	stats.memory.push_back({ "triangle blocks", triangles.blocks.size() * sizeof(TriangleBlock) });
+	stats.memory.push_back({ "stackless links", stackless.parents.size() * sizeof(int) + stackless.order.size() });
+	stats.memory.push_back({ "kd-tree nodes", kdtree.nodes.size() * sizeof(KdNode) });
+	stats.memory.push_back({ "kd-tree triangle blocks", kdtree.blocks.size() * sizeof(TriangleBlock) });
+	std::size_t gridCells = grid.top.cellStart.size() + grid.subgridOf.size();
+	for (const Grid& subgrid : grid.subgrids) {
+		gridCells += subgrid.cellStart.size();
+	}
+	stats.memory.push_back({ "grid cells", gridCells * sizeof(int) });
+	stats.memory.push_back({ "grid references", gridReferenceCount(grid) * sizeof(int) });
+	stats.memory.push_back({ "grid triangle blocks", grid.faces.size() * sizeof(TriangleBlock) });
+	stats.memory.push_back({ "sphere nodes", spheres.tree.nodes.size() * sizeof(LinearNode) });
+	stats.memory.push_back({ "sphere blocks", spheres.blocks.size() * sizeof(SphereBlock) });
+	stats.memory.push_back({ "object space faces", objectFaces.size() * sizeof(face) });
+
+	printBVHStats(stats);
+	if (writeBVHStats(BVH_STATS_FILE, meshFile, BUILD_MODE, stats)) {
+		std::cout << "BVH analysis written to " << BVH_STATS_FILE << endl;
+	}
+}
+
 void Flyscene::changeObject(void)
 {
 	lights.clear();
@@ -656,6 +1008,33 @@ void Flyscene::shiftBgroundblack(void)
 	std::cout << "Current Color: Black" << endl;
 }
 
+void Flyscene::cycleTraversal(void)
+{
+	if (traversal == TRAVERSAL_BINARY) {
+		traversal = TRAVERSAL_BVH4;
+	}
+	else if (traversal == TRAVERSAL_BVH4 && BUILD_QUANTIZED) {
+		traversal = TRAVERSAL_QBVH4;
+	}
+	else if ((traversal == TRAVERSAL_BVH4 || traversal == TRAVERSAL_QBVH4) && cpuSupportsAVX2()) {
+		traversal = TRAVERSAL_BVH8;
+	}
+	else if (traversal != TRAVERSAL_STACKLESS && traversal != TRAVERSAL_KDTREE && traversal != TRAVERSAL_GRID) {
+		traversal = TRAVERSAL_STACKLESS;
+	}
+	else if (traversal == TRAVERSAL_STACKLESS && BUILD_KDTREE) {
+		traversal = TRAVERSAL_KDTREE;
+	}
+	else if (traversal != TRAVERSAL_GRID && BUILD_GRID) {
+		traversal = TRAVERSAL_GRID;
+	}
+	else {
+		traversal = TRAVERSAL_BINARY;
+	}
+	std::cout << "Traversal: " << traversalModeName(traversal) << endl;
+	prepareTraversal();
+}
+
 void Flyscene::printInformationDebug(int ray) {
 	std::cout << std::endl;
 	std::cout << "================================ RAY INFORMATION ================================" << std::endl;
@@ -748,13 +1127,14 @@ void Flyscene::createDebugRay(const Eigen::Vector2f& mouse_pos) {
 	vectorThree myOrigin = vectorThree::toVectorThree(flycamera.getCenter());
 	vectorThree myDestination = vectorThree::toVectorThree(screen_pos);
 	
-	traceDebugRay(myOrigin, myDestination, boxes, 0);
+	prepareTraversal();
+	traceDebugRay(myOrigin, myDestination, bvh, 0);
 	
 	camerarep.resetModelMatrix();
 	camerarep.setModelMatrix(flycamera.getViewMatrix().inverse());
 }
 
-void Flyscene::traceDebugRay(vectorThree& origin, vectorThree& dest, std::vector<BoundingBox>& boxes, int bounces) {	
+void Flyscene::traceDebugRay(vectorThree& origin, vectorThree& dest, LinearBVH& bvh, int bounces) {	
 	if (bounces >= MAX_BOUNCES) {
 		return;
 	}
@@ -766,7 +1146,7 @@ void Flyscene::traceDebugRay(vectorThree& origin, vectorThree& dest, std::vector
 	debugRay.resetModelMatrix();
 
 	//Trace where new ray hits a point and set origin and direction
-	Triangle tracedRay = traceRay(origin, dest, boxes);
+	Triangle tracedRay = traceRay(origin, dest, bvh);
 	debugRay.setOriginOrientation(origin.toEigenThree(), dir.toEigenThree());
 
 	//Store origin and destination
@@ -782,7 +1162,7 @@ void Flyscene::traceDebugRay(vectorThree& origin, vectorThree& dest, std::vector
 		reflectColor = NO_HIT_COLOR.cwiseProduct(noHitMultiplier);
 	}
 	else {
-		reflectColor = traceRay(origin, dest, boxes, bounces);
+		reflectColor = traceRay(origin, dest, bvh, bounces);
 		rayLength = (tracedRay.hitPoint - origin).length();
 	}
 	
@@ -810,10 +1190,97 @@ void Flyscene::traceDebugRay(vectorThree& origin, vectorThree& dest, std::vector
 	vectorThree reflect = calcReflection(tracedRay.hitPoint, origin, tracedRay.hitFace);
 
 	//Make next debugray
-	traceDebugRay(tracedRay.hitPoint, reflect, boxes, bounces + 1);
+	traceDebugRay(tracedRay.hitPoint, reflect, bvh, bounces + 1);
+}
+
+// Sets up the packet for the tile of the image with its top left pixel at
+// (x, y), row by row, leaving out pixels beyond the image. dirOf(i, j) is the
+// direction of the camera ray through pixel (i, j).
+template <typename DirFunction>
+static void fillPacket(RayPacket& packet, int x, int y, int width, int height, DirFunction dirOf) {
+
+  packet.count = 0;
+  for (int j = y; j < std::min(y + PACKET_WIDTH, height); j++) {
+    for (int i = x; i < std::min(x + PACKET_WIDTH, width); i++) {
+
+      vectorThree dir = dirOf(i, j);
+      int r = packet.count++;
+      packet.dx[r] = dir.x;
+      packet.dy[r] = dir.y;
+      packet.dz[r] = dir.z;
+      packet.tMin[r] = 0.0001f / dir.length();
+      packet.hits[r] = RayHit();
+    }
+  }
+}
+
+// Times the first hits of the camera rays of a width x height image traced
+// one by one and in packets, and counts the rays they disagree on. dirs holds
+// the directions of the rays row by row.
+static void comparePrimaryRays(const LinearBVH& bvh, const TriangleLeaves& triangles, const vectorThree& origin,
+  const std::vector<vectorThree>& dirs, int width, int height) {
+
+  long long boxChecks = rayBoxChecks;
+  long long boxIntersections = rayBoxIntersections;
+  long long triangleChecks = rayTriangleChecks;
+  long long triangleIntersections = rayTriangleIntersections;
+
+  std::vector<RayHit> single(dirs.size());
+  std::vector<RayHit> packed(dirs.size());
+
+  auto t1 = std::chrono::high_resolution_clock::now();
+  for (int k = 0; k < dirs.size(); k++) {
+    vectorThree dir = dirs[k];
+    closestHit(bvh, triangles, origin, dir, 0.0001f / dir.length(), single[k]);
+  }
+  auto t2 = std::chrono::high_resolution_clock::now();
+
+  RayPacket packet;
+  packet.origin = origin;
+  PacketStats stats;
+  auto dirOf = [&dirs, width](int i, int j) { return dirs[j * width + i]; };
+
+  auto t3 = std::chrono::high_resolution_clock::now();
+  for (int y = 0; y < height; y += PACKET_WIDTH) {
+    for (int x = 0; x < width; x += PACKET_WIDTH) {
+
+      fillPacket(packet, x, y, width, height, dirOf);
+      closestHitPacket(bvh, triangles, packet, stats);
+
+      int r = 0;
+      for (int j = y; j < std::min(y + PACKET_WIDTH, height); j++) {
+        for (int i = x; i < std::min(x + PACKET_WIDTH, width); i++) {
+          packed[j * width + i] = packet.hits[r++];
+        }
+      }
+    }
+  }
+  auto t4 = std::chrono::high_resolution_clock::now();
+
+  int hits = 0;
+  int disagreements = 0;
+  for (int k = 0; k < dirs.size(); k++) {
+    hits += single[k].face >= 0;
+    disagreements += single[k].face != packed[k].face || single[k].t != packed[k].t;
+  }
+
+  double singleSeconds = std::chrono::duration_cast<std::chrono::microseconds>( t2 - t1 ).count() / 1000000.0;
+  double packetSeconds = std::chrono::duration_cast<std::chrono::microseconds>( t4 - t3 ).count() / 1000000.0;
+  std::cout << "First hits of " << width << "x" << height << " camera rays (" << hits << " hits):" << std::endl;
+  std::cout << "  single rays: " << (singleSeconds > 0.0 ? dirs.size() / singleSeconds / 1000000.0 : 0.0) << " Mrays/s" << std::endl;
+  std::cout << "  " << PACKET_WIDTH << "x" << PACKET_WIDTH << " packets: " << (packetSeconds > 0.0 ? dirs.size() / packetSeconds / 1000000.0 : 0.0)
+    << " Mrays/s, " << stats.mixedSigns << " of " << stats.packets << " packets traced alone and " << stats.diverged
+    << " diverged, " << disagreements << " disagreements" << std::endl;
+
+  rayBoxChecks = boxChecks;
+  rayBoxIntersections = boxIntersections;
+  rayTriangleChecks = triangleChecks;
+  rayTriangleIntersections = triangleIntersections;
 }
 
 void Flyscene::raytraceScene(int width, int height) {
+  prepareTraversal();
+
   auto t1 = std::chrono::high_resolution_clock::now();
   std::cout << "Ray tracing..." << std::endl;
 
@@ -845,6 +1312,65 @@ void Flyscene::raytraceScene(int width, int height) {
 
   vectorThree myOrigin = vectorThree::toVectorThree(origin);
 
+  if (PACKET_BENCHMARK && TRACE_PACKETS) {
+    std::vector<vectorThree> dirs(PACKET_BENCHMARK_WIDTH * PACKET_BENCHMARK_HEIGHT);
+    for (int j = 0; j < PACKET_BENCHMARK_HEIGHT; j++) {
+      for (int i = 0; i < PACKET_BENCHMARK_WIDTH; i++) {
+        Eigen::Vector2f pixel(i * float(image_size[0]) / PACKET_BENCHMARK_WIDTH, j * float(image_size[1]) / PACKET_BENCHMARK_HEIGHT);
+        dirs[j * PACKET_BENCHMARK_WIDTH + i] = (vectorThree::toVectorThree(flycamera.screenToWorld(pixel)) - myOrigin) * 5.0f;
+      }
+    }
+    comparePrimaryRays(bvh, triangles, myOrigin, dirs, PACKET_BENCHMARK_WIDTH, PACKET_BENCHMARK_HEIGHT);
+  }
+
+  // camera rays of neighbouring pixels take the same way through the
+  // hierarchy, so their closest hits are found a packet at a time
+  PacketStats packetStats;
+  StreamStats streamStats;
+  if (streamSecondary) {
+
+    // batches of whole packet rows, shaded in the same order as below
+    int rows = std::max(PACKET_WIDTH, STREAM_BATCH_PIXELS / std::max(image_size[0], 1) / PACKET_WIDTH * PACKET_WIDTH);
+    for (int y = 0; y < image_size[1]; y += rows) {
+
+      load_progress = std::min(y + rows, image_size[1]);
+      printProgressBar(load_progress, image_size[1]);
+      traceStreamed(image_size, y, std::min(y + rows, image_size[1]), myOrigin, pixel_data, packetStats, streamStats);
+    }
+  }
+  else if (TRACE_PACKETS) {
+
+    RayPacket packet;
+    packet.origin = myOrigin;
+    auto dirOf = [this, &myOrigin](int i, int j) {
+      return (vectorThree::toVectorThree(flycamera.screenToWorld(Eigen::Vector2f(i, j))) - myOrigin) * 5.0f;
+    };
+
+    for (int y = 0; y < image_size[1]; y += PACKET_WIDTH) {
+
+      load_progress = std::min(y + PACKET_WIDTH, image_size[1]);
+      printProgressBar(load_progress, image_size[1]);
+
+      for (int x = 0; x < image_size[0]; x += PACKET_WIDTH) {
+
+        fillPacket(packet, x, y, image_size[0], image_size[1], dirOf);
+        closestHitPacket(bvh, triangles, packet, packetStats);
+
+        int r = 0;
+        for (int j = y; j < std::min(y + PACKET_WIDTH, image_size[1]); j++) {
+          for (int i = x; i < std::min(x + PACKET_WIDTH, image_size[0]); i++) {
+
+            vectorThree rayDirection = packet.dir(r);
+            vectorThree dest = rayDirection + myOrigin;
+            Triangle tracedRay = completeHit(myOrigin, rayDirection, packet.hits[r++]);
+            pixel_data[i][j] = shadeRay(myOrigin, dest, tracedRay, bvh, 0);
+          }
+        }
+      }
+    }
+  }
+  else {
+
  //for every pixel shoot a ray from the origin through the pixel coords
 #define N 10
 #pragma omp parallel 
@@ -870,10 +1396,11 @@ void Flyscene::raytraceScene(int width, int height) {
 		myScreen_coords.y = coords[1];
 		myScreen_coords.z = coords[2];
 
-		pixel_data[i][j] = traceRay(myOrigin, myScreen_coords, boxes, 0);
+		pixel_data[i][j] = traceRay(myOrigin, myScreen_coords, bvh, 0);
 		
     }
   }
+  }
   std::cout << std::endl;
   auto t2 = std::chrono::high_resolution_clock::now();
 
@@ -881,7 +1408,37 @@ void Flyscene::raytraceScene(int width, int height) {
   std::cout << "Resolution: " << image_size[0] << "x" << image_size[1] << std::endl;
   std::cout << "Number of ray reflections: " << MAX_BOUNCES << std::endl;
   std::cout << "Soft shadow precision: " << SOFT_SHADOW_PRECISION << std::endl;
-  std::cout << "Faces per bounding box: " << SPLIT_FACTOR << std::endl;
+  std::cout << "BVH builder: " << buildModeName(BUILD_MODE) << std::endl;
+  if (BUILD_MODE == BUILD_MEDIAN) {
+    std::cout << "Faces per bounding box: " << SPLIT_FACTOR << std::endl;
+  }
+  std::cout << "BVH SAH cost: " << sahCost(bvh) << std::endl;
+  std::cout << "Traversal: " << traversalModeName(traversal) << std::endl;
+  if (TRACE_PACKETS) {
+    std::cout << "Camera rays: " << PACKET_WIDTH << "x" << PACKET_WIDTH << " packets, " << traversalModeName(TRAVERSAL_BINARY) << " traversal, "
+      << packetStats.mixedSigns << " of " << packetStats.packets << " traced alone, " << packetStats.diverged << " diverged" << std::endl;
+  }
+  else {
+    std::cout << "Camera rays: one by one, " << traversalModeName(traversal) << " traversal" << std::endl;
+  }
+  if (streamSecondary) {
+    std::cout << "Secondary rays: sorted streams" << std::endl;
+    std::cout << "Reflection rays: " << streamStats.reflectionRays << ", "
+      << (streamStats.reflectionSeconds > 0.0 ? streamStats.reflectionRays / streamStats.reflectionSeconds / 1000000.0 : 0.0) << " Mrays/s" << std::endl;
+    std::cout << "Shadow rays: " << streamStats.shadowRays << ", "
+      << (streamStats.shadowSeconds > 0.0 ? streamStats.shadowRays / streamStats.shadowSeconds / 1000000.0 : 0.0) << " Mrays/s" << std::endl;
+    if (STREAM_COMPARE) {
+      std::cout << "Unsorted reflection rays: "
+        << (streamStats.unsortedReflectionSeconds > 0.0 ? streamStats.reflectionRays / streamStats.unsortedReflectionSeconds / 1000000.0 : 0.0)
+        << " Mrays/s" << std::endl;
+      std::cout << "Unsorted shadow rays: "
+        << (streamStats.unsortedShadowSeconds > 0.0 ? streamStats.shadowRays / streamStats.unsortedShadowSeconds / 1000000.0 : 0.0)
+        << " Mrays/s" << std::endl;
+    }
+  }
+  else {
+    std::cout << "Secondary rays: immediate" << std::endl;
+  }
   std::cout << "----------------------------------" << std::endl;
   std::cout << "Ray-triangle checks: " << rayTriangleChecks << std::endl;
   std::cout << "Ray-triangle intersections: " << rayTriangleIntersections << std::endl;
@@ -889,6 +1446,7 @@ void Flyscene::raytraceScene(int width, int height) {
   std::cout << "Ray-box checks: " << rayBoxChecks << std::endl;
   std::cout << "Ray-box intersections: " << rayBoxIntersections << std::endl;
   std::cout << "Ray-box efficiency: " << round(float(rayBoxIntersections)/float(rayBoxChecks) * 100) << " %" << std::endl;
+  std::cout << "Ray-box checks per pixel: " << rayBoxChecks / (image_size[0] * image_size[1]) << std::endl;
   std::cout << "----------------------------------" << std::endl;
   std::cout << "Total checks: " << rayBoxChecks + rayTriangleChecks << std::endl;
   std::cout << "Total intersections: " << rayBoxIntersections + rayTriangleIntersections << std::endl;
@@ -903,21 +1461,201 @@ void Flyscene::raytraceScene(int width, int height) {
 }
 
 
-Eigen::Vector3f Flyscene::calColor(std::vector<face> hitFace, vectorThree hitPoint, std::vector<BoundingBox>& boxes, Eigen::Vector3f reflectColor) {
-	Eigen::Vector3f color = { 0.0, 0.0, 0.0 };
+void Flyscene::traceStreamed(const Eigen::Vector2i& image_size, int y0, int y1, vectorThree origin,
+  vector<vector<Eigen::Vector3f>>& pixel_data, PacketStats& packetStats, StreamStats& streamStats) {
 
-	int matId = hitFace[0].material_id;
-	Tucano::Material::Mtl mat = materials[matId];
-	vectorThree shadowLight;
+  int width = image_size[0];
+  StreamedPaths paths;
+  paths.pixels = width * (y1 - y0);
+  paths.hits.assign(MAX_BOUNCES + 1, std::vector<Triangle>(paths.pixels, Triangle(vectorThree(), {})));
+  paths.origins.assign(MAX_BOUNCES + 1, std::vector<vectorThree>(paths.pixels, origin));
+  paths.unoccluded.assign((MAX_BOUNCES + 1) * paths.pixels, 0);
+
+  // pixels in the order immediate tracing shades them, which the stars of
+  // the background depend on
+  std::vector<int> shadeOrder;
+  shadeOrder.reserve(paths.pixels);
+
+  auto dirOf = [this, &origin](int i, int j) {
+    return (vectorThree::toVectorThree(flycamera.screenToWorld(Eigen::Vector2f(i, j))) - origin) * 5.0f;
+  };
+
+  if (TRACE_PACKETS) {
+
+    RayPacket packet;
+    packet.origin = origin;
+    for (int y = y0; y < y1; y += PACKET_WIDTH) {
+      for (int x = 0; x < width; x += PACKET_WIDTH) {
+
+        fillPacket(packet, x, y, width, y1, dirOf);
+        closestHitPacket(bvh, triangles, packet, packetStats);
+
+        int r = 0;
+        for (int j = y; j < std::min(y + PACKET_WIDTH, y1); j++) {
+          for (int i = x; i < std::min(x + PACKET_WIDTH, width); i++) {
+            int pixel = (j - y0) * width + i;
+            paths.hits[0][pixel] = completeHit(origin, packet.dir(r), packet.hits[r]);
+            shadeOrder.push_back(pixel);
+            r++;
+          }
+        }
+      }
+    }
+  }
+  else {
+    for (int j = y0; j < y1; j++) {
+      for (int i = 0; i < width; i++) {
+        int pixel = (j - y0) * width + i;
+        vectorThree screen = vectorThree::toVectorThree(flycamera.screenToWorld(Eigen::Vector2f(i, j)));
+        paths.hits[0][pixel] = traceRay(origin, screen, bvh);
+        shadeOrder.push_back(pixel);
+      }
+    }
+  }
+
+  Bounds bounds = bvh.nodes.empty() ? Bounds() : bvh.nodes[0].getBounds();
+  RayStream stream;
+  std::vector<int> owner;
+
+  // traces the rays of the stream after sorting them, and in the order they
+  // were added in once more for the comparison. traceOne(slot, ray) traces the
+  // ray in the given slot of the stream, which was added as the given ray.
+  auto traceStream = [&](std::function<void(int, int)> traceOne, double& seconds, double& unsortedSeconds) {
+
+    if (STREAM_COMPARE) {
+      long long boxChecks = rayBoxChecks;
+      long long boxIntersections = rayBoxIntersections;
+      long long triangleChecks = rayTriangleChecks;
+      long long triangleIntersections = rayTriangleIntersections;
+
+      auto t1 = std::chrono::high_resolution_clock::now();
+      for (int k = 0; k < stream.size(); k++) {
+        traceOne(k, k);
+      }
+      auto t2 = std::chrono::high_resolution_clock::now();
+      unsortedSeconds += std::chrono::duration_cast<std::chrono::microseconds>( t2 - t1 ).count() / 1000000.0;
+
+      rayBoxChecks = boxChecks;
+      rayBoxIntersections = boxIntersections;
+      rayTriangleChecks = triangleChecks;
+      rayTriangleIntersections = triangleIntersections;
+    }
+
+    auto t1 = std::chrono::high_resolution_clock::now();
+    sortRayStream(stream, bounds);
+    for (int k = 0; k < stream.size(); k++) {
+      traceOne(k, stream.order[k]);
+    }
+    auto t2 = std::chrono::high_resolution_clock::now();
+    seconds += std::chrono::duration_cast<std::chrono::microseconds>( t2 - t1 ).count() / 1000000.0;
+  };
+
+  // every bounce reflects the paths that hit something on the last one
+  for (int bounce = 1; bounce <= MAX_BOUNCES; bounce++) {
+
+    stream.clear();
+    owner.clear();
+    for (int pixel = 0; pixel < paths.pixels; pixel++) {
+      const Triangle& hit = paths.hits[bounce - 1][pixel];
+      if (!hit.hitFace.empty()) {
+        stream.add(hit.hitPoint, calcReflection(hit.hitPoint, paths.origins[bounce - 1][pixel], hit.hitFace));
+        owner.push_back(pixel);
+      }
+    }
+    if (stream.size() == 0) {
+      break;
+    }
+
+    std::vector<Triangle> traced(stream.size(), Triangle(vectorThree(), {}));
+    traceStream([&](int slot, int ray) { traced[ray] = traceRay(stream.origins[slot], stream.targets[slot], bvh); },
+      streamStats.reflectionSeconds, streamStats.unsortedReflectionSeconds);
+    streamStats.reflectionRays += stream.size();
+
+    for (int k = 0; k < stream.size(); k++) {
+      paths.hits[bounce][owner[stream.order[k]]] = traced[stream.order[k]];
+      paths.origins[bounce][owner[stream.order[k]]] = stream.origins[k];
+    }
+  }
+
+  // the shadow rays of every hit of every path go into one stream
+  stream.clear();
+  owner.clear();
+  for (int bounce = 0; bounce <= MAX_BOUNCES; bounce++) {
+    for (int pixel = 0; pixel < paths.pixels; pixel++) {
+
+      const Triangle& hit = paths.hits[bounce][pixel];
+      if (hit.hitFace.empty()) {
+        continue;
+      }
+
+      vectorThree hitPointBias;
+      std::vector<vectorThree> pointsOnDisks;
+      shadowRays(hit.hitFace[0], hit.hitPoint, hitPointBias, pointsOnDisks);
+      for (const vectorThree& pointOndisk : pointsOnDisks) {
+        stream.add(hitPointBias, pointOndisk);
+        owner.push_back(bounce * paths.pixels + pixel);
+      }
+    }
+  }
+
+  std::vector<char> blocked(stream.size());
+  traceStream([&](int slot, int ray) { blocked[ray] = occluded(stream.origins[slot], stream.targets[slot]); },
+    streamStats.shadowSeconds, streamStats.unsortedShadowSeconds);
+  streamStats.shadowRays += stream.size();
+
+  for (int k = 0; k < stream.size(); k++) {
+    paths.unoccluded[owner[k]] += !blocked[k];
+  }
+
+  for (int pixel : shadeOrder) {
+    pixel_data[pixel % width][y0 + pixel / width] = shadePath(paths, pixel, 0);
+  }
+}
+
+Eigen::Vector3f Flyscene::shadePath(const StreamedPaths& paths, int pixel, int bounces) {
+	const Triangle& hit = paths.hits[bounces][pixel];
+
+	//If nothing was hit, return NO_HIT_COLOR
+	if (hit.hitFace.empty()) {
+		return missColor();
+	}
+
+	Eigen::Vector3f reflectColor = { 0,0,0 };
+	if (bounces < MAX_BOUNCES) {
+		reflectColor = shadePath(paths, pixel, bounces + 1);
+	}
+	int brightness = std::min(paths.unoccluded[bounces * paths.pixels + pixel], SOFT_SHADOW_PRECISION);
+	return litColor(hit.hitFace, hit.hitPoint, reflectColor, brightness);
+}
+
+void Flyscene::toggleStreams(void)
+{
+	streamSecondary = !streamSecondary;
+	std::cout << "Secondary rays: " << (streamSecondary ? "sorted streams" : "immediate") << endl;
+}
+
+Eigen::Vector3f Flyscene::calColor(std::vector<face> hitFace, vectorThree hitPoint, Eigen::Vector3f reflectColor) {
 	vectorThree hitPointBias;
-	float brightness = 0;
+	std::vector<vectorThree> pointsOnDisks;
+	shadowRays(hitFace[0], hitPoint, hitPointBias, pointsOnDisks);
 
-	
+	int brightness = 0;
+	for (vectorThree& pointOndisk : pointsOnDisks) {
+		if (!occluded(hitPointBias, pointOndisk) && brightness < SOFT_SHADOW_PRECISION) {
+			brightness++;
+		}
+	}
+
+	return litColor(hitFace, hitPoint, reflectColor, brightness);
+}
+
+void Flyscene::shadowRays(face hitFace, vectorThree hitPoint, vectorThree& hitPointBias, std::vector<vectorThree>& pointsOnDisks) {
+	vectorThree shadowLight;
 
 	for (Eigen::Vector3f light : lights)
 	{
 		shadowLight = vectorThree::toVectorThree(light);
-		hitPointBias = hitPoint + (hitFace[0].normal * 0.000001);
+		hitPointBias = hitPoint + (hitFace.normal * 0.000001);
 		float radius = 0.15;
 
 		vectorThree ray = shadowLight - hitPointBias;
@@ -934,16 +1672,20 @@ Eigen::Vector3f Flyscene::calColor(std::vector<face> hitFace, vectorThree hitPoi
 			float diskZ = shadowLight.z + radius * cos((M_PI / (SOFT_SHADOW_PRECISION / 2)) * i) * a.z + radius * sin((M_PI / (SOFT_SHADOW_PRECISION / 2)) * i) * b.z;
 
 			vectorThree pointOndisk = { diskX, diskY, diskZ };
+			pointsOnDisks.push_back(pointOndisk);
+		}
+	}
+}
 
-			Triangle sShadowRay = traceRay(hitPointBias, pointOndisk, boxes);
+Eigen::Vector3f Flyscene::litColor(const std::vector<face>& hitFace, vectorThree hitPoint, Eigen::Vector3f reflectColor, int brightness) {
+	Eigen::Vector3f color = { 0.0, 0.0, 0.0 };
 
-			if (sShadowRay.hitFace.empty() && brightness < SOFT_SHADOW_PRECISION) {
-				brightness++;
-			}
-		}
+	int matId = hitFace[0].material_id;
+	Tucano::Material::Mtl mat = materials[matId];
 
+	for (Eigen::Vector3f light : lights)
+	{
 		color += calculateColor(mat, light, flycamera, hitFace[0], hitPoint);
-
 	}
 
 	Eigen::Vector3f emitter = { 0.0, 0.0, 0.1 };
@@ -954,32 +1696,77 @@ Eigen::Vector3f Flyscene::calColor(std::vector<face> hitFace, vectorThree hitPoi
 	return color * (float(brightness) / float(SOFT_SHADOW_PRECISION));
 }
 
+bool Flyscene::occluded(vectorThree origin, vectorThree target) {
+
+	vectorThree rayDirection = target - origin;
+	float length = rayDirection.length();
+	if (length == 0.0f) {
+		return false;
+	}
+
+	// only hits between the surface and the target block it
+	float tMin = 0.0001f / length;
+	bool hit;
+	if (traversal == TRAVERSAL_BVH8) {
+		hit = anyHit8(bvh8, bvh, triangles, origin, rayDirection, tMin, 1.0f);
+	}
+	else if (traversal == TRAVERSAL_BVH4) {
+		hit = anyHit4(bvh4, bvh, triangles, origin, rayDirection, tMin, 1.0f);
+	}
+	else if (traversal == TRAVERSAL_QBVH4) {
+		hit = anyHitQ4(qbvh4, bvh, triangles, origin, rayDirection, tMin, 1.0f);
+	}
+	else if (traversal == TRAVERSAL_STACKLESS) {
+		hit = anyHitStackless(bvh, stackless, triangles, origin, rayDirection, tMin, 1.0f);
+	}
+	else if (traversal == TRAVERSAL_KDTREE) {
+		hit = anyHitKd(kdtree, origin, rayDirection, tMin, 1.0f);
+	}
+	else if (traversal == TRAVERSAL_GRID) {
+		hit = anyHitGrid(grid, origin, rayDirection, tMin, 1.0f);
+	}
+	else {
+		hit = anyHit(bvh, triangles, origin, rayDirection, tMin, 1.0f);
+	}
+
+	return hit || occludedInstances(scene, traversal, origin, target, 0.0001f)
+		|| anySphereHit(spheres, origin, rayDirection, tMin, 1.0f);
+}
+
 // Traces ray
-Eigen::Vector3f Flyscene::traceRay(vectorThree &origin, vectorThree &dest, std::vector<BoundingBox> &boxes, 
+Eigen::Vector3f Flyscene::traceRay(vectorThree &origin, vectorThree &dest, LinearBVH& bvh, 
 									int bounces) {
 	//Search for hit
-	Triangle lightRay = traceRay(origin, dest, boxes);
+	return shadeRay(origin, dest, traceRay(origin, dest, bvh), bvh, bounces);
+}
+
+Eigen::Vector3f Flyscene::shadeRay(vectorThree &origin, vectorThree &dest, const Triangle& lightRay, LinearBVH& bvh,
+									int bounces) {
 	std::vector<face> hitFace = lightRay.hitFace;
 	vectorThree hitPoint = lightRay.hitPoint;
 	Eigen::Vector3f reflectColor = { 0,0,0 };
 
 	//If nothing was hit, return NO_HIT_COLOR
 	if (hitFace.empty()) {
-		star++;
-		//int v1 = rand() % 100;
-		if ((star%100 < 50 && star%4000 > 48) || star%40000>99) {
-			return NO_HIT_COLOR.cwiseProduct(noHitMultiplier);
-		}
-		else {
-			return { 1.0, 1.0, 1.0 };
-		}
+		return missColor();
 	}
 	
 	if (bounces < MAX_BOUNCES) {
 		dest = calcReflection(hitPoint, origin, hitFace);
-		reflectColor = traceRay(hitPoint, dest, boxes, bounces + 1);
+		reflectColor = traceRay(hitPoint, dest, bvh, bounces + 1);
+	}
+	return calColor(hitFace, hitPoint, reflectColor);
+}
+
+Eigen::Vector3f Flyscene::missColor() {
+	star++;
+	//int v1 = rand() % 100;
+	if ((star%100 < 50 && star%4000 > 48) || star%40000>99) {
+		return NO_HIT_COLOR.cwiseProduct(noHitMultiplier);
+	}
+	else {
+		return { 1.0, 1.0, 1.0 };
 	}
-	return calColor(hitFace, hitPoint, boxes, reflectColor);
 }
 
 vectorThree Flyscene::calcReflection(vectorThree hitPoint, vectorThree origin, std::vector<face> hitFace) {
@@ -993,12 +1780,7 @@ vectorThree Flyscene::calcReflection(vectorThree hitPoint, vectorThree origin, s
 	return dest;
 	}
 
-Triangle Flyscene::traceRay(vectorThree origin, vectorThree dest, std::vector<BoundingBox>& boxes) {
-	vectorThree uvw, point, hitPoint;
-	std::vector<face> minFace;
-	float currentDistance;
-	float minDistance = FLT_MAX;
-
+Triangle Flyscene::traceRay(vectorThree origin, vectorThree dest, LinearBVH& bvh) {
 	vectorThree origin2 = origin;
 	vectorThree dest2 = dest;
 
@@ -1006,67 +1788,74 @@ Triangle Flyscene::traceRay(vectorThree origin, vectorThree dest, std::vector<Bo
 	rayDirection.x *= 5.0;
 	rayDirection.y *= 5.0;
 	rayDirection.z *= 5.0;
-	dest2 = rayDirection + origin2;
 
-  
-	for (const BoundingBox &currentBox : boxes) {
-		//If ray hits a box
-		if (rayBoxIntersection(currentBox, origin2, dest2)) {
-			std::vector<face> checkFaces;
-			intersectingChildren(currentBox, origin2, dest2, checkFaces);
-			for (const face &currentFace : checkFaces) {
-				//If it hits a face in that box	
-				face oppositeFace = currentFace;
-				std::swap<vectorThree>(oppositeFace.vertex2, oppositeFace.vertex3);
-        
-				if (rayTriangleIntersection(origin2, dest2, currentFace, point, true)) {
-					//This is the point it hits the triangle
-					
-					currentDistance = (point - origin).length();
-					//Calculates closest triangle
-					if (minDistance > currentDistance && currentDistance > 0.0001) {
-						minFace.resize(1);
-						minDistance = currentDistance;
-						minFace[0] = currentFace;
-						hitPoint = point;
-					}
-				}
-				else if (rayTriangleIntersection(origin2, dest2, oppositeFace, point, false)) {
-						currentDistance = (point - origin).length();
-						//Calculates closest triangle
-						if (minDistance > currentDistance && currentDistance > 0.0001) {
-							minFace.resize(1);
-							minDistance = currentDistance;
-							minFace[0] = oppositeFace;
-							hitPoint = point;
-
-					}
-				}
-			}
-    }
-      std::vector<Sphere> local_spheres = currentBox.spheres;
-      for (Sphere& sphere : local_spheres) {
-        //std::cout << "Sphere Check!" << local_spheres.size() << std::endl;
-        face new_face;
 
-        if(sphere.intersection(origin2, dest2, point)) {
+	// the closest hit shortens the segment while traversing, hits closer than
+	// 0.0001 to the origin are the surface the ray starts on
+	RayHit hit;
+	float tMin = 0.0001f / rayDirection.length();
+	if (traversal == TRAVERSAL_BVH8) {
+		closestHit8(bvh8, bvh, triangles, origin2, rayDirection, tMin, hit);
+	}
+	else if (traversal == TRAVERSAL_BVH4) {
+		closestHit4(bvh4, bvh, triangles, origin2, rayDirection, tMin, hit);
+	}
+	else if (traversal == TRAVERSAL_QBVH4) {
+		closestHitQ4(qbvh4, bvh, triangles, origin2, rayDirection, tMin, hit);
+	}
+	else if (traversal == TRAVERSAL_STACKLESS) {
+		closestHitStackless(bvh, stackless, triangles, origin2, rayDirection, tMin, hit);
+	}
+	else if (traversal == TRAVERSAL_KDTREE) {
+		closestHitKd(kdtree, origin2, rayDirection, tMin, hit);
+	}
+	else if (traversal == TRAVERSAL_GRID) {
+		closestHitGrid(grid, origin2, rayDirection, tMin, hit);
+	}
+	else {
+		closestHit(bvh, triangles, origin2, rayDirection, tMin, hit);
+	}
+
+	return completeHit(origin2, rayDirection, hit);
+}
 
+Triangle Flyscene::completeHit(vectorThree origin, vectorThree rayDirection, const RayHit& hit) {
+	vectorThree point, hitPoint;
+	std::vector<face> minFace;
+	float minDistance = FLT_MAX;
 
-          //std::cout << "Sphere Intersection!" << point.x << ", " << point.y << ", " << point.z << std::endl;
+	vectorThree origin2 = origin;
+	vectorThree dest2 = rayDirection + origin2;
+	float tMin = 0.0001f / rayDirection.length();
+
+	if (hit.face >= 0) {
+		//This is the point it hits the triangle
+		hitPoint = origin2 + rayDirection * hit.t;
+		minDistance = (hitPoint - origin).length();
+		minFace.push_back(sidedFace(bvh.faces[hit.face], hit.front));
+	}
 
-          currentDistance = (point - origin).length();
-          if (minDistance > currentDistance && currentDistance > 0.0001) {
+	face instanceFace;
+	if (intersectInstances(scene, traversal, origin2, dest2, minDistance, instanceFace, hitPoint)) {
+		minFace.resize(1);
+		minFace[0] = instanceFace;
+	}
 
-              minFace.resize(1);
-              minDistance = currentDistance;
-              new_face.normal = sphere.getNormal(point);
-              new_face.material_id = sphere.getMaterialId();
-              minFace[0] = new_face;
-              hitPoint = point;
-          }
-        
-      }
-		}
+	// spheres only count when closer than every face hit so far
+	float tSphere = std::min(1.0f, minDistance / rayDirection.length());
+	int sphereHit = -1;
+	closestSphereHit(spheres, origin2, rayDirection, tMin, tSphere, sphereHit);
+	if (sphereHit >= 0) {
+		face new_face;
+		Sphere& sphere = spheres.spheres[sphereHit];
+
+		point = origin2 + rayDirection * tSphere;
+		minFace.resize(1);
+		minDistance = (point - origin).length();
+		new_face.normal = sphere.getNormal(point);
+		new_face.material_id = sphere.getMaterialId();
+		minFace[0] = new_face;
+		hitPoint = point;
 	}
 	//In case ray hits nothing
 	if (hitPoint == dest2) {
@@ -20,11 +20,23 @@
 #include <chrono>
 #include <algorithm>
 #include <cmath>
+#include <random>
+
+#include "geometry.hpp"
+#include "bvh.hpp"
+#include "widebvh.hpp"
+#include "lbvh.hpp"
+#include "treelet.hpp"
+#include "instance.hpp"
+#include "stackless.hpp"
+#include "kdtree.hpp"
+#include "grid.hpp"
+#include "spheres.hpp"
+#include "packets.hpp"
+#include "streams.hpp"
+#include "bvhcache.hpp"
+#include "bvhstats.hpp"
 
-static long long rayTriangleChecks = 0;
-static long long rayBoxChecks = 0;
-static long long rayTriangleIntersections = 0;
-static long long rayBoxIntersections = 0;
 static long long star = 0;
 
 static int load_progress = 0;
@@ -36,260 +48,9 @@ static const int MAX_BOUNCES = 10;
 static const Eigen::Vector3f NO_HIT_COLOR = { 1.0, 1.0, 1.0 };
 
 static const int SOFT_SHADOW_PRECISION = 4;
-static const int SPLIT_FACTOR = 10;
 
 static std::vector<Tucano::Shapes::Box> leafBoxes;
 
-struct vectorFour {
-	float x;
-	float y;
-	float z;
-	float w;
-
-	float dot(vectorFour other) {
-		float result = 0;
-		result += x * other.x;
-		result += y * other.y;
-		result += z * other.z;
-		result += w * other.w;
-		return result;
-	}
-
-};
-
-struct vectorTwo {
-	float x;
-	float y;
-
-	vectorTwo operator/ (float divisor) {
-		vectorTwo out;
-		out.x = x / divisor;
-		out.y = y / divisor;
-		return out;
-	}
-
-	vectorTwo operator- (vectorTwo other) {
-		vectorTwo out;
-		out.x = x - other.x;
-		out.y = y - other.y;
-		return out;
-	}
-
-	vectorTwo operator+ (vectorTwo other) {
-		vectorTwo out;
-		out.x = x + other.x;
-		out.y = y + other.y;
-		return out;
-	}
-
-	vectorTwo operator* (vectorTwo other) {
-		vectorTwo out;
-		out.x = other.x * x;
-		out.y = other.y * y;
-		return out;
-	}
-
-	vectorTwo operator* (float other) {
-		vectorTwo out;
-		out.x = other * x;
-		out.y = other * y;
-		return out;
-	}
-
-	float length() {
-		return sqrt(x * x + y * y);
-	}
-};
-
-struct vectorThree {
-	float x;
-	float y;
-	float z;
-
-	vectorThree operator/ (float divisor) {
-		vectorThree out;
-		out.x = x / divisor;
-		out.y = y / divisor;
-		out.z = z / divisor;
-		return out;
-	}
-
-	vectorThree operator- (vectorThree other) {
-		vectorThree out;
-		out.x = x - other.x;
-		out.y = y - other.y;
-		out.z = z - other.z;
-		return out;
-	}
-
-	vectorThree operator+ (vectorThree other) {
-		vectorThree out;
-		out.x = x + other.x;
-		out.y = y + other.y;
-		out.z = z + other.z;
-		return out;
-	}
-
-	vectorThree operator* (vectorThree other) {
-		vectorThree out;
-		out.x = other.x * x;
-		out.y = other.y * y;
-		out.z = other.z * z;
-		return out;
-	}
-
-	vectorThree operator* (float other) {
-		vectorThree out;
-		out.x = other * x;
-		out.y = other * y;
-		out.z = other * z;
-		return out;
-	}
-
-	vectorThree operator* (float other) const {
-		vectorThree out;
-		out.x = other * x;
-		out.y = other * y;
-		out.z = other * z;
-		return out;
-	}
-
-	vectorThree operator/ (float other) const {
-		vectorThree out;
-		out.x = x / other;
-		out.y = y / other;
-		out.z = z / other;
-		return out;
-	}
-
-	bool operator== (vectorThree other) {
-		if (x == other.x && y == other.y && z == other.z) {
-			return true;
-		}
-		return false;
-	}
-
-	float dot(vectorThree other) {
-		float result = 0;
-		result += x * other.x;
-		result += y * other.y;
-		result += z * other.z;
-		return result;
-	}
-
-	vectorThree cross(vectorThree other) {
-		vectorThree result;
-		result.x = (y * other.z) - (z * other.y);
-		result.y = (z * other.x) - (x * other.z);
-		result.z = (x * other.y) - (y * other.x);
-		return result;
-	}
-
-	vectorThree normalize() {
-		vectorThree result;
-		result.x = x / length();
-		result.y = y / length();
-		result.z = z / length();
-		return result;
-	}
-
-	vectorThree reflect(vectorThree other) {
-		vectorThree result = normalize() - (other.normalize().operator*(2*dot(other.normalize())));
-		return result;
-	}
-
-	float scalarTripleProduct(vectorThree v, vectorThree w) {
-		return (this->cross(v)).dot(w);
-	}
-
-	float length() {
-		return sqrt(x * x + y * y + z * z);
-	}
-
-	static vectorThree toVectorThree(Eigen::Vector3f old) {
-		vectorThree out = { old(0), old(1), old(2) };
-		return out;
-	}
-
-	Eigen::Vector3f toEigenThree() {
-		Eigen::Vector3f out = { x, y, z};
-		return out;
-	}
-
-};
-
-struct face {
-	vectorThree vertex1;
-	vectorThree vertex2;
-	vectorThree vertex3;
-	vectorThree normal;
-	int material_id;
-};
-
-class Sphere {
-
-	float radius;
-	vectorThree center;
-	int material_id = -1;
-
-public:
-
-	Sphere(float r, vectorThree c, int mat) {
-		radius = r;
-		center = c;
-		material_id = mat;
-	}
-	float getRadius() { return radius; }
-	vectorThree getCenter() { return center; }
-	int getMaterialId() { return material_id; }
-	vectorThree getNormal(vectorThree& point) { return (point - center).normalize(); }
-	bool intersection(vectorThree& origin, vectorThree& dest, vectorThree& point);
-};
-
-struct Triangle {
-	vectorThree hitPoint;
-	std::vector<face> hitFace;
-
-	Triangle(vectorThree hitPoint, std::vector<face> hitFace) : hitPoint(hitPoint), hitFace(hitFace) {};
-
-};
-
-
-class BoundingBox {
-public:
-	std::vector<face> faces;
-	std::vector<Sphere> spheres;
-	std::vector<BoundingBox> children;
-	float xMax;
-	float xMin;
-	float yMax;
-	float yMin;
-	float zMax;
-	float zMin;
-
-
-	BoundingBox(void) {
-		xMax = -FLT_MAX;
-		xMin = FLT_MAX;
-		yMax = -FLT_MAX;
-		yMin = FLT_MAX;
-		zMax = -FLT_MAX;
-		zMin = FLT_MAX;
-	}
-
-	void addChild(BoundingBox& newchild) { children.push_back(newchild); }
-
-	float getVolume() { return ((xMax - xMin) * (yMax - yMin) * (zMax - zMin)); }
-
-	float getX() { return (xMax - xMin); }
-
-	float getY() { return (yMax - yMin); }
-
-	float getZ() { return (zMax - zMin); }
-
-	Eigen::Vector3f getCenter() { return Eigen::Vector3f(xMin + getX()/2, yMin + getY()/2, zMin + getZ()/2); }
-};
-
 
 
 class Flyscene {
@@ -353,18 +114,98 @@ public:
   void shiftBgroundblack();
 
   void printInformationDebug(int ray);
+
+  /**
+   * @brief Switch to the next BVH traversal kernel
+   */
+  void cycleTraversal();
+
+  /**
+   * @brief Switch between tracing reflection and shadow rays right away and
+   * in sorted streams
+   */
+  void toggleStreams();
+
+  /**
+   * @brief Set the sides of the faces of a material rays ignore, for the
+   * mesh and its instances
+   */
+  void setCullMode(int material, CullMode mode);
+
+  /**
+   * @brief Switch all materials to the next cull mode
+   */
+  void cycleCullModes();
+
+  /**
+   * @brief Rotate the mesh around the y axis and refit the BVH to it
+   */
+  void spinMesh();
+
+  /**
+   * @brief Place another copy of the mesh in front of the camera
+   */
+  void addMeshInstance();
+
+  /**
+   * @brief Print the quality and memory of the BVHs and write them to
+   * BVH_STATS_FILE, without rendering
+   */
+  void reportBVH();
+
   /**
    * @brief trace a single ray from the camera passing through dest
    * @param origin Ray origin
    * @param dest Other point on the ray, usually screen coordinates
    * @return a RGB color
    */
-  Eigen::Vector3f traceRay(vectorThree &origin, vectorThree &dest, std::vector<BoundingBox> &boxes, int bounces);
+  Eigen::Vector3f traceRay(vectorThree &origin, vectorThree &dest, LinearBVH& bvh, int bounces);
+
+  /**
+   * @brief color of a ray whose closest hit was already traced, continues
+   * with its reflection
+   * @param tracedRay Closest hit of the ray from origin through dest
+   */
+  Eigen::Vector3f shadeRay(vectorThree &origin, vectorThree &dest, const Triangle& tracedRay, LinearBVH& bvh, int bounces);
+
+  void traceDebugRay(vectorThree& origin, vectorThree& dest, LinearBVH& bvh, int bounces);
+
+  Triangle traceRay(vectorThree origin, vectorThree dest, LinearBVH& bvh);
+
+  /**
+   * @brief closest hit of the ray origin + t * rayDirection given the closest
+   * face hit of the mesh, which instances and spheres may still cover
+   */
+  Triangle completeHit(vectorThree origin, vectorThree rayDirection, const RayHit& hit);
+
+  /**
+   * @brief whether anything lies between origin and target, returns on the
+   * first hit found
+   * @param origin Surface point, hits closer than 0.0001 are ignored
+   * @param target Point the ray ends at, usually on a light
+   */
+  bool occluded(vectorThree origin, vectorThree target);
+
+  Eigen::Vector3f calColor(std::vector<face> hitFace, vectorThree hitPoint, Eigen::Vector3f reflectColor);
+
+  /**
+   * @brief the shadow rays calColor traces from a hit, from hitPointBias to
+   * every point of pointsOnDisks
+   */
+  void shadowRays(face hitFace, vectorThree hitPoint, vectorThree& hitPointBias, std::vector<vectorThree>& pointsOnDisks);
 
-  void traceDebugRay(vectorThree& origin, vectorThree& dest, std::vector<BoundingBox>& boxes, int bounces);
+  /**
+   * @brief color of a hit lit by the lights, once its shadow rays and
+   * reflection were traced
+   * @param brightness Shadow rays that reached their light, at most
+   * SOFT_SHADOW_PRECISION
+   */
+  Eigen::Vector3f litColor(const std::vector<face>& hitFace, vectorThree hitPoint, Eigen::Vector3f reflectColor, int brightness);
 
-  Triangle traceRay(vectorThree origin, vectorThree dest, std::vector<BoundingBox>& boxes);
-  Eigen::Vector3f calColor(std::vector<face> hitFace, vectorThree hitPoint, std::vector<BoundingBox>& boxes, Eigen::Vector3f reflectColor);
+  /**
+   * @brief color of a ray that hit nothing, the background with a few stars
+   */
+  Eigen::Vector3f missColor();
 
   vectorThree calcReflection(vectorThree hitPoint, vectorThree origin, std::vector<face> hitFace);
   Tucano::Flycamera flycamera;
@@ -402,7 +243,105 @@ private:
 
   /// MTL materials
   vector<Tucano::Material::Mtl> materials;
-  std::vector<BoundingBox> boxes;
+  /// Sides of the faces rays ignore, indexed like materials. Materials whose
+  /// name ends in _cullback or _cullfront start out culling that side.
+  std::vector<CullMode> cullModes;
+
+  /// Whether reflection and shadow rays are traced in sorted streams
+  bool streamSecondary = STREAM_SECONDARY_RAYS;
+
+  // Paths of the pixels of a batch, hits[bounce][pixel] is the closest hit
+  // after that many reflections and origins[bounce][pixel] where its ray
+  // started. unoccluded[bounce * pixels + pixel] counts the shadow rays of the
+  // hit that reached their light.
+  struct StreamedPaths {
+    int pixels;
+    std::vector<std::vector<Triangle>> hits;
+    std::vector<std::vector<vectorThree>> origins;
+    std::vector<int> unoccluded;
+  };
+
+  /**
+   * @brief Trace the camera rays of rows y0 up to y1 and the reflection and
+   * shadow rays of their paths in sorted streams, and shade the pixels in the
+   * order immediate tracing does
+   */
+  void traceStreamed(const Eigen::Vector2i& image_size, int y0, int y1, vectorThree origin,
+    vector<vector<Eigen::Vector3f>>& pixel_data, PacketStats& packetStats, StreamStats& streamStats);
+
+  /**
+   * @brief color of the path of a pixel from the given bounce on, the same
+   * traceRay computes
+   */
+  Eigen::Vector3f shadePath(const StreamedPaths& paths, int pixel, int bounces);
+  /**
+   * @brief Build all BVHs from the mesh with its current model matrix
+   * @param meshFile File the mesh was loaded from, the binary BVH is mapped
+   * from its cache file when that is up to date and written to it otherwise
+   */
+  void buildAccelerationStructures(const std::string& meshFile = "");
+
+  /**
+   * @brief Move the faces to the current model matrix and refit the BVHs,
+   * rebuilding them once the refitted tree got too expensive
+   */
+  void refitAccelerationStructures();
+
+  /**
+   * @brief Build the kd-tree over the faces of the BVH for the kd-tree
+   * traversal mode, when BUILD_KDTREE is set and the faces changed since it
+   * was last built
+   */
+  void rebuildKdTree();
+
+  /**
+   * @brief Build the hierarchical grid over the faces of the BVH for the grid
+   * traversal mode, when BUILD_GRID is set and the faces changed since it was
+   * last built
+   */
+  void rebuildGrid();
+
+  /**
+   * @brief Copy the cull modes of the materials into the triangle blocks of
+   * the BVH, the kd-tree, the grid and the instanced meshes
+   */
+  void updateCullModes();
+
+  /**
+   * @brief Build what the current traversal mode needs and was left out of
+   * date, call before tracing rays
+   */
+  void prepareTraversal();
+
+  /// OBJ file the mesh was loaded from
+  std::string meshFile;
+  /// Worker threads for building the acceleration structures
+  ThreadPool pool;
+  /// Faces of the BVH in object space, in the same order as bvh.faces
+  std::vector<face> objectFaces;
+  /// SAH cost of the BVH right after the last full build
+  float bvhBuildCost = 0.0f;
+  LinearBVH bvh;
+  /// Faces of the BVH leaves packed for intersection
+  TriangleLeaves triangles;
+  /// Parent links of the BVH for the stackless traversal
+  StacklessLinks stackless;
+  BVH4 bvh4;
+  BVH8 bvh8;
+  QBVH4 qbvh4;
+  /// Alternative to the BVHs over the same faces, hits reference bvh.faces
+  KdTree kdtree;
+  /// Whether the faces changed since the kd-tree was built
+  bool kdtreeStale = true;
+  /// Same for the grid, hits reference bvh.faces
+  HierarchicalGrid grid;
+  /// Whether the faces changed since the grid was built
+  bool gridStale = true;
+  /// Hierarchy over bvh.spheres, hits reference spheres.spheres
+  SphereBVH spheres;
+  /// Copies of the mesh placed with addMeshInstance
+  InstancedScene scene;
+  TraversalMode traversal = TRAVERSAL_BINARY;
 };
 
 #endif // FLYSCENE
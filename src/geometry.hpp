@@ -0,0 +1,229 @@
+#ifndef __GEOMETRY__
+#define __GEOMETRY__
+
+#include <Eigen/Dense>
+#include <float.h>
+#include <cmath>
+#include <vector>
+
+struct vectorFour {
+	float x;
+	float y;
+	float z;
+	float w;
+
+	float dot(vectorFour other) {
+		float result = 0;
+		result += x * other.x;
+		result += y * other.y;
+		result += z * other.z;
+		result += w * other.w;
+		return result;
+	}
+
+};
+
+struct vectorTwo {
+	float x;
+	float y;
+
+	vectorTwo operator/ (float divisor) {
+		vectorTwo out;
+		out.x = x / divisor;
+		out.y = y / divisor;
+		return out;
+	}
+
+	vectorTwo operator- (vectorTwo other) {
+		vectorTwo out;
+		out.x = x - other.x;
+		out.y = y - other.y;
+		return out;
+	}
+
+	vectorTwo operator+ (vectorTwo other) {
+		vectorTwo out;
+		out.x = x + other.x;
+		out.y = y + other.y;
+		return out;
+	}
+
+	vectorTwo operator* (vectorTwo other) {
+		vectorTwo out;
+		out.x = other.x * x;
+		out.y = other.y * y;
+		return out;
+	}
+
+	vectorTwo operator* (float other) {
+		vectorTwo out;
+		out.x = other * x;
+		out.y = other * y;
+		return out;
+	}
+
+	float length() {
+		return sqrt(x * x + y * y);
+	}
+};
+
+struct vectorThree {
+	float x;
+	float y;
+	float z;
+
+	vectorThree operator/ (float divisor) {
+		vectorThree out;
+		out.x = x / divisor;
+		out.y = y / divisor;
+		out.z = z / divisor;
+		return out;
+	}
+
+	vectorThree operator- (vectorThree other) {
+		vectorThree out;
+		out.x = x - other.x;
+		out.y = y - other.y;
+		out.z = z - other.z;
+		return out;
+	}
+
+	vectorThree operator+ (vectorThree other) {
+		vectorThree out;
+		out.x = x + other.x;
+		out.y = y + other.y;
+		out.z = z + other.z;
+		return out;
+	}
+
+	vectorThree operator* (vectorThree other) {
+		vectorThree out;
+		out.x = other.x * x;
+		out.y = other.y * y;
+		out.z = other.z * z;
+		return out;
+	}
+
+	vectorThree operator* (float other) {
+		vectorThree out;
+		out.x = other * x;
+		out.y = other * y;
+		out.z = other * z;
+		return out;
+	}
+
+	vectorThree operator* (float other) const {
+		vectorThree out;
+		out.x = other * x;
+		out.y = other * y;
+		out.z = other * z;
+		return out;
+	}
+
+	vectorThree operator/ (float other) const {
+		vectorThree out;
+		out.x = x / other;
+		out.y = y / other;
+		out.z = z / other;
+		return out;
+	}
+
+	bool operator== (vectorThree other) {
+		if (x == other.x && y == other.y && z == other.z) {
+			return true;
+		}
+		return false;
+	}
+
+	float operator[] (int axis) const {
+		if (axis == 0) { return x; }
+		if (axis == 1) { return y; }
+		return z;
+	}
+
+	float dot(vectorThree other) {
+		float result = 0;
+		result += x * other.x;
+		result += y * other.y;
+		result += z * other.z;
+		return result;
+	}
+
+	vectorThree cross(vectorThree other) {
+		vectorThree result;
+		result.x = (y * other.z) - (z * other.y);
+		result.y = (z * other.x) - (x * other.z);
+		result.z = (x * other.y) - (y * other.x);
+		return result;
+	}
+
+	vectorThree normalize() {
+		vectorThree result;
+		result.x = x / length();
+		result.y = y / length();
+		result.z = z / length();
+		return result;
+	}
+
+	vectorThree reflect(vectorThree other) {
+		vectorThree result = normalize() - (other.normalize().operator*(2*dot(other.normalize())));
+		return result;
+	}
+
+	float scalarTripleProduct(vectorThree v, vectorThree w) {
+		return (this->cross(v)).dot(w);
+	}
+
+	float length() {
+		return sqrt(x * x + y * y + z * z);
+	}
+
+	static vectorThree toVectorThree(Eigen::Vector3f old) {
+		vectorThree out = { old(0), old(1), old(2) };
+		return out;
+	}
+
+	Eigen::Vector3f toEigenThree() {
+		Eigen::Vector3f out = { x, y, z};
+		return out;
+	}
+
+};
+
+struct face {
+	vectorThree vertex1;
+	vectorThree vertex2;
+	vectorThree vertex3;
+	vectorThree normal;
+	int material_id;
+};
+
+class Sphere {
+
+	float radius;
+	vectorThree center;
+	int material_id = -1;
+
+public:
+
+	Sphere(float r, vectorThree c, int mat) {
+		radius = r;
+		center = c;
+		material_id = mat;
+	}
+	float getRadius() const { return radius; }
+	vectorThree getCenter() const { return center; }
+	int getMaterialId() const { return material_id; }
+	vectorThree getNormal(vectorThree& point) { return (point - center).normalize(); }
+	bool intersection(vectorThree& origin, vectorThree& dest, vectorThree& point);
+};
+
+struct Triangle {
+	vectorThree hitPoint;
+	std::vector<face> hitFace;
+
+	Triangle(vectorThree hitPoint, std::vector<face> hitFace) : hitPoint(hitPoint), hitFace(hitFace) {};
+
+};
+
+#endif // GEOMETRY
@@ -0,0 +1,387 @@
+#include "grid.hpp"
+#include <cmath>
+#include <memory>
+#include <numeric>
+
+static Bounds faceBounds(const face& currentFace) {
+
+  Bounds bounds;
+  bounds.grow(currentFace.vertex1);
+  bounds.grow(currentFace.vertex2);
+  bounds.grow(currentFace.vertex3);
+  return bounds;
+}
+
+static float& component(vectorThree& v, int axis) {
+  return axis == 0 ? v.x : (axis == 1 ? v.y : v.z);
+}
+
+//===========================================================================
+//=============================== Building ==================================
+//===========================================================================
+
+// Cubic cells with density cells per face over the volume of the grid. Flat
+// axes count as a thousandth of the longest one so the volume stays positive.
+static void chooseResolution(Grid& grid, int count, float density) {
+
+  float longest = 0.0f;
+  for (int axis = 0; axis < 3; axis++) {
+    longest = std::max(longest, grid.bounds.max[axis] - grid.bounds.min[axis]);
+  }
+  float thickness = longest > 0.0f ? longest * 1e-3f : 1.0f;
+
+  float volume = 1.0f;
+  for (int axis = 0; axis < 3; axis++) {
+    volume *= std::max(grid.bounds.max[axis] - grid.bounds.min[axis], thickness);
+  }
+  float cellsPerLength = std::cbrt(density * count / volume);
+
+  for (int axis = 0; axis < 3; axis++) {
+
+    float extent = grid.bounds.max[axis] - grid.bounds.min[axis];
+    int resolution = int(std::max(extent, thickness) * cellsPerLength);
+    grid.resolution[axis] = std::max(1, std::min(resolution, GRID_MAX_RESOLUTION));
+
+    component(grid.cellSize, axis) = extent / grid.resolution[axis];
+    component(grid.inverseCellSize, axis) = extent > 0.0f ? grid.resolution[axis] / extent : 0.0f;
+  }
+}
+
+static int cellCoordinate(const Grid& grid, float position, int axis) {
+
+  int cell = int((position - grid.bounds.min[axis]) * grid.inverseCellSize[axis]);
+  return std::max(0, std::min(cell, grid.resolution[axis] - 1));
+}
+
+// Calls visit for every cell the bounds overlap
+template <typename CellFunction>
+static void forEachCell(const Grid& grid, const Bounds& bounds, CellFunction visit) {
+
+  int low[3], high[3];
+  for (int axis = 0; axis < 3; axis++) {
+    low[axis] = cellCoordinate(grid, bounds.min[axis], axis);
+    high[axis] = cellCoordinate(grid, bounds.max[axis], axis);
+  }
+
+  for (int z = low[2]; z <= high[2]; z++) {
+    for (int y = low[1]; y <= high[1]; y++) {
+      for (int x = low[0]; x <= high[0]; x++) {
+        visit(x + grid.resolution[0] * (y + grid.resolution[1] * z));
+      }
+    }
+  }
+}
+
+// Counting sort of the faces at ids into the cells their bounds overlap:
+// count the references per cell, turn the counts into offsets with a prefix
+// sum and scatter the faces. Both passes over the faces run through
+// parallelFor, the scatter order depends on the threads so every cell is
+// sorted afterwards to keep builds reproducible.
+template <typename ParallelFor>
+static void fillGrid(Grid& grid, const std::vector<Bounds>& boxes, const int* ids, int count, ParallelFor parallelFor) {
+
+  int cells = grid.cellCount();
+  std::unique_ptr<std::atomic<int>[]> counts(new std::atomic<int>[cells]);
+
+  parallelFor(0, cells, BUILD_PARALLEL_CHUNK_SIZE, [&](int begin, int end) {
+    for (int cell = begin; cell < end; cell++) {
+      counts[cell].store(0, std::memory_order_relaxed);
+    }
+  });
+
+  parallelFor(0, count, BUILD_PARALLEL_CHUNK_SIZE, [&](int begin, int end) {
+    for (int i = begin; i < end; i++) {
+      forEachCell(grid, boxes[ids[i]], [&](int cell) {
+        counts[cell].fetch_add(1, std::memory_order_relaxed);
+      });
+    }
+  });
+
+  grid.cellStart.resize(cells + 1);
+  grid.cellStart[0] = 0;
+  for (int cell = 0; cell < cells; cell++) {
+    grid.cellStart[cell + 1] = grid.cellStart[cell] + counts[cell].load(std::memory_order_relaxed);
+  }
+
+  // the counts become the next free reference of every cell
+  parallelFor(0, cells, BUILD_PARALLEL_CHUNK_SIZE, [&](int begin, int end) {
+    for (int cell = begin; cell < end; cell++) {
+      counts[cell].store(grid.cellStart[cell], std::memory_order_relaxed);
+    }
+  });
+
+  grid.references.resize(grid.cellStart[cells]);
+  parallelFor(0, count, BUILD_PARALLEL_CHUNK_SIZE, [&](int begin, int end) {
+    for (int i = begin; i < end; i++) {
+      forEachCell(grid, boxes[ids[i]], [&](int cell) {
+        grid.references[counts[cell].fetch_add(1, std::memory_order_relaxed)] = ids[i];
+      });
+    }
+  });
+
+  parallelFor(0, cells, BUILD_PARALLEL_CHUNK_SIZE, [&](int begin, int end) {
+    for (int cell = begin; cell < end; cell++) {
+      std::sort(grid.references.begin() + grid.cellStart[cell], grid.references.begin() + grid.cellStart[cell + 1]);
+    }
+  });
+}
+
+static Bounds cellBounds(const Grid& grid, int cell) {
+
+  int coordinates[3] = { cell % grid.resolution[0], (cell / grid.resolution[0]) % grid.resolution[1],
+    cell / (grid.resolution[0] * grid.resolution[1]) };
+
+  Bounds bounds;
+  for (int axis = 0; axis < 3; axis++) {
+    component(bounds.min, axis) = grid.bounds.min[axis] + coordinates[axis] * grid.cellSize[axis];
+    component(bounds.max, axis) = coordinates[axis] == grid.resolution[axis] - 1
+      ? grid.bounds.max[axis] : bounds.min[axis] + grid.cellSize[axis];
+  }
+  return bounds;
+}
+
+HierarchicalGrid buildHierarchicalGrid(const face* faces, int count, ThreadPool& pool) {
+
+  HierarchicalGrid grid;
+  if (count == 0) {
+    return grid;
+  }
+
+  std::vector<Bounds> boxes(count);
+  pool.parallelFor(0, count, BUILD_PARALLEL_CHUNK_SIZE, [&](int begin, int end) {
+    for (int i = begin; i < end; i++) {
+      boxes[i] = faceBounds(faces[i]);
+    }
+  });
+
+  for (const Bounds& box : boxes) {
+    grid.top.bounds.grow(box);
+  }
+
+  std::vector<int> ids(count);
+  std::iota(ids.begin(), ids.end(), 0);
+
+  auto parallel = [&pool](int begin, int end, int chunkSize, const std::function<void(int, int)>& body) {
+    pool.parallelFor(begin, end, chunkSize, body);
+  };
+  auto serial = [](int begin, int end, int, const std::function<void(int, int)>& body) {
+    body(begin, end);
+  };
+
+  chooseResolution(grid.top, count, GRID_TOP_DENSITY);
+  fillGrid(grid.top, boxes, ids.data(), count, parallel);
+
+  // crowded cells get a grid of their own over the part of the cell covered
+  // by their faces, one subgrid per task
+  int cells = grid.top.cellCount();
+  grid.subgridOf.assign(cells, -1);
+  std::vector<int> crowded;
+  for (int cell = 0; cell < cells; cell++) {
+    if (grid.top.cellStart[cell + 1] - grid.top.cellStart[cell] > GRID_SUBGRID_MIN_FACES) {
+      grid.subgridOf[cell] = int(crowded.size());
+      crowded.push_back(cell);
+    }
+  }
+
+  grid.subgrids.resize(crowded.size());
+  pool.parallelFor(0, int(crowded.size()), 1, [&](int begin, int end) {
+    for (int i = begin; i < end; i++) {
+
+      int cell = crowded[i];
+      const int* cellIds = grid.top.references.data() + grid.top.cellStart[cell];
+      int cellCount = grid.top.cellStart[cell + 1] - grid.top.cellStart[cell];
+
+      Bounds covered;
+      for (int j = 0; j < cellCount; j++) {
+        covered.grow(boxes[cellIds[j]]);
+      }
+
+      Grid& subgrid = grid.subgrids[i];
+      Bounds bounds = cellBounds(grid.top, cell);
+      for (int axis = 0; axis < 3; axis++) {
+        component(subgrid.bounds.min, axis) = std::max(bounds.min[axis], covered.min[axis]);
+        component(subgrid.bounds.max, axis) = std::max(subgrid.bounds.min[axis], std::min(bounds.max[axis], covered.max[axis]));
+      }
+
+      chooseResolution(subgrid, cellCount, GRID_SUBGRID_DENSITY);
+      fillGrid(subgrid, boxes, cellIds, cellCount, serial);
+    }
+  });
+
+  appendTriangleBlocks(faces, ids.data(), count, grid.faces);
+  return grid;
+}
+
+std::size_t gridReferenceCount(const HierarchicalGrid& grid) {
+
+  std::size_t count = grid.top.references.size();
+  for (const Grid& subgrid : grid.subgrids) {
+    count += subgrid.references.size();
+  }
+  return count;
+}
+
+//===========================================================================
+//============================== Traversal ==================================
+//===========================================================================
+
+// Part of origin + t * dir, t in [tStart, tEnd], inside the bounds
+static bool clipSegment(const Bounds& bounds, const vectorThree& origin, const vectorThree& inverse, float tStart, float tEnd,
+  float& tNear, float& tFar) {
+
+  rayBoxChecks++;
+  tNear = tStart;
+  tFar = tEnd;
+
+  for (int axis = 0; axis < 3; axis++) {
+    float t0 = (bounds.min[axis] - origin[axis]) * inverse[axis];
+    float t1 = (bounds.max[axis] - origin[axis]) * inverse[axis];
+    tNear = std::max(tNear, std::min(t0, t1));
+    tFar = std::min(tFar, std::max(t0, t1));
+  }
+
+  if (tNear > tFar) {
+    return false;
+  }
+  rayBoxIntersections++;
+  return true;
+}
+
+// Walks the cells pierced by origin + t * dir, t in [tStart, tEnd], front to
+// back with a 3D-DDA until visitCell returns true, each cell with the part of
+// the segment inside it. Returns whether visitCell stopped the walk.
+template <typename CellFunction>
+static bool walkGrid(const Grid& grid, const vectorThree& origin, const vectorThree& dir, const vectorThree& inverse,
+  float tStart, float tEnd, CellFunction visitCell) {
+
+  float tNear, tFar;
+  if (!clipSegment(grid.bounds, origin, inverse, tStart, tEnd, tNear, tFar)) {
+    return false;
+  }
+
+  int cell[3], step[3], outside[3];
+  float next[3], delta[3];
+
+  for (int axis = 0; axis < 3; axis++) {
+
+    float offset = origin[axis] + dir[axis] * tNear - grid.bounds.min[axis];
+    cell[axis] = cellCoordinate(grid, grid.bounds.min[axis] + offset, axis);
+
+    // next is where the segment crosses into the next cell along the axis
+    if (dir[axis] > 0.0f) {
+      step[axis] = 1;
+      outside[axis] = grid.resolution[axis];
+      next[axis] = tNear + ((cell[axis] + 1) * grid.cellSize[axis] - offset) * inverse[axis];
+      delta[axis] = grid.cellSize[axis] * inverse[axis];
+    }
+    else if (dir[axis] < 0.0f) {
+      step[axis] = -1;
+      outside[axis] = -1;
+      next[axis] = tNear + (cell[axis] * grid.cellSize[axis] - offset) * inverse[axis];
+      delta[axis] = -grid.cellSize[axis] * inverse[axis];
+    }
+    else {
+      step[axis] = 0;
+      outside[axis] = -1;
+      next[axis] = FLT_MAX;
+      delta[axis] = 0.0f;
+    }
+  }
+
+  while (true) {
+
+    int axis = next[0] < next[1] ? (next[0] < next[2] ? 0 : 2) : (next[1] < next[2] ? 1 : 2);
+    float tExit = std::min(next[axis], tFar);
+
+    if (visitCell(cell[0] + grid.resolution[0] * (cell[1] + grid.resolution[1] * cell[2]), tNear, tExit)) {
+      return true;
+    }
+    if (next[axis] > tFar) {
+      return false;
+    }
+
+    cell[axis] += step[axis];
+    if (cell[axis] == outside[axis]) {
+      return false;
+    }
+    tNear = next[axis];
+    next[axis] += delta[axis];
+  }
+}
+
+// Walks the top level cells and the subgrids inside them, visitCell gets the
+// level and cell of every cell holding faces
+template <typename CellFunction>
+static void walkHierarchicalGrid(const HierarchicalGrid& grid, const vectorThree& origin, const vectorThree& dir,
+  const float& tMax, CellFunction visitCell) {
+
+  if (grid.top.cellStart.empty()) {
+    return;
+  }
+
+  vectorThree inverse = { safeInverse(dir.x), safeInverse(dir.y), safeInverse(dir.z) };
+
+  walkGrid(grid.top, origin, dir, inverse, 0.0f, tMax, [&](int cell, float tEnter, float tExit) {
+
+    int subgrid = grid.subgridOf[cell];
+    if (subgrid < 0) {
+      return visitCell(grid.top, cell, tExit);
+    }
+    return walkGrid(grid.subgrids[subgrid], origin, dir, inverse, tEnter, std::min(tExit, tMax),
+      [&](int subCell, float, float subExit) {
+        return visitCell(grid.subgrids[subgrid], subCell, subExit);
+      });
+  });
+}
+
+void closestHitGrid(const HierarchicalGrid& grid, const vectorThree& origin, const vectorThree& dir, float tMin, RayHit& hit, int cull) {
+
+  Mailbox mailbox;
+  ShearedRay ray(origin, dir, cull);
+
+  walkHierarchicalGrid(grid, origin, dir, hit.t, [&](const Grid& level, int cell, float tExit) {
+
+    for (int i = level.cellStart[cell]; i < level.cellStart[cell + 1]; i++) {
+
+      // hits are kept wherever they lie, a face is never worth a second test
+      int id = level.references[i];
+      if (mailbox.visited(id)) {
+        continue;
+      }
+
+      RayHit laneHit;
+      if (rayLaneIntersection(grid.faces[id / TRIANGLE_BLOCK_SIZE], id % TRIANGLE_BLOCK_SIZE, ray, laneHit)
+        && laneHit.t > tMin && laneHit.t < hit.t) {
+        hit = laneHit;
+      }
+    }
+
+    // cells come front to back, a hit inside this one is the closest
+    return hit.t <= tExit;
+  });
+}
+
+bool anyHitGrid(const HierarchicalGrid& grid, const vectorThree& origin, const vectorThree& dir, float tMin, float tMax, int cull) {
+
+  Mailbox mailbox;
+  ShearedRay ray(origin, dir, cull);
+  bool hit = false;
+
+  walkHierarchicalGrid(grid, origin, dir, tMax, [&](const Grid& level, int cell, float) {
+
+    for (int i = level.cellStart[cell]; i < level.cellStart[cell + 1] && !hit; i++) {
+
+      int id = level.references[i];
+      if (mailbox.visited(id)) {
+        continue;
+      }
+
+      RayHit laneHit;
+      hit = rayLaneIntersection(grid.faces[id / TRIANGLE_BLOCK_SIZE], id % TRIANGLE_BLOCK_SIZE, ray, laneHit)
+        && laneHit.t > tMin && laneHit.t < tMax;
+    }
+    return hit;
+  });
+
+  return hit;
+}
@@ -0,0 +1,67 @@
+#ifndef __GRID__
+#define __GRID__
+
+#include "triangles.hpp"
+#include "threadpool.hpp"
+
+// Two level grid settings. BUILD_GRID offers the grid traversal mode, the grid
+// is only built once that mode traces rays. The top level gets
+// GRID_TOP_DENSITY cells per face, top level cells referencing more than
+// GRID_SUBGRID_MIN_FACES faces get a grid of their own with
+// GRID_SUBGRID_DENSITY cells per reference. No axis gets more than
+// GRID_MAX_RESOLUTION cells.
+static const bool BUILD_GRID = true;
+static const float GRID_TOP_DENSITY = 1.0f;
+static const float GRID_SUBGRID_DENSITY = 2.0f;
+static const int GRID_SUBGRID_MIN_FACES = 12;
+static const int GRID_MAX_RESOLUTION = 256;
+
+// A uniform grid, cell (x, y, z) is cell x + resolution[0] * (y + resolution[1] * z)
+struct Grid {
+	Bounds bounds;
+	int resolution[3] = { 0, 0, 0 };
+	vectorThree cellSize;
+	vectorThree inverseCellSize;
+	// the faces overlapping cell c are references[cellStart[c]] up to
+	// references[cellStart[c + 1]], sorted by index
+	std::vector<int> cellStart;
+	std::vector<int> references;
+
+	int cellCount() const { return resolution[0] * resolution[1] * resolution[2]; }
+};
+
+struct HierarchicalGrid {
+	Grid top;
+	// index into subgrids for every top level cell, -1 for cells whose faces
+	// are intersected directly
+	std::vector<int> subgridOf;
+	std::vector<Grid> subgrids;
+	// the faces the grid was built from, face i in lane i % TRIANGLE_BLOCK_SIZE
+	// of block i / TRIANGLE_BLOCK_SIZE
+	TriangleBlockArray faces;
+};
+
+/**
+ * @brief Builds a two level grid over the faces with the resolution of both
+ * levels chosen from the number of faces per volume. Every level is filled
+ * with a counting sort, the top level and the subgrids in parallel.
+ */
+HierarchicalGrid buildHierarchicalGrid(const face* faces, int count, ThreadPool& pool);
+
+/**
+ * @brief Same as closestHit, on the grid. Cells are walked front to back
+ * with a 3D-DDA and faces referenced by several cells are only tested once.
+ */
+void closestHitGrid(const HierarchicalGrid& grid, const vectorThree& origin, const vectorThree& dir, float tMin, RayHit& hit, int cull = CULL_BY_LANE);
+
+/**
+ * @brief Same as anyHit, on the grid
+ */
+bool anyHitGrid(const HierarchicalGrid& grid, const vectorThree& origin, const vectorThree& dir, float tMin, float tMax, int cull = CULL_BY_LANE);
+
+/**
+ * @brief Face references in all cells of both levels
+ */
+std::size_t gridReferenceCount(const HierarchicalGrid& grid);
+
+#endif // GRID
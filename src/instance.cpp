@@ -0,0 +1,328 @@
+#include "instance.hpp"
+
+static vectorThree transformPoint(const Eigen::Affine3f& transform, const vectorThree& point) {
+
+  Eigen::Vector3f p = transform * Eigen::Vector3f(point.x, point.y, point.z);
+  return { p[0], p[1], p[2] };
+}
+
+//===========================================================================
+//============================ Bottom level =================================
+//===========================================================================
+
+static CullMode materialCullMode(const std::vector<CullMode>& modes, int material) {
+  return material >= 0 && material < int(modes.size()) ? modes[material] : DEFAULT_CULL_MODE;
+}
+
+// Copies the cull modes into the triangle blocks of the mesh, the kd-tree and
+// the grid only have blocks once they were built
+static void cullMesh(MeshBVH& mesh, const std::vector<CullMode>& modes) {
+
+  const face* faces = mesh.bvh.faces.data();
+  applyCullModes(mesh.triangles.blocks, faces, modes);
+  applyCullModes(mesh.kdtree.blocks, faces, modes);
+  applyCullModes(mesh.grid.faces, faces, modes);
+}
+
+static int instanceCullMode(const InstancedScene& scene, int material) {
+  return material >= 0 ? materialCullMode(scene.cullModes, material) : CULL_BY_LANE;
+}
+
+int addMesh(InstancedScene& scene, const std::vector<face>& faces) {
+
+  MeshBVH mesh;
+  mesh.bvh = flattenBVH(buildBVH(faces, BUILD_MODE));
+  mesh.triangles = buildTriangleLeaves(mesh.bvh);
+  mesh.stackless = buildStacklessLinks(mesh.bvh);
+  mesh.bvh4 = collapseBVH4(mesh.bvh);
+  if (BUILD_QUANTIZED) {
+    mesh.qbvh4 = quantizeBVH4(mesh.bvh4);
+  }
+  if (cpuSupportsAVX2()) {
+    mesh.bvh8 = collapseBVH8(mesh.bvh);
+  }
+
+  cullMesh(mesh, scene.cullModes);
+  scene.meshes.push_back(std::move(mesh));
+  return int(scene.meshes.size()) - 1;
+}
+
+void prepareMeshes(InstancedScene& scene, TraversalMode mode, ThreadPool& pool) {
+
+  // meshes never move in object space, so what was built once stays valid
+  for (MeshBVH& mesh : scene.meshes) {
+    if (mode == TRAVERSAL_KDTREE && BUILD_KDTREE && mesh.kdtree.nodes.empty() && !mesh.bvh.faces.empty()) {
+      mesh.kdtree = buildKdTree(mesh.bvh.faces.data(), int(mesh.bvh.faces.size()));
+      cullMesh(mesh, scene.cullModes);
+    }
+    if (mode == TRAVERSAL_GRID && BUILD_GRID && mesh.grid.top.cellStart.empty() && !mesh.bvh.faces.empty()) {
+      mesh.grid = buildHierarchicalGrid(mesh.bvh.faces.data(), int(mesh.bvh.faces.size()), pool);
+      cullMesh(mesh, scene.cullModes);
+    }
+  }
+}
+
+//===========================================================================
+//============================== Top level ==================================
+//===========================================================================
+
+static Bounds instanceBounds(const InstancedScene& scene, const Instance& instance) {
+
+  Bounds bounds;
+  const LinearBVH& bvh = scene.meshes[instance.mesh].bvh;
+  if (bvh.nodes.empty()) {
+    return bounds;
+  }
+
+  // the world bounds enclose all eight transformed corners of the object bounds
+  Bounds object = bvh.nodes[0].getBounds();
+  for (int corner = 0; corner < 8; corner++) {
+    vectorThree point = {
+      corner & 1 ? object.max.x : object.min.x,
+      corner & 2 ? object.max.y : object.min.y,
+      corner & 4 ? object.max.z : object.min.z };
+    bounds.grow(transformPoint(instance.transform, point));
+  }
+  return bounds;
+}
+
+int addInstance(InstancedScene& scene, int mesh, const Eigen::Affine3f& transform, int material) {
+
+  Instance instance;
+  instance.mesh = mesh;
+  instance.material = material;
+  instance.cull = instanceCullMode(scene, material);
+  scene.instances.push_back(instance);
+
+  int index = int(scene.instances.size()) - 1;
+  setInstanceTransform(scene, index, transform);
+  return index;
+}
+
+void setInstanceCullModes(InstancedScene& scene, const std::vector<CullMode>& modes) {
+
+  scene.cullModes = modes;
+  for (MeshBVH& mesh : scene.meshes) {
+    cullMesh(mesh, modes);
+  }
+
+  for (Instance& instance : scene.instances) {
+    instance.cull = instanceCullMode(scene, instance.material);
+  }
+}
+
+void setInstanceTransform(InstancedScene& scene, int instance, const Eigen::Affine3f& transform) {
+
+  Instance& current = scene.instances[instance];
+  current.transform = transform;
+  current.inverse = transform.inverse();
+  current.normalMatrix = transform.linear().inverse().transpose();
+  current.worldBounds = instanceBounds(scene, current);
+}
+
+// Median split on the longest axis of the instance centers, instances are few
+// so the top level favours a quick rebuild over the best possible tree
+static int buildTopNode(InstancedScene& scene, int begin, int end, int depth) {
+
+  LinearBVH& top = scene.top;
+  int index = int(top.nodes.size());
+  top.nodes.emplace_back();
+
+  Bounds bounds;
+  Bounds centers;
+  for (int i = begin; i < end; i++) {
+    Bounds instance = scene.instances[scene.instanceOrder[i]].worldBounds;
+    bounds.grow(instance);
+    centers.grow((instance.min + instance.max) * 0.5f);
+  }
+
+  LinearNode node;
+  node.setBounds(bounds);
+
+  if (end - begin <= TLAS_MAX_LEAF_SIZE || depth >= BVH_MAX_DEPTH - 1) {
+    node.offset = begin;
+    node.count = end - begin;
+  }
+  else {
+
+    int axis = centers.maxAxis();
+    int mid = begin + (end - begin) / 2;
+    std::nth_element(scene.instanceOrder.begin() + begin, scene.instanceOrder.begin() + mid, scene.instanceOrder.begin() + end,
+      [&scene, axis](int a, int b) {
+        const Bounds& first = scene.instances[a].worldBounds;
+        const Bounds& second = scene.instances[b].worldBounds;
+        return first.min[axis] + first.max[axis] < second.min[axis] + second.max[axis];
+      });
+
+    buildTopNode(scene, begin, mid, depth + 1);
+    node.offset = buildTopNode(scene, mid, end, depth + 1);
+    node.count = 0;
+  }
+
+  // the recursion may have reallocated the array, so write the node last
+  top.nodes[index] = node;
+  return index;
+}
+
+void buildTopLevel(InstancedScene& scene) {
+
+  scene.top.nodes.clear();
+  scene.instanceOrder.resize(scene.instances.size());
+  for (int i = 0; i < scene.instances.size(); i++) {
+    scene.instanceOrder[i] = i;
+  }
+
+  if (!scene.instances.empty()) {
+    buildTopNode(scene, 0, int(scene.instances.size()), 0);
+  }
+}
+
+//===========================================================================
+//============================== Traversal ==================================
+//===========================================================================
+
+// Brings a face hit in object space back into world space and applies the
+// material override of the instance
+static face worldFace(const Instance& instance, const face& objectFace) {
+
+  face result = objectFace;
+  result.vertex1 = transformPoint(instance.transform, objectFace.vertex1);
+  result.vertex2 = transformPoint(instance.transform, objectFace.vertex2);
+  result.vertex3 = transformPoint(instance.transform, objectFace.vertex3);
+
+  Eigen::Vector3f normal = (instance.normalMatrix * Eigen::Vector3f(objectFace.normal.x, objectFace.normal.y, objectFace.normal.z)).normalized();
+  result.normal = { normal[0], normal[1], normal[2] };
+
+  if (instance.material >= 0) {
+    result.material_id = instance.material;
+  }
+  return result;
+}
+
+bool intersectInstances(const InstancedScene& scene, TraversalMode mode, vectorThree& origin, vectorThree& dest,
+  float& minDistance, face& hitFace, vectorThree& hitPoint) {
+
+  if (scene.instances.empty()) {
+    return false;
+  }
+
+  // affine maps keep the segment parameter, so every instance shares the
+  // closest hit in t and the object space segments cover exactly the same
+  // part of the ray
+  vectorThree dir = dest - origin;
+  float length = dir.length();
+  if (length == 0.0f) {
+    return false;
+  }
+  float tMin = 0.0001f / length;
+
+  RayHit hit;
+  hit.t = std::min(1.0f, minDistance / length);
+  int hitInstance = -1;
+
+  traverseNearToFar(scene.top, origin, dir, hit.t, [&](int topLeaf) {
+
+    const LinearNode& topNode = scene.top.nodes[topLeaf];
+    for (int i = topNode.offset; i < topNode.offset + topNode.count; i++) {
+
+      const Instance& instance = scene.instances[scene.instanceOrder[i]];
+      const MeshBVH& mesh = scene.meshes[instance.mesh];
+
+      vectorThree objectOrigin = transformPoint(instance.inverse, origin);
+      vectorThree objectDir = transformPoint(instance.inverse, dest) - objectOrigin;
+
+      float t = hit.t;
+      if (mode == TRAVERSAL_BVH8) {
+        closestHit8(mesh.bvh8, mesh.bvh, mesh.triangles, objectOrigin, objectDir, tMin, hit, instance.cull);
+      }
+      else if (mode == TRAVERSAL_BVH4) {
+        closestHit4(mesh.bvh4, mesh.bvh, mesh.triangles, objectOrigin, objectDir, tMin, hit, instance.cull);
+      }
+      else if (mode == TRAVERSAL_QBVH4) {
+        closestHitQ4(mesh.qbvh4, mesh.bvh, mesh.triangles, objectOrigin, objectDir, tMin, hit, instance.cull);
+      }
+      else if (mode == TRAVERSAL_STACKLESS) {
+        closestHitStackless(mesh.bvh, mesh.stackless, mesh.triangles, objectOrigin, objectDir, tMin, hit, instance.cull);
+      }
+      else if (mode == TRAVERSAL_KDTREE) {
+        closestHitKd(mesh.kdtree, objectOrigin, objectDir, tMin, hit, instance.cull);
+      }
+      else if (mode == TRAVERSAL_GRID) {
+        closestHitGrid(mesh.grid, objectOrigin, objectDir, tMin, hit, instance.cull);
+      }
+      else {
+        closestHit(mesh.bvh, mesh.triangles, objectOrigin, objectDir, tMin, hit, instance.cull);
+      }
+
+      if (hit.t < t) {
+        hitInstance = scene.instanceOrder[i];
+      }
+    }
+  });
+
+  if (hitInstance < 0) {
+    return false;
+  }
+
+  const Instance& instance = scene.instances[hitInstance];
+  const MeshBVH& mesh = scene.meshes[instance.mesh];
+  hitFace = worldFace(instance, sidedFace(mesh.bvh.faces[hit.face], hit.front));
+  hitPoint = origin + dir * hit.t;
+  minDistance = hit.t * length;
+  return true;
+}
+
+bool occludedInstances(const InstancedScene& scene, TraversalMode mode, vectorThree& origin, vectorThree& dest, float minDistance) {
+
+  if (scene.instances.empty()) {
+    return false;
+  }
+
+  vectorThree dir = dest - origin;
+  float length = dir.length();
+  if (length == 0.0f) {
+    return false;
+  }
+  float tMin = minDistance / length;
+
+  return traverseAnyHit(scene.top, origin, dir, 1.0f, [&](int topLeaf) {
+
+    const LinearNode& topNode = scene.top.nodes[topLeaf];
+    for (int i = topNode.offset; i < topNode.offset + topNode.count; i++) {
+
+      const Instance& instance = scene.instances[scene.instanceOrder[i]];
+      const MeshBVH& mesh = scene.meshes[instance.mesh];
+
+      vectorThree objectOrigin = transformPoint(instance.inverse, origin);
+      vectorThree objectDir = transformPoint(instance.inverse, dest) - objectOrigin;
+
+      bool hit;
+      if (mode == TRAVERSAL_BVH8) {
+        hit = anyHit8(mesh.bvh8, mesh.bvh, mesh.triangles, objectOrigin, objectDir, tMin, 1.0f, instance.cull);
+      }
+      else if (mode == TRAVERSAL_BVH4) {
+        hit = anyHit4(mesh.bvh4, mesh.bvh, mesh.triangles, objectOrigin, objectDir, tMin, 1.0f, instance.cull);
+      }
+      else if (mode == TRAVERSAL_QBVH4) {
+        hit = anyHitQ4(mesh.qbvh4, mesh.bvh, mesh.triangles, objectOrigin, objectDir, tMin, 1.0f, instance.cull);
+      }
+      else if (mode == TRAVERSAL_STACKLESS) {
+        hit = anyHitStackless(mesh.bvh, mesh.stackless, mesh.triangles, objectOrigin, objectDir, tMin, 1.0f, instance.cull);
+      }
+      else if (mode == TRAVERSAL_KDTREE) {
+        hit = anyHitKd(mesh.kdtree, objectOrigin, objectDir, tMin, 1.0f, instance.cull);
+      }
+      else if (mode == TRAVERSAL_GRID) {
+        hit = anyHitGrid(mesh.grid, objectOrigin, objectDir, tMin, 1.0f, instance.cull);
+      }
+      else {
+        hit = anyHit(mesh.bvh, mesh.triangles, objectOrigin, objectDir, tMin, 1.0f, instance.cull);
+      }
+
+      if (hit) {
+        return true;
+      }
+    }
+    return false;
+  });
+}
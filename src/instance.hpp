@@ -0,0 +1,99 @@
+#ifndef __INSTANCE__
+#define __INSTANCE__
+
+#include "widebvh.hpp"
+#include "stackless.hpp"
+#include "kdtree.hpp"
+#include "grid.hpp"
+
+// Most instances a top level leaf holds
+static const int TLAS_MAX_LEAF_SIZE = 2;
+
+// A bottom level hierarchy, built once per unique mesh in its object space
+// and shared by all instances of that mesh
+struct MeshBVH {
+	LinearBVH bvh;
+	TriangleLeaves triangles;
+	BVH4 bvh4;
+	BVH8 bvh8;
+	QBVH4 qbvh4;
+	StacklessLinks stackless;
+	KdTree kdtree;
+	HierarchicalGrid grid;
+};
+
+struct Instance {
+	int mesh;
+	// object to world space, the inverse brings rays into object space
+	Eigen::Affine3f transform;
+	Eigen::Affine3f inverse;
+	Eigen::Matrix3f normalMatrix;
+	// material used for all faces of the instance, -1 keeps the mesh materials
+	int material;
+	// CullMode of the material override, handed to the traversal so the mesh
+	// is shared. CULL_BY_LANE without an override.
+	int cull;
+	Bounds worldBounds;
+
+	EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+};
+
+struct InstancedScene {
+	std::vector<MeshBVH> meshes;
+	std::vector<Instance, Eigen::aligned_allocator<Instance>> instances;
+	// top level hierarchy over the world bounds of the instances, the leaves
+	// reference ranges of instanceOrder
+	LinearBVH top;
+	std::vector<int> instanceOrder;
+	// cull modes of the materials, indexed like them
+	std::vector<CullMode> cullModes;
+};
+
+/**
+ * @brief Builds the bottom level hierarchy of a mesh and returns its index
+ */
+int addMesh(InstancedScene& scene, const std::vector<face>& faces);
+
+/**
+ * @brief Builds the kd-trees or grids of the meshes when the traversal mode
+ * needs them, addMesh leaves them out
+ */
+void prepareMeshes(InstancedScene& scene, TraversalMode mode, ThreadPool& pool);
+
+/**
+ * @brief Places a copy of a mesh, call buildTopLevel afterwards
+ * @param material Material override, -1 keeps the materials of the mesh
+ */
+int addInstance(InstancedScene& scene, int mesh, const Eigen::Affine3f& transform, int material);
+
+/**
+ * @brief Sets the cull modes of the materials, copies them into the triangle
+ * blocks of all meshes and updates the cull override of every instance
+ */
+void setInstanceCullModes(InstancedScene& scene, const std::vector<CullMode>& modes);
+
+/**
+ * @brief Moves an instance, call buildTopLevel afterwards
+ */
+void setInstanceTransform(InstancedScene& scene, int instance, const Eigen::Affine3f& transform);
+
+/**
+ * @brief Rebuilds the top level hierarchy, the meshes are left untouched
+ */
+void buildTopLevel(InstancedScene& scene);
+
+/**
+ * @brief Finds the closest instance face hit by the segment from origin to
+ * dest that is nearer than minDistance. Rays are transformed into the object
+ * space of every instance, the hit is reported in world space.
+ */
+bool intersectInstances(const InstancedScene& scene, TraversalMode mode, vectorThree& origin, vectorThree& dest,
+	float& minDistance, face& hitFace, vectorThree& hitPoint);
+
+/**
+ * @brief Whether any instance face is hit by the segment from origin to dest,
+ * ignoring hits closer to origin than minDistance
+ */
+bool occludedInstances(const InstancedScene& scene, TraversalMode mode, vectorThree& origin, vectorThree& dest, float minDistance);
+
+#endif // INSTANCE
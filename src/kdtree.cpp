@@ -0,0 +1,433 @@
+#include "kdtree.hpp"
+#include <cmath>
+
+static float& component(vectorThree& v, int axis) {
+  return axis == 0 ? v.x : (axis == 1 ? v.y : v.z);
+}
+
+static Bounds faceBounds(const face& currentFace) {
+
+  Bounds bounds;
+  bounds.grow(currentFace.vertex1);
+  bounds.grow(currentFace.vertex2);
+  bounds.grow(currentFace.vertex3);
+  return bounds;
+}
+
+// Bounds of the part of the triangle inside the box, empty when they do not
+// overlap. The triangle is clipped against the six planes of the box one at
+// a time, every plane adds at most one vertex.
+static Bounds clipFace(const face& currentFace, const Bounds& box) {
+
+  vectorThree polygon[9] = { currentFace.vertex1, currentFace.vertex2, currentFace.vertex3 };
+  vectorThree clipped[9];
+  int count = 3;
+
+  for (int plane = 0; plane < 6 && count > 0; plane++) {
+
+    int axis = plane % 3;
+    bool keepAbove = plane < 3;
+    float position = keepAbove ? box.min[axis] : box.max[axis];
+
+    int clippedCount = 0;
+    for (int i = 0; i < count; i++) {
+
+      vectorThree& a = polygon[i];
+      vectorThree& b = polygon[(i + 1) % count];
+      float da = keepAbove ? a[axis] - position : position - a[axis];
+      float db = keepAbove ? b[axis] - position : position - b[axis];
+
+      if (da >= 0.0f) {
+        clipped[clippedCount++] = a;
+      }
+      if ((da < 0.0f && db > 0.0f) || (da > 0.0f && db < 0.0f)) {
+        vectorThree crossing = a + (b - a) * (da / (da - db));
+        // keep the crossing exactly on the plane despite rounding
+        component(crossing, axis) = position;
+        clipped[clippedCount++] = crossing;
+      }
+    }
+
+    count = clippedCount;
+    std::copy(clipped, clipped + count, polygon);
+  }
+
+  Bounds bounds;
+  for (int i = 0; i < count; i++) {
+    bounds.grow(polygon[i]);
+  }
+  return bounds;
+}
+
+// Bounds::empty only looks at x, a clipped triangle can be empty on any axis
+static bool validBounds(const Bounds& bounds) {
+  return bounds.min.x <= bounds.max.x && bounds.min.y <= bounds.max.y && bounds.min.z <= bounds.max.z;
+}
+
+//===========================================================================
+//=============================== Building ==================================
+//===========================================================================
+
+// Faces start, end or lie in a candidate plane. At the same position ends
+// sort first, so the faces left of a plane are counted before it.
+enum KdEventType {
+  KD_EVENT_END,
+  KD_EVENT_PLANAR,
+  KD_EVENT_START
+};
+
+struct KdEvent {
+  float position;
+  KdEventType type;
+
+  bool operator< (const KdEvent& other) const {
+    return position < other.position || (position == other.position && type < other.type);
+  }
+};
+
+struct KdSplit {
+  int axis = -1;
+  float position = 0.0f;
+  // faces lying in the plane go below it
+  bool planarBelow = true;
+  float cost = FLT_MAX;
+};
+
+struct KdBuilder {
+  const face* faces;
+  KdTree& tree;
+  int maxDepth;
+  std::vector<KdEvent> events;
+};
+
+static float splitCost(const Bounds& bounds, int axis, float position, int below, int above) {
+
+  Bounds lower = bounds;
+  Bounds upper = bounds;
+  component(lower.max, axis) = position;
+  component(upper.min, axis) = position;
+
+  float area = bounds.surfaceArea();
+  float cost = SAH_INTERSECTION_COST * (lower.surfaceArea() / area * below + upper.surfaceArea() / area * above);
+
+  // cutting off empty space makes the rays crossing it cheaper than the SAH
+  // alone predicts
+  if (below == 0 || above == 0) {
+    cost *= 1.0f - KD_EMPTY_BONUS;
+  }
+  return SAH_TRAVERSAL_COST + cost;
+}
+
+// Sweeps the clipped bounds of the faces along every axis, keeping the number
+// of faces below and above each candidate plane
+static KdSplit findKdSplit(KdBuilder& builder, const Bounds& bounds, const std::vector<Bounds>& boxes) {
+
+  KdSplit best;
+  int count = int(boxes.size());
+  std::vector<KdEvent>& events = builder.events;
+
+  for (int axis = 0; axis < 3; axis++) {
+
+    float low = bounds.min[axis];
+    float high = bounds.max[axis];
+    if (high <= low) {
+      continue;
+    }
+
+    events.clear();
+    for (const Bounds& box : boxes) {
+      if (box.min[axis] == box.max[axis]) {
+        events.push_back({ box.min[axis], KD_EVENT_PLANAR });
+      }
+      else {
+        events.push_back({ box.min[axis], KD_EVENT_START });
+        events.push_back({ box.max[axis], KD_EVENT_END });
+      }
+    }
+    std::sort(events.begin(), events.end());
+
+    int below = 0;
+    int above = count;
+
+    for (int i = 0; i < events.size();) {
+
+      float position = events[i].position;
+      int ending = 0;
+      int planar = 0;
+      int starting = 0;
+      for (; i < events.size() && events[i].position == position && events[i].type == KD_EVENT_END; i++) {
+        ending++;
+      }
+      for (; i < events.size() && events[i].position == position && events[i].type == KD_EVENT_PLANAR; i++) {
+        planar++;
+      }
+      for (; i < events.size() && events[i].position == position && events[i].type == KD_EVENT_START; i++) {
+        starting++;
+      }
+
+      above -= planar + ending;
+
+      if (position > low && position < high) {
+
+        float cost = splitCost(bounds, axis, position, below + planar, above);
+        if (cost < best.cost) {
+          best = { axis, position, true, cost };
+        }
+        cost = splitCost(bounds, axis, position, below, above + planar);
+        if (cost < best.cost) {
+          best = { axis, position, false, cost };
+        }
+      }
+
+      below += starting + planar;
+    }
+  }
+
+  return best;
+}
+
+static void buildKdNode(KdBuilder& builder, const Bounds& bounds, const std::vector<int>& indices, const std::vector<Bounds>& boxes, int depth) {
+
+  KdTree& tree = builder.tree;
+  int index = int(tree.nodes.size());
+  tree.nodes.emplace_back();
+
+  int count = int(indices.size());
+  KdSplit split;
+  if (count > 1 && depth < builder.maxDepth && bounds.surfaceArea() > 0.0f) {
+    split = findKdSplit(builder, bounds, boxes);
+  }
+
+  if (split.axis < 0 || split.cost >= SAH_INTERSECTION_COST * count) {
+    tree.nodes[index].firstBlock = int(tree.blocks.size());
+    tree.nodes[index].flags = (count << 2) | 3;
+    appendTriangleBlocks(builder.faces, indices.data(), count, tree.blocks);
+    return;
+  }
+
+  Bounds lower = bounds;
+  Bounds upper = bounds;
+  component(lower.max, split.axis) = split.position;
+  component(upper.min, split.axis) = split.position;
+
+  std::vector<int> lowerIndices, upperIndices;
+  std::vector<Bounds> lowerBoxes, upperBoxes;
+
+  for (int i = 0; i < count; i++) {
+
+    float min = boxes[i].min[split.axis];
+    float max = boxes[i].max[split.axis];
+
+    bool inLower, inUpper;
+    if (min == max && min == split.position) {
+      inLower = split.planarBelow;
+      inUpper = !split.planarBelow;
+    }
+    else {
+      inLower = min < split.position;
+      inUpper = max > split.position;
+    }
+
+    // faces on both sides are clipped again, their bounds may overlap a
+    // side the triangle itself misses
+    if (inLower && inUpper) {
+      Bounds lowerBox = clipFace(builder.faces[indices[i]], lower);
+      Bounds upperBox = clipFace(builder.faces[indices[i]], upper);
+      inLower = validBounds(lowerBox);
+      inUpper = validBounds(upperBox);
+      if (inLower) {
+        lowerIndices.push_back(indices[i]);
+        lowerBoxes.push_back(lowerBox);
+      }
+      if (inUpper) {
+        upperIndices.push_back(indices[i]);
+        upperBoxes.push_back(upperBox);
+      }
+    }
+    else if (inLower) {
+      lowerIndices.push_back(indices[i]);
+      lowerBoxes.push_back(boxes[i]);
+    }
+    else if (inUpper) {
+      upperIndices.push_back(indices[i]);
+      upperBoxes.push_back(boxes[i]);
+    }
+  }
+
+  buildKdNode(builder, lower, lowerIndices, lowerBoxes, depth + 1);
+  int aboveChild = int(tree.nodes.size());
+  buildKdNode(builder, upper, upperIndices, upperBoxes, depth + 1);
+
+  // the children may have reallocated the nodes, so write the node last
+  tree.nodes[index].split = split.position;
+  tree.nodes[index].flags = (aboveChild << 2) | split.axis;
+}
+
+KdTree buildKdTree(const face* faces, int count) {
+
+  KdTree tree;
+  if (count == 0) {
+    return tree;
+  }
+
+  std::vector<int> indices(count);
+  std::vector<Bounds> boxes(count);
+  for (int i = 0; i < count; i++) {
+    indices[i] = i;
+    boxes[i] = faceBounds(faces[i]);
+    tree.bounds.grow(boxes[i]);
+  }
+
+  int maxDepth = int(std::round(KD_DEPTH_BASE + KD_DEPTH_FACTOR * std::log2(float(count))));
+  KdBuilder builder = { faces, tree, std::min(maxDepth, KD_MAX_DEPTH), {} };
+  buildKdNode(builder, tree.bounds, indices, boxes, 0);
+
+  return tree;
+}
+
+int kdTreeDepth(const KdTree& tree) {
+
+  if (tree.nodes.empty()) {
+    return 0;
+  }
+
+  int depth = 0;
+  std::vector<std::pair<int, int>> stack;
+  stack.push_back({ 0, 0 });
+
+  while (!stack.empty()) {
+
+    int index = stack.back().first;
+    int nodeDepth = stack.back().second;
+    stack.pop_back();
+
+    const KdNode& node = tree.nodes[index];
+    if (node.isLeaf()) {
+      depth = std::max(depth, nodeDepth);
+    }
+    else {
+      stack.push_back({ index + 1, nodeDepth + 1 });
+      stack.push_back({ node.aboveChild(), nodeDepth + 1 });
+    }
+  }
+
+  return depth;
+}
+
+//===========================================================================
+//============================== Traversal ==================================
+//===========================================================================
+
+// Part of origin + t * dir, t in [0, tMax], inside the bounds
+static bool clipSegment(const Bounds& bounds, const vectorThree& origin, const vectorThree& inverse, float tMax, float& tNear, float& tFar) {
+
+  rayBoxChecks++;
+  tNear = 0.0f;
+  tFar = tMax;
+
+  for (int axis = 0; axis < 3; axis++) {
+    float t0 = (bounds.min[axis] - origin[axis]) * inverse[axis];
+    float t1 = (bounds.max[axis] - origin[axis]) * inverse[axis];
+    tNear = std::max(tNear, std::min(t0, t1));
+    tFar = std::min(tFar, std::max(t0, t1));
+  }
+
+  if (tNear > tFar) {
+    return false;
+  }
+  rayBoxIntersections++;
+  return true;
+}
+
+// Walks the leaves pierced by the segment front to back, each with the part
+// of the segment inside it, until visitLeaf returns true. visitLeaf may lower
+// tMax, the leaves beyond it are skipped.
+template <typename LeafFunction>
+static void traverseKd(const KdTree& tree, const vectorThree& origin, const vectorThree& dir, const float& tMax, LeafFunction visitLeaf) {
+
+  if (tree.nodes.empty()) {
+    return;
+  }
+
+  vectorThree inverse = { safeInverse(dir.x), safeInverse(dir.y), safeInverse(dir.z) };
+
+  float tNear, tFar;
+  if (!clipSegment(tree.bounds, origin, inverse, tMax, tNear, tFar)) {
+    return;
+  }
+
+  struct Entry {
+    int node;
+    float tNear;
+    float tFar;
+  };
+  Entry stack[KD_MAX_DEPTH + 1];
+  int stackSize = 0;
+  int current = 0;
+
+  while (true) {
+
+    if (tNear <= tMax) {
+
+      const KdNode& node = tree.nodes[current];
+
+      if (!node.isLeaf()) {
+
+        int axis = node.axis();
+        float tPlane = (node.split - origin[axis]) * inverse[axis];
+        bool belowFirst = origin[axis] < node.split || (origin[axis] == node.split && dir[axis] <= 0.0f);
+        int first = belowFirst ? current + 1 : node.aboveChild();
+        int second = belowFirst ? node.aboveChild() : current + 1;
+
+        // the plane is only crossed when it lies within the current part
+        if (tPlane > tFar || tPlane <= 0.0f) {
+          current = first;
+        }
+        else if (tPlane < tNear) {
+          current = second;
+        }
+        else {
+          stack[stackSize++] = { second, tPlane, tFar };
+          current = first;
+          tFar = tPlane;
+        }
+        continue;
+      }
+
+      if (visitLeaf(node, tFar)) {
+        return;
+      }
+    }
+
+    if (stackSize == 0) {
+      return;
+    }
+    stackSize--;
+    current = stack[stackSize].node;
+    tNear = stack[stackSize].tNear;
+    tFar = stack[stackSize].tFar;
+  }
+}
+
+static int blockCount(const KdNode& leaf) {
+  return (leaf.count() + TRIANGLE_BLOCK_SIZE - 1) / TRIANGLE_BLOCK_SIZE;
+}
+
+void closestHitKd(const KdTree& tree, const vectorThree& origin, const vectorThree& dir, float tMin, RayHit& hit, int cull) {
+
+  traverseKd(tree, origin, dir, hit.t, [&](const KdNode& leaf, float tFar) {
+    intersectBlocks(tree.blocks.data() + leaf.firstBlock, blockCount(leaf), origin, dir, tMin, hit, cull);
+    // leaves come front to back, a hit inside this one is the closest
+    return hit.t <= tFar;
+  });
+}
+
+bool anyHitKd(const KdTree& tree, const vectorThree& origin, const vectorThree& dir, float tMin, float tMax, int cull) {
+
+  bool hit = false;
+  traverseKd(tree, origin, dir, tMax, [&](const KdNode& leaf, float) {
+    hit = occludedBlocks(tree.blocks.data() + leaf.firstBlock, blockCount(leaf), origin, dir, tMin, tMax, cull);
+    return hit;
+  });
+  return hit;
+}
@@ -0,0 +1,72 @@
+#ifndef __KDTREE__
+#define __KDTREE__
+
+#include "triangles.hpp"
+
+// SAH kd-tree settings. BUILD_KDTREE offers the kd-tree traversal mode, the
+// tree is only built once that mode traces rays. Splits cutting off empty
+// space get their cost lowered by the bonus, the depth is limited to
+// KD_DEPTH_BASE + KD_DEPTH_FACTOR * log2(faces) and never exceeds
+// KD_MAX_DEPTH.
+static const bool BUILD_KDTREE = true;
+static const float KD_EMPTY_BONUS = 0.2f;
+static const int KD_DEPTH_BASE = 8;
+static const float KD_DEPTH_FACTOR = 1.3f;
+static const int KD_MAX_DEPTH = 48;
+
+// A node of the kd-tree in 8 bytes. The child below the split follows its
+// parent, the child above it is stored.
+struct KdNode {
+	union {
+		// split plane of interior nodes
+		float split;
+		// first triangle block of leaves
+		int firstBlock;
+	};
+	// the split axis in the lowest two bits, 3 for leaves. Above them the
+	// index of the child above the split, or the face count of a leaf.
+	int flags;
+
+	bool isLeaf() const { return (flags & 3) == 3; }
+
+	int axis() const { return flags & 3; }
+
+	int aboveChild() const { return flags >> 2; }
+
+	int count() const { return flags >> 2; }
+};
+
+static_assert(sizeof(KdNode) == 8, "KdNode must fit in 8 bytes");
+
+struct KdTree {
+	std::vector<KdNode> nodes;
+	// faces of the leaves, a face overlapping several leaves is stored in each
+	// of them. The lanes reference the faces the tree was built from.
+	TriangleBlockArray blocks;
+	Bounds bounds;
+};
+
+/**
+ * @brief Builds a kd-tree over the faces with the sweep SAH. Split candidates
+ * are the bounds of the faces clipped to the node, so faces only end up in
+ * the leaves they overlap.
+ */
+KdTree buildKdTree(const face* faces, int count);
+
+/**
+ * @brief Same as closestHit, on the kd-tree. Leaves are visited front to back
+ * and the traversal ends at the first leaf holding the closest hit.
+ */
+void closestHitKd(const KdTree& tree, const vectorThree& origin, const vectorThree& dir, float tMin, RayHit& hit, int cull = CULL_BY_LANE);
+
+/**
+ * @brief Same as anyHit, on the kd-tree
+ */
+bool anyHitKd(const KdTree& tree, const vectorThree& origin, const vectorThree& dir, float tMin, float tMax, int cull = CULL_BY_LANE);
+
+/**
+ * @brief Depth of the deepest leaf
+ */
+int kdTreeDepth(const KdTree& tree);
+
+#endif // KDTREE
@@ -0,0 +1,372 @@
+#include "lbvh.hpp"
+
+//===========================================================================
+//============================ Morton codes =================================
+//===========================================================================
+
+struct MortonPrimitive {
+  unsigned int code;
+  int index;
+};
+
+// Spreads the lower 10 bits of v so there are two zero bits between each of them
+static unsigned int expandBits(unsigned int v) {
+
+  v = (v * 0x00010001u) & 0xFF0000FFu;
+  v = (v * 0x00000101u) & 0x0F00F00Fu;
+  v = (v * 0x00000011u) & 0xC30C30C3u;
+  v = (v * 0x00000005u) & 0x49249249u;
+  return v;
+}
+
+static unsigned int quantize(float value, float min, float extent) {
+
+  if (extent <= 0.0f) {
+    return 0;
+  }
+
+  int cell = int(1024.0f * (value - min) / extent);
+  return unsigned(std::min(std::max(cell, 0), 1023));
+}
+
+static vectorThree faceCentroid(const face& currentFace) {
+
+  Bounds bounds;
+  bounds.grow(currentFace.vertex1);
+  bounds.grow(currentFace.vertex2);
+  bounds.grow(currentFace.vertex3);
+  return (bounds.min + bounds.max) * 0.5f;
+}
+
+static unsigned int mortonCode(const vectorThree& centroid, const Bounds& centroidBounds) {
+
+  const vectorThree& min = centroidBounds.min;
+  const vectorThree& max = centroidBounds.max;
+
+  unsigned int x = quantize(centroid.x, min.x, max.x - min.x);
+  unsigned int y = quantize(centroid.y, min.y, max.y - min.y);
+  unsigned int z = quantize(centroid.z, min.z, max.z - min.z);
+
+  return (expandBits(x) << 2) | (expandBits(y) << 1) | expandBits(z);
+}
+
+// Stable least significant digit radix sort of the 30 bit codes. Every pass
+// counts digits per chunk in parallel, turns the counts into per chunk offsets
+// and scatters the chunks in parallel.
+static void radixSort(std::vector<MortonPrimitive>& keys, ThreadPool& pool) {
+
+  const int buckets = 1 << LBVH_RADIX_BITS;
+  int n = int(keys.size());
+  int chunks = (n + BUILD_PARALLEL_CHUNK_SIZE - 1) / BUILD_PARALLEL_CHUNK_SIZE;
+
+  std::vector<MortonPrimitive> sorted(keys.size());
+  std::vector<int> offsets(chunks * buckets);
+
+  for (int shift = 0; shift < 30; shift += LBVH_RADIX_BITS) {
+
+    std::fill(offsets.begin(), offsets.end(), 0);
+
+    pool.parallelFor(0, n, BUILD_PARALLEL_CHUNK_SIZE, [&](int begin, int end) {
+      int* counts = &offsets[(begin / BUILD_PARALLEL_CHUNK_SIZE) * buckets];
+      for (int i = begin; i < end; i++) {
+        counts[(keys[i].code >> shift) & (buckets - 1)]++;
+      }
+    });
+
+    // digit major, chunk minor, so equal digits keep the order of their chunks
+    int total = 0;
+    for (int digit = 0; digit < buckets; digit++) {
+      for (int chunk = 0; chunk < chunks; chunk++) {
+        int count = offsets[chunk * buckets + digit];
+        offsets[chunk * buckets + digit] = total;
+        total += count;
+      }
+    }
+
+    pool.parallelFor(0, n, BUILD_PARALLEL_CHUNK_SIZE, [&](int begin, int end) {
+      int* next = &offsets[(begin / BUILD_PARALLEL_CHUNK_SIZE) * buckets];
+      for (int i = begin; i < end; i++) {
+        sorted[next[(keys[i].code >> shift) & (buckets - 1)]++] = keys[i];
+      }
+    });
+
+    keys.swap(sorted);
+  }
+}
+
+//===========================================================================
+//============================ Hierarchy ====================================
+//===========================================================================
+
+static int highestBit(unsigned int v) {
+
+  int bit = -1;
+  while (v) {
+    v >>= 1;
+    bit++;
+  }
+  return bit;
+}
+
+// First index of the sorted range whose code has the highest differing bit of
+// the range set, or the middle when all codes are equal
+static int findMortonSplit(const std::vector<MortonPrimitive>& keys, int begin, int end) {
+
+  unsigned int first = keys[begin].code;
+  unsigned int last = keys[end - 1].code;
+
+  if (first == last) {
+    return begin + (end - begin) / 2;
+  }
+
+  unsigned int bit = 1u << highestBit(first ^ last);
+
+  // codes agree above the bit, so the ones with it set form the upper part
+  int low = begin + 1;
+  int high = end - 1;
+  while (low < high) {
+    int mid = (low + high) / 2;
+    if (keys[mid].code & bit) {
+      high = mid;
+    }
+    else {
+      low = mid + 1;
+    }
+  }
+  return low;
+}
+
+static void emitLeaf(const std::vector<MortonPrimitive>& keys, int begin, int end, const std::vector<face>& faces, BoundingBox& node) {
+
+  Bounds bounds;
+  for (int i = begin; i < end; i++) {
+    const face& currentFace = faces[keys[i].index];
+    bounds.grow(currentFace.vertex1);
+    bounds.grow(currentFace.vertex2);
+    bounds.grow(currentFace.vertex3);
+    node.faces.push_back(currentFace);
+  }
+  node.setBounds(bounds);
+}
+
+static void growFromChildren(BoundingBox& node) {
+
+  Bounds bounds = node.children[0].getBounds();
+  bounds.grow(node.children[1].getBounds());
+  node.setBounds(bounds);
+}
+
+static void emitNode(const std::vector<MortonPrimitive>& keys, int begin, int end, const std::vector<face>& faces,
+  BoundingBox& node, int depth) {
+
+  if (end - begin <= LBVH_LEAF_SIZE || depth >= BVH_MAX_DEPTH - 1) {
+    emitLeaf(keys, begin, end, faces, node);
+    return;
+  }
+
+  int mid = findMortonSplit(keys, begin, end);
+  node.children.resize(2);
+  emitNode(keys, begin, mid, faces, node.children[0], depth + 1);
+  emitNode(keys, mid, end, faces, node.children[1], depth + 1);
+  growFromChildren(node);
+}
+
+// Same as emitNode, but hands ranges of at most taskSize faces to the pool.
+// The bounds of the nodes above those tasks are grown in finishBounds.
+static void emitNodeParallel(const std::vector<MortonPrimitive>& keys, int begin, int end, const std::vector<face>& faces,
+  BoundingBox& node, int depth, int taskSize, ThreadPool& pool, TaskGroup& subtrees) {
+
+  if (end - begin <= taskSize) {
+    pool.submit(subtrees, [&keys, begin, end, &faces, &node, depth] {
+      emitNode(keys, begin, end, faces, node, depth);
+    });
+    return;
+  }
+
+  int mid = findMortonSplit(keys, begin, end);
+  node.children.resize(2);
+  emitNodeParallel(keys, begin, mid, faces, node.children[0], depth + 1, taskSize, pool, subtrees);
+  emitNodeParallel(keys, mid, end, faces, node.children[1], depth + 1, taskSize, pool, subtrees);
+}
+
+static void finishBounds(BoundingBox& node) {
+
+  if (!node.getBounds().empty()) {
+    return;
+  }
+
+  finishBounds(node.children[0]);
+  finishBounds(node.children[1]);
+  growFromChildren(node);
+}
+
+BoundingBox buildLBVH(const std::vector<face>& faces, ThreadPool& pool, bool optimize) {
+
+  BoundingBox root;
+  if (faces.empty()) {
+    return root;
+  }
+
+  int n = int(faces.size());
+  std::vector<MortonPrimitive> keys(faces.size());
+
+  std::vector<vectorThree> centroids(faces.size());
+  int chunks = (n + BUILD_PARALLEL_CHUNK_SIZE - 1) / BUILD_PARALLEL_CHUNK_SIZE;
+  std::vector<Bounds> chunkBounds(chunks);
+
+  pool.parallelFor(0, n, BUILD_PARALLEL_CHUNK_SIZE, [&](int begin, int end) {
+    Bounds& bounds = chunkBounds[begin / BUILD_PARALLEL_CHUNK_SIZE];
+    for (int i = begin; i < end; i++) {
+      centroids[i] = faceCentroid(faces[i]);
+      bounds.grow(centroids[i]);
+    }
+  });
+
+  Bounds centroidBounds;
+  for (const Bounds& bounds : chunkBounds) {
+    centroidBounds.grow(bounds);
+  }
+
+  pool.parallelFor(0, n, BUILD_PARALLEL_CHUNK_SIZE, [&](int begin, int end) {
+    for (int i = begin; i < end; i++) {
+      keys[i].code = mortonCode(centroids[i], centroidBounds);
+      keys[i].index = i;
+    }
+  });
+
+  radixSort(keys, pool);
+
+  int taskSize = std::max(n / (8 * pool.size()), BUILD_MIN_TASK_SIZE);
+
+  TaskGroup subtrees;
+  emitNodeParallel(keys, 0, n, faces, root, 0, taskSize, pool, subtrees);
+  pool.wait(subtrees);
+  finishBounds(root);
+
+  if (optimize) {
+    optimizeTreelets(root, pool);
+  }
+
+  return root;
+}
+
+//===========================================================================
+//========================= Treelet optimisation ============================
+//===========================================================================
+
+// Tries the rotations of the treelet formed by a node, its children and its
+// grandchildren and applies the one that lowers the surface area of the
+// interior nodes the most. The bounds of the node itself never change.
+static bool rotateNode(BoundingBox& node) {
+
+  BoundingBox& left = node.children[0];
+  BoundingBox& right = node.children[1];
+  float before = 0.0f;
+  float best = 0.0f;
+  int rotation = -1;
+
+  auto unionArea = [](const BoundingBox& a, const BoundingBox& b) {
+    Bounds bounds = a.getBounds();
+    bounds.grow(b.getBounds());
+    return bounds.surfaceArea();
+  };
+
+  if (!right.children.empty()) {
+    // left child with a child of the right child
+    before = right.getSurfaceArea();
+    for (int i = 0; i < 2; i++) {
+      float gain = before - unionArea(left, right.children[1 - i]);
+      if (gain > best) {
+        best = gain;
+        rotation = i;
+      }
+    }
+  }
+
+  if (!left.children.empty()) {
+    // right child with a child of the left child
+    before = left.getSurfaceArea();
+    for (int i = 0; i < 2; i++) {
+      float gain = before - unionArea(right, left.children[1 - i]);
+      if (gain > best) {
+        best = gain;
+        rotation = 2 + i;
+      }
+    }
+  }
+
+  if (!left.children.empty() && !right.children.empty()) {
+    // first child of the left child with a child of the right child
+    before = left.getSurfaceArea() + right.getSurfaceArea();
+    for (int i = 0; i < 2; i++) {
+      float gain = before - unionArea(right.children[i], left.children[1]) - unionArea(left.children[0], right.children[1 - i]);
+      if (gain > best) {
+        best = gain;
+        rotation = 4 + i;
+      }
+    }
+  }
+
+  switch (rotation) {
+  case 0:
+  case 1:
+    std::swap(left, right.children[rotation]);
+    growFromChildren(right);
+    break;
+  case 2:
+  case 3:
+    std::swap(right, left.children[rotation - 2]);
+    growFromChildren(left);
+    break;
+  case 4:
+  case 5:
+    std::swap(left.children[0], right.children[rotation - 4]);
+    growFromChildren(left);
+    growFromChildren(right);
+    break;
+  default:
+    return false;
+  }
+  return true;
+}
+
+// Optimizes the subtrees before their parent and returns an upper bound of
+// the height of the node. Nodes above parallelDepth run one child as a task.
+static int optimizeNode(BoundingBox& node, int depth, int parallelDepth, ThreadPool& pool) {
+
+  if (node.children.empty()) {
+    return 0;
+  }
+
+  int leftHeight = 0;
+  int rightHeight = 0;
+
+  if (depth < parallelDepth) {
+    TaskGroup group;
+    pool.submit(group, [&] { leftHeight = optimizeNode(node.children[0], depth + 1, parallelDepth, pool); });
+    rightHeight = optimizeNode(node.children[1], depth + 1, parallelDepth, pool);
+    pool.wait(group);
+  }
+  else {
+    leftHeight = optimizeNode(node.children[0], depth + 1, parallelDepth, pool);
+    rightHeight = optimizeNode(node.children[1], depth + 1, parallelDepth, pool);
+  }
+
+  int height = 1 + std::max(leftHeight, rightHeight);
+
+  // a rotation moves a subtree one level down, keep within the traversal stack
+  if (depth + height + 1 < BVH_MAX_DEPTH && rotateNode(node)) {
+    height++;
+  }
+  return height;
+}
+
+void optimizeTreelets(BoundingBox& root, ThreadPool& pool) {
+
+  int parallelDepth = 0;
+  while ((1 << parallelDepth) < 4 * pool.size()) {
+    parallelDepth++;
+  }
+
+  optimizeNode(root, 0, pool.size() > 1 ? parallelDepth : 0, pool);
+}
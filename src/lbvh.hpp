@@ -0,0 +1,26 @@
+#ifndef __LBVH__
+#define __LBVH__
+
+#include "bvh.hpp"
+
+// Linear BVH builder settings, Morton codes use 10 bits per axis and are
+// sorted 8 bits per radix pass
+static const int LBVH_LEAF_SIZE = 4;
+static const int LBVH_RADIX_BITS = 8;
+static const bool LBVH_OPTIMIZE = true;
+
+/**
+ * @brief Builds a hierarchy by sorting the face centroids along a Morton curve
+ * and splitting every range at the highest differing bit of its codes. Much
+ * faster than the SAH builders, at the cost of a worse hierarchy.
+ * @param optimize Runs optimizeTreelets on the result
+ */
+BoundingBox buildLBVH(const std::vector<face>& faces, ThreadPool& pool, bool optimize);
+
+/**
+ * @brief Lowers the SAH cost of a hierarchy by bottom up rotations, swapping a
+ * child with a grandchild whenever that shrinks the interior nodes
+ */
+void optimizeTreelets(BoundingBox& root, ThreadPool& pool);
+
+#endif // LBVH
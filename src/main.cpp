@@ -51,6 +51,12 @@ void initialize(void) {
   std::cout << "L    : Add new light source at current camera position." << std::endl;
   std::cout << "C	 : Reset the lighting on the scene." << std::endl;
   std::cout << "T    : Ray trace the scene." << std::endl;
+  std::cout << "B    : Switch traversal kernel, kd-tree or grid." << std::endl;
+  std::cout << "G    : Switch secondary rays between immediate tracing and sorted streams." << std::endl;
+  std::cout << "K    : Switch the faces all materials cull, none, back or front." << std::endl;
+  std::cout << "M    : Spin the mesh and refit the BVH." << std::endl;
+  std::cout << "N    : Place a copy of the mesh in front of the camera." << std::endl;
+  std::cout << "H    : Analyse the BVH and write it to " << BVH_STATS_FILE << "." << std::endl;
   std::cout << "Y    : BG Color = Red" << std::endl;
   std::cout << "U    : BG Color = Green" << std::endl;
   std::cout << "I    : BG Color = Blue" << std::endl;
@@ -72,6 +78,18 @@ void keyCallback(GLFWwindow *window, int key, int scancode, int action,
 		flyscene->addLight();
 	else if (key == GLFW_KEY_T && action == GLFW_PRESS)
 		flyscene->raytraceScene();
+	else if (key == GLFW_KEY_B && action == GLFW_PRESS)
+		flyscene->cycleTraversal();
+	else if (key == GLFW_KEY_G && action == GLFW_PRESS)
+		flyscene->toggleStreams();
+	else if (key == GLFW_KEY_K && action == GLFW_PRESS)
+		flyscene->cycleCullModes();
+	else if (key == GLFW_KEY_M && action == GLFW_PRESS)
+		flyscene->spinMesh();
+	else if (key == GLFW_KEY_N && action == GLFW_PRESS)
+		flyscene->addMeshInstance();
+	else if (key == GLFW_KEY_H && action == GLFW_PRESS)
+		flyscene->reportBVH();
 	else if (key == GLFW_KEY_C && action == GLFW_PRESS)
 		flyscene->changeObject();
 	else if (key == GLFW_KEY_Y && action == GLFW_PRESS)
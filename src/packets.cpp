@@ -0,0 +1,437 @@
+#include "packets.hpp"
+#include <cfloat>
+#include <cstdint>
+#include <immintrin.h>
+
+//===========================================================================
+//============================== Intervals ==================================
+//===========================================================================
+
+// The reciprocal directions of the rays of a packet, and their range along
+// every axis. Set up once per packet.
+struct PacketRays {
+  alignas(16) float inverse[3][PACKET_RAYS];
+  float inverseLow[3];
+  float inverseHigh[3];
+  // 1 where every direction is negative, like Ray::sign
+  int sign[3];
+  // set up when the ray enters its first leaf, flagged in shearedRays
+  ShearedRay sheared[PACKET_RAYS];
+  uint64_t shearedRays;
+  // faces every ray tested, only used when the SBVH references faces from
+  // several leaves
+  Mailbox mailboxes[PACKET_RAYS];
+};
+
+// Fails when the rays do not all head the same way along every axis, the
+// interval test would then have to split the packet
+static bool setUpPacketRays(const RayPacket& packet, PacketRays& rays) {
+
+  const float* dirs[3] = { packet.dx, packet.dy, packet.dz };
+
+  const __m128 one = _mm_set1_ps(1.0f);
+  const __m128 tiny = _mm_set1_ps(1e-20f);
+  const __m128 huge = _mm_set1_ps(1e20f);
+  const __m128 signBit = _mm_set1_ps(-0.0f);
+
+  for (int axis = 0; axis < 3; axis++) {
+
+    // unused rays of a partial packet repeat the first one, the reciprocals
+    // are then computed in place
+    float* inverse = rays.inverse[axis];
+    for (int r = 0; r < PACKET_RAYS; r++) {
+      inverse[r] = dirs[axis][r < packet.count ? r : 0];
+    }
+
+    __m128 low = _mm_set1_ps(FLT_MAX);
+    __m128 high = _mm_set1_ps(-FLT_MAX);
+    bool anyNegative = false;
+    bool allNegative = true;
+
+    for (int first = 0; first < PACKET_RAYS; first += 4) {
+
+      // safeInverse of four rays at once
+      __m128 dir = _mm_load_ps(inverse + first);
+      __m128 small = _mm_cmplt_ps(_mm_andnot_ps(signBit, dir), tiny);
+      __m128 reciprocal = _mm_div_ps(one, dir);
+      __m128 clamped = _mm_or_ps(huge, _mm_and_ps(_mm_cmplt_ps(dir, _mm_setzero_ps()), signBit));
+      reciprocal = _mm_or_ps(_mm_andnot_ps(small, reciprocal), _mm_and_ps(small, clamped));
+      _mm_store_ps(inverse + first, reciprocal);
+
+      low = _mm_min_ps(low, reciprocal);
+      high = _mm_max_ps(high, reciprocal);
+      int negative = _mm_movemask_ps(_mm_cmplt_ps(reciprocal, _mm_setzero_ps()));
+      anyNegative |= negative != 0;
+      allNegative &= negative == 15;
+    }
+
+    if (anyNegative && !allNegative) {
+      return false;
+    }
+    rays.sign[axis] = anyNegative;
+
+    low = _mm_min_ps(low, _mm_shuffle_ps(low, low, _MM_SHUFFLE(2, 3, 0, 1)));
+    high = _mm_max_ps(high, _mm_shuffle_ps(high, high, _MM_SHUFFLE(2, 3, 0, 1)));
+    rays.inverseLow[axis] = std::min(_mm_cvtss_f32(low), _mm_cvtss_f32(_mm_movehl_ps(low, low)));
+    rays.inverseHigh[axis] = std::max(_mm_cvtss_f32(high), _mm_cvtss_f32(_mm_movehl_ps(high, high)));
+  }
+
+  rays.shearedRays = 0;
+  return true;
+}
+
+// Interval test of the whole packet against the node. With a shared origin
+// the distance to a slab along every ray is the distance of the origin to
+// it times a reciprocal direction, so the range of reciprocals bounds where
+// every ray enters and leaves the node. Passes whenever any ray of the packet
+// enters the node in [0, tMax], tNear is then a lower bound of where they do.
+static bool packetEntersNode(const LinearNode& node, const vectorThree& origin, const PacketRays& rays, float tMax, float& tNear) {
+
+  rayBoxChecks++;
+  const float* slabs[2] = { node.min, node.max };
+
+  float tFar = tMax;
+  tNear = 0.0f;
+  for (int axis = 0; axis < 3; axis++) {
+    float near = slabs[rays.sign[axis]][axis] - origin[axis];
+    float far = slabs[1 - rays.sign[axis]][axis] - origin[axis];
+    tNear = std::max(tNear, std::min(near * rays.inverseLow[axis], near * rays.inverseHigh[axis]));
+    tFar = std::min(tFar, std::max(far * rays.inverseLow[axis], far * rays.inverseHigh[axis]));
+  }
+
+  bool hit = tNear <= tFar;
+  rayBoxIntersections += hit;
+  return hit;
+}
+
+// Slab test of rays first to first + 3 against the box of the leaf, the same
+// as rayBoxEntry with the hit found so far as tMax of every ray. Returns the
+// rays that enter the leaf as a bit mask.
+static int raysEnteringLeaf(const LinearNode& node, const RayPacket& packet, const PacketRays& rays, int first) {
+
+  const float* slabs[2] = { node.min, node.max };
+  __m128 tNear = _mm_setzero_ps();
+  __m128 tFar = _mm_set_ps(packet.hits[first + 3].t, packet.hits[first + 2].t, packet.hits[first + 1].t, packet.hits[first].t);
+
+  for (int axis = 0; axis < 3; axis++) {
+    __m128 inverse = _mm_load_ps(rays.inverse[axis] + first);
+    __m128 near = _mm_set1_ps(slabs[rays.sign[axis]][axis] - packet.origin[axis]);
+    __m128 far = _mm_set1_ps(slabs[1 - rays.sign[axis]][axis] - packet.origin[axis]);
+    tNear = _mm_max_ps(tNear, _mm_mul_ps(near, inverse));
+    tFar = _mm_min_ps(tFar, _mm_mul_ps(far, inverse));
+  }
+
+  int used = first + 4 <= packet.count ? 15 : (1 << (packet.count - first)) - 1;
+  int entering = _mm_movemask_ps(_mm_cmple_ps(tNear, tFar)) & used;
+
+  for (int lane = 0; lane < 4; lane++) {
+    rayBoxChecks += (used >> lane) & 1;
+    rayBoxIntersections += (entering >> lane) & 1;
+  }
+  return entering;
+}
+
+//===========================================================================
+//============================== Traversal ==================================
+//===========================================================================
+
+static int countRays(int mask) {
+
+  int count = 0;
+  for (; mask; mask &= mask - 1) {
+    count++;
+  }
+  return count;
+}
+
+static int lowestRay(int mask) {
+
+  int ray = 0;
+  while (!(mask & (1 << ray))) {
+    ray++;
+  }
+  return ray;
+}
+
+static float farthestHit(const RayPacket& packet) {
+
+  float tMax = 0.0f;
+  for (int r = 0; r < packet.count; r++) {
+    tMax = std::max(tMax, packet.hits[r].t);
+  }
+  return tMax;
+}
+
+// Keeps hit of ray r in lane of the vectors as its closest hit when it lies
+// in (tMin, hit.t), u and v are the edge functions of the second and third
+// vertex like in the SIMD kernels of the triangles
+static void keepLaneHit(RayHit& hit, float tMin, int face, float t, float u, float v, float determinant) {
+
+  if (t <= tMin || t >= hit.t) {
+    return;
+  }
+  hit.t = t;
+  hit.face = face;
+  hit.front = determinant > 0.0f;
+  hit.u = u / determinant;
+  hit.v = v / determinant;
+}
+
+// Same as closestInBlocks for the rays of lanes, a bit mask of rays first to
+// first + 3, one ray per SIMD lane. The rays must be sheared along the same
+// axes, every lane then computes exactly what rayTriangleWatertight does for
+// its ray. Triangles go in the order of the blocks, so ties end the same way.
+static void closestInBlocksRays4(const TriangleBlock* blocks, int blockCount, RayPacket& packet, const PacketRays& rays,
+  int first, int lanes) {
+
+  const ShearedRay& axes = rays.sheared[first + lowestRay(lanes)];
+  int kx = axes.kx;
+  int ky = axes.ky;
+  int kz = axes.kz;
+
+  alignas(16) float shear[3][4];
+  for (int lane = 0; lane < 4; lane++) {
+    const ShearedRay& ray = lanes & (1 << lane) ? rays.sheared[first + lane] : axes;
+    shear[0][lane] = ray.sx;
+    shear[1][lane] = ray.sy;
+    shear[2][lane] = ray.sz;
+  }
+  __m128 sx = _mm_load_ps(shear[0]);
+  __m128 sy = _mm_load_ps(shear[1]);
+  __m128 sz = _mm_load_ps(shear[2]);
+
+  __m128 active = _mm_castsi128_ps(_mm_cmpgt_epi32(_mm_and_si128(_mm_set1_epi32(lanes), _mm_set_epi32(8, 4, 2, 1)),
+    _mm_setzero_si128()));
+  __m128 zero = _mm_setzero_ps();
+  float ox = packet.origin[kx];
+  float oy = packet.origin[ky];
+  float oz = packet.origin[kz];
+
+  for (int b = 0; b < blockCount; b++) {
+
+    const TriangleBlock& block = blocks[b];
+    const float* v0[3] = { block.v0x, block.v0y, block.v0z };
+    const float* v1[3] = { block.v1x, block.v1y, block.v1z };
+    const float* v2[3] = { block.v2x, block.v2y, block.v2z };
+
+    for (int triangle = 0; triangle < TRIANGLE_BLOCK_SIZE; triangle++) {
+
+      if (block.face[triangle] < 0) {
+        continue;
+      }
+
+      float az = v0[kz][triangle] - oz;
+      float bz = v1[kz][triangle] - oz;
+      float cz = v2[kz][triangle] - oz;
+      __m128 ax = _mm_sub_ps(_mm_set1_ps(v0[kx][triangle] - ox), _mm_mul_ps(sx, _mm_set1_ps(az)));
+      __m128 ay = _mm_sub_ps(_mm_set1_ps(v0[ky][triangle] - oy), _mm_mul_ps(sy, _mm_set1_ps(az)));
+      __m128 bx = _mm_sub_ps(_mm_set1_ps(v1[kx][triangle] - ox), _mm_mul_ps(sx, _mm_set1_ps(bz)));
+      __m128 by = _mm_sub_ps(_mm_set1_ps(v1[ky][triangle] - oy), _mm_mul_ps(sy, _mm_set1_ps(bz)));
+      __m128 cx = _mm_sub_ps(_mm_set1_ps(v2[kx][triangle] - ox), _mm_mul_ps(sx, _mm_set1_ps(cz)));
+      __m128 cy = _mm_sub_ps(_mm_set1_ps(v2[ky][triangle] - oy), _mm_mul_ps(sy, _mm_set1_ps(cz)));
+
+      __m128 u = _mm_sub_ps(_mm_mul_ps(cx, by), _mm_mul_ps(cy, bx));
+      __m128 v = _mm_sub_ps(_mm_mul_ps(ax, cy), _mm_mul_ps(ay, cx));
+      __m128 w = _mm_sub_ps(_mm_mul_ps(bx, ay), _mm_mul_ps(by, ax));
+
+      __m128 onEdge = _mm_or_ps(_mm_or_ps(_mm_cmpeq_ps(u, zero), _mm_cmpeq_ps(v, zero)), _mm_cmpeq_ps(w, zero));
+      int uncertain = _mm_movemask_ps(_mm_and_ps(onEdge, active));
+
+      __m128 negative = _mm_or_ps(_mm_or_ps(_mm_cmplt_ps(u, zero), _mm_cmplt_ps(v, zero)), _mm_cmplt_ps(w, zero));
+      __m128 positive = _mm_or_ps(_mm_or_ps(_mm_cmpgt_ps(u, zero), _mm_cmpgt_ps(v, zero)), _mm_cmpgt_ps(w, zero));
+      __m128 determinant = _mm_add_ps(_mm_add_ps(u, v), w);
+      __m128 inside = _mm_and_ps(_mm_andnot_ps(_mm_and_ps(negative, positive), active), _mm_cmpneq_ps(determinant, zero));
+
+      __m128 front = _mm_cmpgt_ps(determinant, zero);
+      if (block.cull[triangle] == CULL_BACK) {
+        inside = _mm_and_ps(inside, front);
+      }
+      else if (block.cull[triangle] == CULL_FRONT) {
+        inside = _mm_andnot_ps(front, inside);
+      }
+
+      __m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(u, _mm_set1_ps(az)), _mm_mul_ps(v, _mm_set1_ps(bz))),
+        _mm_mul_ps(w, _mm_set1_ps(cz)));
+      __m128 t = _mm_div_ps(_mm_mul_ps(distance, sz), determinant);
+      int hits = _mm_movemask_ps(_mm_and_ps(inside, _mm_cmpgt_ps(t, zero))) & ~uncertain;
+
+      rayTriangleChecks += countRays(lanes & ~uncertain);
+      rayTriangleIntersections += countRays(hits);
+
+      if (hits) {
+        alignas(16) float lane[4][4];
+        _mm_store_ps(lane[0], t);
+        _mm_store_ps(lane[1], v);
+        _mm_store_ps(lane[2], w);
+        _mm_store_ps(lane[3], determinant);
+        for (int k = 0; k < 4; k++) {
+          if (hits & (1 << k)) {
+            keepLaneHit(packet.hits[first + k], packet.tMin[first + k], block.face[triangle], lane[0][k], lane[1][k], lane[2][k], lane[3][k]);
+          }
+        }
+      }
+
+      // segments exactly through an edge are decided in double precision
+      for (int k = 0; k < 4; k++) {
+        RayHit laneHit;
+        if ((uncertain & (1 << k)) && rayLaneIntersection(block, triangle, rays.sheared[first + k], laneHit)
+          && laneHit.t > packet.tMin[first + k] && laneHit.t < packet.hits[first + k].t) {
+          packet.hits[first + k] = laneHit;
+        }
+      }
+    }
+  }
+}
+
+// Intersects the leaf with the rays of the packet that enter it, returns how
+// many did
+static int intersectLeafPacket(const LinearBVH& bvh, const TriangleLeaves& triangles, int leaf, RayPacket& packet,
+  PacketRays& rays) {
+
+  const LinearNode& node = bvh.nodes[leaf];
+  const TriangleBlock* blocks = triangles.blocks.data() + triangles.firstBlock[leaf];
+  int blockCount = (node.count + TRIANGLE_BLOCK_SIZE - 1) / TRIANGLE_BLOCK_SIZE;
+  TriangleKernel kernel = bestTriangleKernel();
+
+  int entered = 0;
+  for (int first = 0; first < packet.count; first += 4) {
+
+    int entering = raysEnteringLeaf(node, packet, rays, first);
+    if (!entering) {
+      continue;
+    }
+
+    bool sameAxes = true;
+    const ShearedRay* axes = nullptr;
+    for (int lane = 0; lane < 4; lane++) {
+      if (entering & (1 << lane)) {
+        int r = first + lane;
+        if (!(rays.shearedRays & (uint64_t(1) << r))) {
+          rays.sheared[r] = ShearedRay(packet.origin, packet.dir(r));
+          rays.shearedRays |= uint64_t(1) << r;
+        }
+        if (!axes) {
+          axes = &rays.sheared[r];
+        }
+        sameAxes &= rays.sheared[r].kx == axes->kx && rays.sheared[r].kz == axes->kz;
+      }
+    }
+
+    int count = countRays(entering);
+    entered += count;
+
+    // a single ray is faster through the kernel that runs across triangles
+    auto intersect = [&](const TriangleBlock* leafBlocks, int leafBlockCount) {
+      if (count > 1 && sameAxes) {
+        closestInBlocksRays4(leafBlocks, leafBlockCount, packet, rays, first, entering);
+        return;
+      }
+      for (int lane = 0; lane < 4; lane++) {
+        if (entering & (1 << lane)) {
+          int r = first + lane;
+          closestInBlocks(leafBlocks, leafBlockCount, rays.sheared[r], packet.tMin[r], packet.hits[r], kernel);
+        }
+      }
+    };
+
+    if (bvh.faceIds.empty()) {
+      intersect(blocks, blockCount);
+      continue;
+    }
+
+    // same as intersectLeaf, a face is skipped once all entering rays tested it
+    TriangleBlock filtered[MAILBOX_BLOCKS];
+    for (int b = 0; b < blockCount;) {
+      int filteredCount;
+      b = filterBlocks(blocks, b, blockCount, bvh.faceIds.data(), rays.mailboxes + first, entering, filtered, filteredCount);
+      intersect(filtered, filteredCount);
+    }
+  }
+  return entered;
+}
+
+// Finishes every ray of the packet on its own, keeping the hits found so far
+static void closestHitRays(const LinearBVH& bvh, const TriangleLeaves& triangles, RayPacket& packet) {
+
+  for (int r = 0; r < packet.count; r++) {
+    closestHit(bvh, triangles, packet.origin, packet.dir(r), packet.tMin[r], packet.hits[r]);
+  }
+}
+
+void closestHitPacket(const LinearBVH& bvh, const TriangleLeaves& triangles, RayPacket& packet, PacketStats& stats) {
+
+  if (bvh.nodes.empty() || packet.count == 0) {
+    return;
+  }
+  stats.packets++;
+
+  PacketRays rays;
+  if (!setUpPacketRays(packet, rays)) {
+    stats.mixedSigns++;
+    closestHitRays(bvh, triangles, packet);
+    return;
+  }
+
+  struct Entry {
+    int node;
+    float tNear;
+  };
+  Entry stack[BVH_MAX_DEPTH + 1];
+  int stackSize = 0;
+
+  float tMax = farthestHit(packet);
+  float tRoot;
+  stats.nodeTests++;
+  if (!packetEntersNode(bvh.nodes[0], packet.origin, rays, tMax, tRoot)) {
+    return;
+  }
+  stack[stackSize++] = { 0, tRoot };
+
+  int leaves = 0;
+  int raysEntered = 0;
+
+  while (stackSize > 0) {
+
+    Entry entry = stack[--stackSize];
+    if (entry.tNear > tMax) {
+      continue;
+    }
+
+    const LinearNode& node = bvh.nodes[entry.node];
+    if (node.isLeaf()) {
+
+      raysEntered += intersectLeafPacket(bvh, triangles, entry.node, packet, rays);
+      leaves++;
+      tMax = farthestHit(packet);
+
+      // the rays went separate ways, tracing them alone is cheaper than
+      // dragging the whole packet into leaves only a few of them enter
+      if (leaves >= PACKET_MIN_LEAVES && raysEntered < PACKET_MIN_COHERENCE * leaves * packet.count) {
+        stats.diverged++;
+        closestHitRays(bvh, triangles, packet);
+        return;
+      }
+      continue;
+    }
+
+    Entry near = { entry.node + 1, 0.0f };
+    Entry far = { node.offset, 0.0f };
+    stats.nodeTests += 2;
+    bool hitNear = packetEntersNode(bvh.nodes[near.node], packet.origin, rays, tMax, near.tNear);
+    bool hitFar = packetEntersNode(bvh.nodes[far.node], packet.origin, rays, tMax, far.tNear);
+
+    if (hitNear && hitFar) {
+      if (far.tNear < near.tNear) {
+        std::swap(near, far);
+      }
+      stack[stackSize++] = far;
+      stack[stackSize++] = near;
+    }
+    else if (hitNear) {
+      stack[stackSize++] = near;
+    }
+    else if (hitFar) {
+      stack[stackSize++] = far;
+    }
+  }
+}
@@ -0,0 +1,61 @@
+#ifndef __PACKETS__
+#define __PACKETS__
+
+#include "triangles.hpp"
+
+// Primary rays are traced in packets of PACKET_WIDTH x PACKET_WIDTH pixels
+// through the binary hierarchy, whatever traversal the other rays use
+static const bool TRACE_PACKETS = true;
+static const int PACKET_WIDTH = 8;
+static const int PACKET_RAYS = PACKET_WIDTH * PACKET_WIDTH;
+
+// Once the leaves a packet entered were entered by fewer than this fraction
+// of its rays on average, its rays are finished one by one
+static const float PACKET_MIN_COHERENCE = 0.1f;
+// Leaves a packet visits before its coherence is judged
+static const int PACKET_MIN_LEAVES = 4;
+
+// Times first hits of camera rays at 4K traced alone and in packets before
+// every render
+static const bool PACKET_BENCHMARK = false;
+static const int PACKET_BENCHMARK_WIDTH = 3840;
+static const int PACKET_BENCHMARK_HEIGHT = 2160;
+
+// Segments origin + t * dir sharing their origin, which camera rays do.
+// Unused rays at the end of a partial packet are never read.
+struct RayPacket {
+	vectorThree origin;
+	int count = 0;
+	alignas(16) float dx[PACKET_RAYS];
+	alignas(16) float dy[PACKET_RAYS];
+	alignas(16) float dz[PACKET_RAYS];
+	// hits closer than tMin are ignored, hits[r].t limits ray r
+	float tMin[PACKET_RAYS];
+	RayHit hits[PACKET_RAYS];
+
+	vectorThree dir(int ray) const { return { dx[ray], dy[ray], dz[ray] }; }
+};
+
+// How packets were traced, summed over a render
+struct PacketStats {
+	long long packets = 0;
+	// packets traced ray by ray from the start, their directions did not
+	// share their signs
+	long long mixedSigns = 0;
+	// packets finished ray by ray after their rays stopped entering the same
+	// leaves
+	long long diverged = 0;
+	// node tests of whole packets
+	long long nodeTests = 0;
+};
+
+/**
+ * @brief Closest face hit of every ray of the packet, the same hits
+ * closestHit finds. The packet descends the hierarchy near to far with one
+ * interval test per node, which bounds where every ray of the packet enters
+ * and leaves the node at once. Leaves test four rays at a time against their
+ * box and intersect the triangles with the rays that enter.
+ */
+void closestHitPacket(const LinearBVH& bvh, const TriangleLeaves& triangles, RayPacket& packet, PacketStats& stats);
+
+#endif // PACKETS
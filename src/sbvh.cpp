@@ -0,0 +1,350 @@
+#include "sbvh.hpp"
+
+// A face, or the part of it that ended up on one side of spatial splits
+struct Reference {
+  Bounds bounds;
+  int index;
+};
+
+struct SBVHBin {
+  Bounds bounds;
+  int count = 0;
+  // references that start and end in the bin, for spatial splits
+  int entries = 0;
+  int exits = 0;
+};
+
+struct SBVHSplit {
+  int axis = -1;
+  int bin = 0;
+  float cost = FLT_MAX;
+  Bounds left;
+  Bounds right;
+  int leftCount = 0;
+  int rightCount = 0;
+};
+
+// Shared state of one build
+struct SBVHBuild {
+  const std::vector<face>& faces;
+  float rootArea;
+  int duplicationBudget;
+};
+
+static void setAxis(vectorThree& v, int axis, float value) {
+
+  if (axis == 0) { v.x = value; }
+  else if (axis == 1) { v.y = value; }
+  else { v.z = value; }
+}
+
+static vectorThree centerOf(const Bounds& bounds) {
+
+  vectorThree min = bounds.min;
+  return (min + bounds.max) * 0.5f;
+}
+
+static Bounds intersectBounds(const Bounds& a, const Bounds& b) {
+
+  Bounds result;
+  result.min = { std::max(a.min.x, b.min.x), std::max(a.min.y, b.min.y), std::max(a.min.z, b.min.z) };
+  result.max = { std::min(a.max.x, b.max.x), std::min(a.max.y, b.max.y), std::min(a.max.z, b.max.z) };
+  return result;
+}
+
+static bool validBounds(const Bounds& bounds) {
+  return bounds.min.x <= bounds.max.x && bounds.min.y <= bounds.max.y && bounds.min.z <= bounds.max.z;
+}
+
+// Clips the face of the reference at the plane and returns the bounds of both
+// parts, limited to the bounds the reference already had
+static void splitReference(const Reference& ref, const face& currentFace, int axis, float position, Bounds& left, Bounds& right) {
+
+  const vectorThree* vertices[3] = { &currentFace.vertex1, &currentFace.vertex2, &currentFace.vertex3 };
+  left = Bounds();
+  right = Bounds();
+
+  for (int i = 0; i < 3; i++) {
+
+    vectorThree a = *vertices[i];
+    vectorThree b = *vertices[(i + 1) % 3];
+    float pa = a[axis];
+    float pb = b[axis];
+
+    if (pa <= position) { left.grow(a); }
+    if (pa >= position) { right.grow(a); }
+
+    if ((pa < position && pb > position) || (pa > position && pb < position)) {
+      vectorThree crossing = a + (b - a) * ((position - pa) / (pb - pa));
+      setAxis(crossing, axis, position);
+      left.grow(crossing);
+      right.grow(crossing);
+    }
+  }
+
+  left = intersectBounds(left, ref.bounds);
+  right = intersectBounds(right, ref.bounds);
+  setAxis(left.max, axis, std::min(left.max[axis], position));
+  setAxis(right.min, axis, std::max(right.min[axis], position));
+}
+
+//===========================================================================
+
+static int centroidBin(const Bounds& bounds, const Bounds& centroidBounds, int axis) {
+
+  float extent = centroidBounds.max[axis] - centroidBounds.min[axis];
+  int bin = int(SAH_BINS * (centerOf(bounds)[axis] - centroidBounds.min[axis]) / extent);
+
+  return std::min(std::max(bin, 0), SAH_BINS - 1);
+}
+
+// Sweeps the bins of one axis and keeps the cheapest boundary in best. Object
+// splits count references per bin, spatial splits count entries and exits.
+static void sweepBins(const SBVHBin* bins, int binCount, int axis, float area, bool spatial, SBVHSplit& best) {
+
+  std::vector<Bounds> rightBounds(binCount);
+  std::vector<int> rightCount(binCount);
+  Bounds right;
+  int count = 0;
+  for (int i = binCount - 1; i > 0; i--) {
+    right.grow(bins[i].bounds);
+    count += spatial ? bins[i].exits : bins[i].count;
+    rightBounds[i] = right;
+    rightCount[i] = count;
+  }
+
+  Bounds left;
+  count = 0;
+  for (int i = 0; i < binCount - 1; i++) {
+    left.grow(bins[i].bounds);
+    count += spatial ? bins[i].entries : bins[i].count;
+
+    if (count == 0 || rightCount[i + 1] == 0) {
+      continue;
+    }
+
+    float cost = SAH_TRAVERSAL_COST + SAH_INTERSECTION_COST *
+      (left.surfaceArea() * count + rightBounds[i + 1].surfaceArea() * rightCount[i + 1]) / area;
+
+    if (cost < best.cost) {
+      best.cost = cost;
+      best.axis = axis;
+      best.bin = i;
+      best.left = left;
+      best.right = rightBounds[i + 1];
+      best.leftCount = count;
+      best.rightCount = rightCount[i + 1];
+    }
+  }
+}
+
+static void findObjectSplit(const std::vector<Reference>& refs, const Bounds& bounds, const Bounds& centroidBounds, SBVHSplit& best) {
+
+  for (int axis = 0; axis < 3; axis++) {
+
+    if (centroidBounds.max[axis] - centroidBounds.min[axis] <= 0.0f) {
+      continue;
+    }
+
+    SBVHBin bins[SAH_BINS];
+    for (const Reference& ref : refs) {
+      SBVHBin& bin = bins[centroidBin(ref.bounds, centroidBounds, axis)];
+      bin.bounds.grow(ref.bounds);
+      bin.count++;
+    }
+
+    sweepBins(bins, SAH_BINS, axis, bounds.surfaceArea(), false, best);
+  }
+}
+
+static float spatialPlane(const Bounds& bounds, int axis, int bin) {
+
+  float extent = bounds.max[axis] - bounds.min[axis];
+  return bounds.min[axis] + extent * (bin + 1) / SBVH_SPATIAL_BINS;
+}
+
+static int spatialBin(const Bounds& bounds, int axis, float position) {
+
+  float extent = bounds.max[axis] - bounds.min[axis];
+  int bin = int(SBVH_SPATIAL_BINS * (position - bounds.min[axis]) / extent);
+
+  return std::min(std::max(bin, 0), SBVH_SPATIAL_BINS - 1);
+}
+
+// Bins the references into equally sized slabs of the node, clipping the
+// faces that span several slabs so every bin only grows by its part
+static void findSpatialSplit(const SBVHBuild& build, const std::vector<Reference>& refs, const Bounds& bounds, SBVHSplit& best) {
+
+  for (int axis = 0; axis < 3; axis++) {
+
+    if (bounds.max[axis] - bounds.min[axis] <= 0.0f) {
+      continue;
+    }
+
+    SBVHBin bins[SBVH_SPATIAL_BINS];
+    for (const Reference& ref : refs) {
+
+      int first = spatialBin(bounds, axis, ref.bounds.min[axis]);
+      int last = spatialBin(bounds, axis, ref.bounds.max[axis]);
+
+      Reference rest = ref;
+      for (int bin = first; bin < last; bin++) {
+        Bounds left;
+        Bounds right;
+        splitReference(rest, build.faces[ref.index], axis, spatialPlane(bounds, axis, bin), left, right);
+        if (validBounds(left)) {
+          bins[bin].bounds.grow(left);
+        }
+        rest.bounds = right;
+      }
+      if (validBounds(rest.bounds)) {
+        bins[last].bounds.grow(rest.bounds);
+      }
+      bins[first].entries++;
+      bins[last].exits++;
+    }
+
+    sweepBins(bins, SBVH_SPATIAL_BINS, axis, bounds.surfaceArea(), true, best);
+  }
+}
+
+//===========================================================================
+
+static void makeLeaf(const SBVHBuild& build, const std::vector<Reference>& refs, BoundingBox& node) {
+
+  for (const Reference& ref : refs) {
+    node.faces.push_back(build.faces[ref.index]);
+    node.faceIds.push_back(ref.index);
+  }
+}
+
+static void partitionObject(const std::vector<Reference>& refs, const Bounds& centroidBounds, const SBVHSplit& split,
+  std::vector<Reference>& left, std::vector<Reference>& right) {
+
+  for (const Reference& ref : refs) {
+    if (centroidBin(ref.bounds, centroidBounds, split.axis) <= split.bin) {
+      left.push_back(ref);
+    }
+    else {
+      right.push_back(ref);
+    }
+  }
+}
+
+static void partitionSpatial(SBVHBuild& build, const std::vector<Reference>& refs, const Bounds& bounds, const SBVHSplit& split,
+  std::vector<Reference>& left, std::vector<Reference>& right) {
+
+  int axis = split.axis;
+  float position = spatialPlane(bounds, axis, split.bin);
+
+  for (const Reference& ref : refs) {
+
+    if (ref.bounds.max[axis] <= position) {
+      left.push_back(ref);
+    }
+    else if (ref.bounds.min[axis] >= position) {
+      right.push_back(ref);
+    }
+    else {
+
+      Reference leftRef = ref;
+      Reference rightRef = ref;
+      splitReference(ref, build.faces[ref.index], axis, position, leftRef.bounds, rightRef.bounds);
+
+      // precision may leave nothing on one side, then the face is not duplicated
+      bool leftValid = validBounds(leftRef.bounds);
+      bool rightValid = validBounds(rightRef.bounds);
+      if (leftValid) { left.push_back(leftRef); }
+      if (rightValid) { right.push_back(rightRef); }
+      if (!leftValid && !rightValid) { left.push_back(ref); }
+      if (leftValid && rightValid) { build.duplicationBudget--; }
+    }
+  }
+}
+
+static void buildSBVHNode(SBVHBuild& build, std::vector<Reference>& refs, BoundingBox& node, int depth) {
+
+  Bounds bounds;
+  Bounds centroidBounds;
+  for (const Reference& ref : refs) {
+    bounds.grow(ref.bounds);
+    centroidBounds.grow(centerOf(ref.bounds));
+  }
+  node.setBounds(bounds);
+
+  int count = int(refs.size());
+  float leafCost = SAH_INTERSECTION_COST * count;
+
+  if (depth >= BVH_MAX_DEPTH - 1 || count <= 1) {
+    makeLeaf(build, refs, node);
+    return;
+  }
+
+  SBVHSplit objectSplit;
+  findObjectSplit(refs, bounds, centroidBounds, objectSplit);
+
+  // only look for spatial splits where the object split children overlap
+  SBVHSplit spatialSplit;
+  if (build.duplicationBudget > 0) {
+    Bounds overlap = intersectBounds(objectSplit.left, objectSplit.right);
+    if (objectSplit.axis == -1 || (validBounds(overlap) && overlap.surfaceArea() > SBVH_OVERLAP_THRESHOLD * build.rootArea)) {
+      findSpatialSplit(build, refs, bounds, spatialSplit);
+    }
+  }
+
+  int duplicates = spatialSplit.leftCount + spatialSplit.rightCount - count;
+  bool useSpatial = spatialSplit.axis != -1 && spatialSplit.cost < objectSplit.cost && duplicates <= build.duplicationBudget;
+  float bestCost = useSpatial ? spatialSplit.cost : objectSplit.cost;
+
+  if (count <= SAH_MAX_LEAF_SIZE && bestCost >= leafCost) {
+    makeLeaf(build, refs, node);
+    return;
+  }
+
+  std::vector<Reference> left;
+  std::vector<Reference> right;
+
+  if (useSpatial) {
+    partitionSpatial(build, refs, bounds, spatialSplit, left, right);
+  }
+  else if (objectSplit.axis != -1) {
+    partitionObject(refs, centroidBounds, objectSplit, left, right);
+  }
+
+  if (left.empty() || right.empty()) {
+    // nothing separates the references but the leaf would be too large
+    left.assign(refs.begin(), refs.begin() + count / 2);
+    right.assign(refs.begin() + count / 2, refs.end());
+  }
+
+  // release the references of this node before descending
+  std::vector<Reference>().swap(refs);
+
+  node.children.resize(2);
+  buildSBVHNode(build, left, node.children[0], depth + 1);
+  buildSBVHNode(build, right, node.children[1], depth + 1);
+}
+
+BoundingBox buildSBVH(const std::vector<face>& faces) {
+
+  std::vector<Reference> refs(faces.size());
+  Bounds rootBounds;
+
+  for (int i = 0; i < faces.size(); i++) {
+    refs[i].bounds.grow(faces[i].vertex1);
+    refs[i].bounds.grow(faces[i].vertex2);
+    refs[i].bounds.grow(faces[i].vertex3);
+    refs[i].index = i;
+    rootBounds.grow(refs[i].bounds);
+  }
+
+  BoundingBox root;
+  if (refs.empty()) {
+    return root;
+  }
+
+  SBVHBuild build = { faces, rootBounds.surfaceArea(), int(faces.size() * (SBVH_MAX_DUPLICATION - 1.0f)) };
+  buildSBVHNode(build, refs, root, 0);
+
+  return root;
+}
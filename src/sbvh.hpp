@@ -0,0 +1,22 @@
+#ifndef __SBVH__
+#define __SBVH__
+
+#include "bvh.hpp"
+
+// Spatial split BVH settings. Spatial splits are only evaluated where the
+// children of the best object split overlap by more than the threshold,
+// relative to the root area, and while the references stay within the
+// duplication budget, relative to the number of faces.
+static const int SBVH_SPATIAL_BINS = 32;
+static const float SBVH_OVERLAP_THRESHOLD = 1e-5f;
+static const float SBVH_MAX_DUPLICATION = 1.5f;
+
+/**
+ * @brief Builds a hierarchy with the binned SAH over both object splits and
+ * spatial splits, which clip faces at the split plane and reference them from
+ * both children. Leaves store the index of every face in faceIds, so
+ * traversal can skip duplicates with a Mailbox.
+ */
+BoundingBox buildSBVH(const std::vector<face>& faces);
+
+#endif // SBVH
@@ -0,0 +1,247 @@
+#include "spheres.hpp"
+#include <chrono>
+#include <cmath>
+#include <immintrin.h>
+#include <iostream>
+#include <random>
+
+long long raySphereChecks = 0;
+
+//===========================================================================
+//=============================== Building ==================================
+//===========================================================================
+
+static Bounds sphereBounds(const Sphere& sphere) {
+
+  vectorThree center = sphere.getCenter();
+  float radius = sphere.getRadius();
+
+  Bounds bounds;
+  bounds.min = { center.x - radius, center.y - radius, center.z - radius };
+  bounds.max = { center.x + radius, center.y + radius, center.z + radius };
+  return bounds;
+}
+
+static void appendSphereBlocks(const std::vector<Sphere>& spheres, const int* ids, int count, SphereBlockArray& blocks) {
+
+  for (int j = 0; j < count; j += SPHERE_BLOCK_SIZE) {
+
+    SphereBlock block;
+    for (int lane = 0; lane < SPHERE_BLOCK_SIZE; lane++) {
+
+      if (j + lane < count) {
+        const Sphere& sphere = spheres[ids[j + lane]];
+        block.cx[lane] = sphere.getCenter().x;
+        block.cy[lane] = sphere.getCenter().y;
+        block.cz[lane] = sphere.getCenter().z;
+        block.radius2[lane] = sphere.getRadius() * sphere.getRadius();
+        block.sphere[lane] = ids[j + lane];
+      }
+      else {
+        block.cx[lane] = block.cy[lane] = block.cz[lane] = 0.0f;
+        block.radius2[lane] = 0.0f;
+        block.sphere[lane] = -1;
+      }
+    }
+    blocks.push_back(block);
+  }
+}
+
+static int buildSphereNode(SphereBVH& bvh, const std::vector<Bounds>& boxes, int* ids, int count) {
+
+  int index = int(bvh.tree.nodes.size());
+  bvh.tree.nodes.emplace_back();
+
+  Bounds bounds;
+  Bounds centroids;
+  for (int i = 0; i < count; i++) {
+    const Bounds& box = boxes[ids[i]];
+    bounds.grow(box);
+    centroids.grow(vectorThree{ (box.min.x + box.max.x) * 0.5f, (box.min.y + box.max.y) * 0.5f, (box.min.z + box.max.z) * 0.5f });
+  }
+
+  LinearNode node;
+  node.setBounds(bounds);
+
+  if (count <= SPHERE_MAX_LEAF_SIZE) {
+
+    node.offset = int(bvh.blocks.size());
+    node.count = count;
+    appendSphereBlocks(bvh.spheres, ids, count, bvh.blocks);
+  }
+  else {
+
+    int axis = centroids.maxAxis();
+    int half = count / 2;
+    std::nth_element(ids, ids + half, ids + count, [&boxes, axis](int a, int b) {
+      return boxes[a].min[axis] + boxes[a].max[axis] < boxes[b].min[axis] + boxes[b].max[axis];
+    });
+
+    buildSphereNode(bvh, boxes, ids, half);
+    node.offset = buildSphereNode(bvh, boxes, ids + half, count - half);
+    node.count = 0;
+  }
+
+  // the recursion may have reallocated the array, so write the node last
+  bvh.tree.nodes[index] = node;
+  return index;
+}
+
+SphereBVH buildSphereBVH(const std::vector<Sphere>& spheres) {
+
+  SphereBVH bvh;
+  bvh.spheres = spheres;
+  if (spheres.empty()) {
+    return bvh;
+  }
+
+  std::vector<Bounds> boxes(spheres.size());
+  std::vector<int> ids(spheres.size());
+  for (int i = 0; i < spheres.size(); i++) {
+    boxes[i] = sphereBounds(spheres[i]);
+    ids[i] = i;
+  }
+
+  buildSphereNode(bvh, boxes, ids.data(), int(ids.size()));
+  return bvh;
+}
+
+//===========================================================================
+//============================= Intersection ================================
+//===========================================================================
+
+int raySphereBlockIntersection(const SphereBlock& block, const vectorThree& origin, const vectorThree& dir,
+  float tMin, float tMax, float t[SPHERE_BLOCK_SIZE]) {
+
+  __m128i ids = _mm_load_si128(reinterpret_cast<const __m128i*>(block.sphere));
+  __m128 used = _mm_castsi128_ps(_mm_cmpgt_epi32(ids, _mm_set1_epi32(-1)));
+  for (int lane = 0; lane < SPHERE_BLOCK_SIZE; lane++) {
+    raySphereChecks += block.sphere[lane] >= 0;
+  }
+
+  // l is the center seen from the origin, the segment hits the sphere where
+  // a * t^2 - 2 * b * t + c = 0
+  __m128 lx = _mm_sub_ps(_mm_load_ps(block.cx), _mm_set1_ps(origin.x));
+  __m128 ly = _mm_sub_ps(_mm_load_ps(block.cy), _mm_set1_ps(origin.y));
+  __m128 lz = _mm_sub_ps(_mm_load_ps(block.cz), _mm_set1_ps(origin.z));
+  __m128 dx = _mm_set1_ps(dir.x);
+  __m128 dy = _mm_set1_ps(dir.y);
+  __m128 dz = _mm_set1_ps(dir.z);
+
+  float a = dir.x * dir.x + dir.y * dir.y + dir.z * dir.z;
+  __m128 b = _mm_add_ps(_mm_add_ps(_mm_mul_ps(lx, dx), _mm_mul_ps(ly, dy)), _mm_mul_ps(lz, dz));
+  __m128 c = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(lx, lx), _mm_mul_ps(ly, ly)), _mm_mul_ps(lz, lz)),
+    _mm_load_ps(block.radius2));
+  __m128 discriminant = _mm_sub_ps(_mm_mul_ps(b, b), _mm_mul_ps(_mm_set1_ps(a), c));
+
+  __m128 root = _mm_sqrt_ps(_mm_max_ps(discriminant, _mm_setzero_ps()));
+  __m128 inverseA = _mm_set1_ps(1.0f / a);
+  __m128 tEnter = _mm_mul_ps(_mm_sub_ps(b, root), inverseA);
+  __m128 tLeave = _mm_mul_ps(_mm_add_ps(b, root), inverseA);
+
+  // segments starting inside a sphere hit it where they leave
+  __m128 minimum = _mm_set1_ps(tMin);
+  __m128 entered = _mm_cmpgt_ps(tEnter, minimum);
+  __m128 tHit = _mm_or_ps(_mm_and_ps(entered, tEnter), _mm_andnot_ps(entered, tLeave));
+
+  __m128 hit = _mm_and_ps(used, _mm_cmpge_ps(discriminant, _mm_setzero_ps()));
+  hit = _mm_and_ps(hit, _mm_and_ps(_mm_cmpgt_ps(tHit, minimum), _mm_cmplt_ps(tHit, _mm_set1_ps(tMax))));
+
+  _mm_storeu_ps(t, tHit);
+  return _mm_movemask_ps(hit);
+}
+
+static int blockCount(const LinearNode& leaf) {
+  return (leaf.count + SPHERE_BLOCK_SIZE - 1) / SPHERE_BLOCK_SIZE;
+}
+
+void closestSphereHit(const SphereBVH& spheres, const vectorThree& origin, const vectorThree& dir, float tMin,
+  float& tHit, int& sphere) {
+
+  traverseNearToFar(spheres.tree, origin, dir, tHit, [&](int leaf) {
+
+    const LinearNode& node = spheres.tree.nodes[leaf];
+    for (int b = node.offset; b < node.offset + blockCount(node); b++) {
+
+      float t[SPHERE_BLOCK_SIZE];
+      int hits = raySphereBlockIntersection(spheres.blocks[b], origin, dir, tMin, tHit, t);
+
+      for (int lane = 0; lane < SPHERE_BLOCK_SIZE; lane++) {
+        if ((hits & (1 << lane)) && t[lane] < tHit) {
+          tHit = t[lane];
+          sphere = spheres.blocks[b].sphere[lane];
+        }
+      }
+    }
+  });
+}
+
+bool anySphereHit(const SphereBVH& spheres, const vectorThree& origin, const vectorThree& dir, float tMin, float tMax) {
+
+  return traverseAnyHit(spheres.tree, origin, dir, tMax, [&](int leaf) {
+
+    const LinearNode& node = spheres.tree.nodes[leaf];
+    for (int b = node.offset; b < node.offset + blockCount(node); b++) {
+      float t[SPHERE_BLOCK_SIZE];
+      if (raySphereBlockIntersection(spheres.blocks[b], origin, dir, tMin, tMax, t)) {
+        return true;
+      }
+    }
+    return false;
+  });
+}
+
+//===========================================================================
+//============================== Benchmark ==================================
+//===========================================================================
+
+void benchmarkSpheres() {
+
+  const int rays = 100000;
+
+  std::mt19937 generator(1);
+  std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+
+  std::vector<vectorThree> points(2 * rays);
+  for (vectorThree& point : points) {
+    point = { unit(generator), unit(generator), unit(generator) };
+  }
+
+  std::cout << "Closest sphere hits of " << rays << " random segments through the unit cube:" << std::endl;
+
+  // the spheres fill the same fraction of the cube whatever their number, so
+  // segments end after passing about as many of them and only the depth of
+  // the hierarchy grows with the count
+  for (int count = 1024; count <= 1024 * 1024; count *= 4) {
+
+    std::vector<Sphere> spheres;
+    float radius = 0.4f / std::cbrt(float(count));
+    for (int i = 0; i < count; i++) {
+      spheres.emplace_back(radius, vectorThree{ unit(generator), unit(generator), unit(generator) }, 0);
+    }
+
+    auto t1 = std::chrono::high_resolution_clock::now();
+    SphereBVH bvh = buildSphereBVH(spheres);
+    auto t2 = std::chrono::high_resolution_clock::now();
+
+    long long boxChecks = rayBoxChecks;
+    long long sphereChecks = raySphereChecks;
+    int hits = 0;
+
+    auto t3 = std::chrono::high_resolution_clock::now();
+    for (int i = 0; i < rays; i++) {
+      vectorThree dir = points[2 * i + 1] - points[2 * i];
+      float t = 1.0f;
+      int sphere = -1;
+      closestSphereHit(bvh, points[2 * i], dir, 0.0f, t, sphere);
+      hits += sphere >= 0;
+    }
+    auto t4 = std::chrono::high_resolution_clock::now();
+
+    std::cout << "  " << count << " spheres: built in "
+      << std::chrono::duration_cast<std::chrono::microseconds>( t2 - t1 ).count()/1000.0 << " ms, "
+      << std::chrono::duration_cast<std::chrono::nanoseconds>( t4 - t3 ).count() / double(rays) << " ns per ray, "
+      << float(rayBoxChecks - boxChecks) / rays << " box and " << float(raySphereChecks - sphereChecks) / rays
+      << " sphere tests per ray, " << hits << " hits" << std::endl;
+  }
+}
@@ -0,0 +1,74 @@
+#ifndef __SPHERES__
+#define __SPHERES__
+
+#include "bvh.hpp"
+
+extern long long raySphereChecks;
+
+// Spheres per block, one SSE register per coordinate
+static const int SPHERE_BLOCK_SIZE = 4;
+
+// Most spheres a leaf of the sphere hierarchy holds
+static const int SPHERE_MAX_LEAF_SIZE = 2 * SPHERE_BLOCK_SIZE;
+
+// Times closest hits against random spheres of growing counts at startup
+static const bool SPHERE_BENCHMARK = false;
+
+// Spheres of a leaf stored as structure of arrays
+struct alignas(16) SphereBlock {
+	float cx[SPHERE_BLOCK_SIZE];
+	float cy[SPHERE_BLOCK_SIZE];
+	float cz[SPHERE_BLOCK_SIZE];
+	float radius2[SPHERE_BLOCK_SIZE];
+	// index into SphereBVH::spheres, -1 for unused lanes
+	int sphere[SPHERE_BLOCK_SIZE];
+};
+
+static_assert(sizeof(SphereBlock) % 16 == 0, "SphereBlock must keep every lane array 16 byte aligned");
+
+typedef std::vector<SphereBlock, AlignedAllocator<SphereBlock, 16>> SphereBlockArray;
+
+// Spheres get leaves of their own in a hierarchy with the same node layout
+// and traversal as the triangles
+struct SphereBVH {
+	// leaves reference count spheres packed in the blocks starting at offset
+	LinearBVH tree;
+	SphereBlockArray blocks;
+	// the spheres the hierarchy was built from, in their original order
+	std::vector<Sphere> spheres;
+};
+
+/**
+ * @brief Builds the hierarchy over the bounds of the spheres, splitting at
+ * the median centroid along the longest axis
+ */
+SphereBVH buildSphereBVH(const std::vector<Sphere>& spheres);
+
+/**
+ * @brief Tests the segment from origin to origin + dir against the four
+ * spheres of the block at once. Returns the spheres hit with t in (tMin,
+ * tMax) as a bit mask with the first such t of each in t, which is where the
+ * segment leaves a sphere it starts in.
+ */
+int raySphereBlockIntersection(const SphereBlock& block, const vectorThree& origin, const vectorThree& dir,
+	float tMin, float tMax, float t[SPHERE_BLOCK_SIZE]);
+
+/**
+ * @brief Closest sphere hit by origin + t * dir with t in (tMin, tHit). On a
+ * hit tHit is lowered and sphere set to its index into SphereBVH::spheres.
+ */
+void closestSphereHit(const SphereBVH& spheres, const vectorThree& origin, const vectorThree& dir, float tMin,
+	float& tHit, int& sphere);
+
+/**
+ * @brief Whether any sphere is hit by origin + t * dir with t in (tMin, tMax)
+ */
+bool anySphereHit(const SphereBVH& spheres, const vectorThree& origin, const vectorThree& dir, float tMin, float tMax);
+
+/**
+ * @brief Prints the closest hit cost of random segments through growing
+ * numbers of random spheres
+ */
+void benchmarkSpheres();
+
+#endif // SPHERES
@@ -0,0 +1,162 @@
+#include "stackless.hpp"
+
+static vectorThree centroidOf(const LinearNode& node) {
+  return { (node.min[0] + node.max[0]) * 0.5f, (node.min[1] + node.max[1]) * 0.5f, (node.min[2] + node.max[2]) * 0.5f };
+}
+
+// The children are ordered along the axis their centers are furthest apart on
+static std::uint8_t childOrder(const LinearBVH& bvh, int node) {
+
+  vectorThree first = centroidOf(bvh.nodes[node + 1]);
+  vectorThree second = centroidOf(bvh.nodes[bvh.nodes[node].offset]);
+  vectorThree offset = second - first;
+
+  int axis = 0;
+  for (int a = 1; a < 3; a++) {
+    if (std::abs(offset[a]) > std::abs(offset[axis])) {
+      axis = a;
+    }
+  }
+  return std::uint8_t(axis * 2 + (offset[axis] < 0.0f ? 1 : 0));
+}
+
+StacklessLinks buildStacklessLinks(const LinearBVH& bvh) {
+
+  StacklessLinks links;
+  links.parents.assign(bvh.nodes.size(), -1);
+  links.order.assign(bvh.nodes.size(), 0);
+
+  for (int i = 0; i < bvh.nodes.size(); i++) {
+
+    const LinearNode& node = bvh.nodes[i];
+    if (node.isLeaf()) {
+      continue;
+    }
+
+    links.parents[i + 1] = i;
+    links.parents[node.offset] = i;
+    links.order[i] = childOrder(bvh, i);
+  }
+
+  return links;
+}
+
+void refitStacklessLinks(StacklessLinks& links, const LinearBVH& bvh) {
+
+  for (int i = 0; i < bvh.nodes.size(); i++) {
+    if (!bvh.nodes[i].isLeaf()) {
+      links.order[i] = childOrder(bvh, i);
+    }
+  }
+}
+
+//===========================================================================
+//============================== Traversal ==================================
+//===========================================================================
+
+// How the traversal arrived at the current node
+enum StacklessState {
+  FROM_PARENT,
+  FROM_SIBLING,
+  FROM_CHILD
+};
+
+// Walks the hierarchy like a depth first traversal with a stack: going down
+// to the near child, across to its sibling, and back up once both children
+// are done. The near child of a node only depends on the ray, so it is found
+// again on the way back up. Stops once intersectLeaf returns true, it may
+// lower tMax to skip the nodes entered beyond it.
+template <typename LeafFunction>
+static void traverseStackless(const LinearBVH& bvh, const StacklessLinks& links, const vectorThree& origin, const vectorThree& dir,
+  const float& tMax, LeafFunction intersectLeaf) {
+
+  if (bvh.nodes.empty()) {
+    return;
+  }
+
+  Ray ray(origin, dir);
+
+  auto nearChild = [&](int index) {
+    int order = links.order[index];
+    bool secondFirst = ((order & 1) != 0) != (dir[order >> 1] < 0.0f);
+    return secondFirst ? bvh.nodes[index].offset : index + 1;
+  };
+  auto sibling = [&](int index) {
+    int parent = links.parents[index];
+    return index == parent + 1 ? bvh.nodes[parent].offset : parent + 1;
+  };
+
+  float tNear, tFar;
+  if (!rayBoxEntry(bvh.nodes[0], ray, tMax, tNear, tFar)) {
+    return;
+  }
+  if (bvh.nodes[0].isLeaf()) {
+    intersectLeaf(0);
+    return;
+  }
+
+  int current = nearChild(0);
+  StacklessState state = FROM_PARENT;
+
+  while (true) {
+
+    if (state == FROM_CHILD) {
+      if (current == 0) {
+        return;
+      }
+      // after the near child comes its sibling, after the far child the
+      // parent is done as well
+      if (current == nearChild(links.parents[current])) {
+        current = sibling(current);
+        state = FROM_SIBLING;
+      }
+      else {
+        current = links.parents[current];
+      }
+      continue;
+    }
+
+    const LinearNode& node = bvh.nodes[current];
+    bool entered = rayBoxEntry(node, ray, tMax, tNear, tFar);
+
+    if (entered && !node.isLeaf()) {
+      current = nearChild(current);
+      state = FROM_PARENT;
+      continue;
+    }
+    if (entered && intersectLeaf(current)) {
+      return;
+    }
+
+    if (state == FROM_PARENT) {
+      current = sibling(current);
+      state = FROM_SIBLING;
+    }
+    else {
+      current = links.parents[current];
+      state = FROM_CHILD;
+    }
+  }
+}
+
+void closestHitStackless(const LinearBVH& bvh, const StacklessLinks& links, const TriangleLeaves& triangles,
+  const vectorThree& origin, const vectorThree& dir, float tMin, RayHit& hit, int cull) {
+
+  Mailbox mailbox;
+  traverseStackless(bvh, links, origin, dir, hit.t, [&](int leaf) {
+    intersectLeaf(bvh, triangles, leaf, origin, dir, tMin, hit, mailbox, cull);
+    return false;
+  });
+}
+
+bool anyHitStackless(const LinearBVH& bvh, const StacklessLinks& links, const TriangleLeaves& triangles,
+  const vectorThree& origin, const vectorThree& dir, float tMin, float tMax, int cull) {
+
+  bool hit = false;
+  Mailbox mailbox;
+  traverseStackless(bvh, links, origin, dir, tMax, [&](int leaf) {
+    hit = occludedLeaf(bvh, triangles, leaf, origin, dir, tMin, tMax, mailbox, cull);
+    return hit;
+  });
+  return hit;
+}
@@ -0,0 +1,44 @@
+#ifndef __STACKLESS__
+#define __STACKLESS__
+
+#include "triangles.hpp"
+#include <cstdint>
+
+// Links that let the flattened hierarchy be traversed without a stack: the
+// parent of every node, and the order the children of every interior node are
+// visited in. A ray only keeps the node it is at and how it got there.
+struct StacklessLinks {
+	// -1 for the root
+	std::vector<int> parents;
+	// axis the children are ordered along times two, plus one when the second
+	// child lies below the first on it. Rays going up the axis visit the lower
+	// child first. Unused for leaves.
+	std::vector<std::uint8_t> order;
+};
+
+/**
+ * @brief Links the nodes of the flattened hierarchy for stackless traversal
+ */
+StacklessLinks buildStacklessLinks(const LinearBVH& bvh);
+
+/**
+ * @brief Orders the children again after refitting so the order follows the
+ * bounds, the parents stay as they are
+ */
+void refitStacklessLinks(StacklessLinks& links, const LinearBVH& bvh);
+
+/**
+ * @brief Same as closestHit, walking the hierarchy through parent links
+ * instead of a stack. Children are visited in a fixed near to far order for
+ * the sign of the direction, and every hit shortens the segment.
+ */
+void closestHitStackless(const LinearBVH& bvh, const StacklessLinks& links, const TriangleLeaves& triangles,
+	const vectorThree& origin, const vectorThree& dir, float tMin, RayHit& hit, int cull = CULL_BY_LANE);
+
+/**
+ * @brief Same as anyHit, walking the hierarchy through parent links
+ */
+bool anyHitStackless(const LinearBVH& bvh, const StacklessLinks& links, const TriangleLeaves& triangles,
+	const vectorThree& origin, const vectorThree& dir, float tMin, float tMax, int cull = CULL_BY_LANE);
+
+#endif // STACKLESS
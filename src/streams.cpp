@@ -0,0 +1,66 @@
+#include "streams.hpp"
+
+//===========================================================================
+//=============================== Sorting ===================================
+//===========================================================================
+
+static const int STREAM_CELLS = 1 << STREAM_CELL_BITS;
+
+static uint32_t originCell(float value, float min, float max) {
+
+  if (max <= min) {
+    return 0;
+  }
+
+  int cell = int(STREAM_CELLS * (value - min) / (max - min));
+  return uint32_t(std::min(std::max(cell, 0), STREAM_CELLS - 1));
+}
+
+uint32_t streamKey(const vectorThree& origin, const vectorThree& target, const Bounds& bounds) {
+
+  uint32_t octant = (target.x < origin.x ? 1 : 0) | (target.y < origin.y ? 2 : 0) | (target.z < origin.z ? 4 : 0);
+
+  uint32_t x = originCell(origin.x, bounds.min.x, bounds.max.x);
+  uint32_t y = originCell(origin.y, bounds.min.y, bounds.max.y);
+  uint32_t z = originCell(origin.z, bounds.min.z, bounds.max.z);
+
+  uint32_t morton = 0;
+  for (int bit = 0; bit < STREAM_CELL_BITS; bit++) {
+    morton |= ((x >> bit) & 1) << (3 * bit + 2);
+    morton |= ((y >> bit) & 1) << (3 * bit + 1);
+    morton |= ((z >> bit) & 1) << (3 * bit);
+  }
+
+  return (octant << (3 * STREAM_CELL_BITS)) | morton;
+}
+
+void sortRayStream(RayStream& stream, const Bounds& bounds) {
+
+  int count = stream.size();
+  std::vector<uint32_t> keys(count);
+  std::vector<int> start((8 << (3 * STREAM_CELL_BITS)) + 1, 0);
+
+  for (int i = 0; i < count; i++) {
+    keys[i] = streamKey(stream.origins[i], stream.targets[i], bounds);
+    start[keys[i] + 1]++;
+  }
+  for (int key = 1; key < start.size(); key++) {
+    start[key] += start[key - 1];
+  }
+
+  stream.order.resize(count);
+  for (int i = 0; i < count; i++) {
+    stream.order[start[keys[i]]++] = i;
+  }
+
+  // tracing reads the rays one after the other, so they are moved into place
+  // rather than looked up through the order
+  std::vector<vectorThree> origins(count);
+  std::vector<vectorThree> targets(count);
+  for (int i = 0; i < count; i++) {
+    origins[i] = stream.origins[stream.order[i]];
+    targets[i] = stream.targets[stream.order[i]];
+  }
+  stream.origins.swap(origins);
+  stream.targets.swap(targets);
+}
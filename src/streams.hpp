@@ -0,0 +1,68 @@
+#ifndef __STREAMS__
+#define __STREAMS__
+
+#include "bvh.hpp"
+#include <cstdint>
+
+// Reflection and shadow rays can be buffered into streams and traced in
+// batches sorted by direction octant and origin cell instead of right when a
+// hit is shaded. The mode renders start in, switched at runtime.
+static const bool STREAM_SECONDARY_RAYS = false;
+// Pixels whose paths are buffered at once, rounded to whole rows of packets
+static const int STREAM_BATCH_PIXELS = 1 << 16;
+// Bits of the origin cell along every axis of the scene bounds
+static const int STREAM_CELL_BITS = 5;
+// Also trace every stream in the order its rays were generated in, which is
+// the order immediate tracing follows, and report both rates
+static const bool STREAM_COMPARE = false;
+
+// Segments from origins to targets, and where every one was added
+struct RayStream {
+	std::vector<vectorThree> origins;
+	std::vector<vectorThree> targets;
+	// index every ray had when it was added, filled by sortRayStream
+	std::vector<int> order;
+
+	int size() const { return int(origins.size()); }
+
+	void add(const vectorThree& origin, const vectorThree& target) {
+		origins.push_back(origin);
+		targets.push_back(target);
+	}
+
+	void clear() {
+		origins.clear();
+		targets.clear();
+		order.clear();
+	}
+};
+
+// Secondary rays of a render and the time spent tracing them, sorting
+// included
+struct StreamStats {
+	long long reflectionRays = 0;
+	long long shadowRays = 0;
+	double reflectionSeconds = 0.0;
+	double shadowSeconds = 0.0;
+	// the same streams traced in the order their rays were generated in,
+	// only measured with STREAM_COMPARE
+	double unsortedReflectionSeconds = 0.0;
+	double unsortedShadowSeconds = 0.0;
+};
+
+/**
+ * @brief Key rays are sorted by: the octant of the direction above the Morton
+ * code of the cell the origin lies in, with the bounds split into 2 ^
+ * STREAM_CELL_BITS cells along every axis. Origins outside the bounds go to
+ * the nearest cell.
+ */
+uint32_t streamKey(const vectorThree& origin, const vectorThree& target, const Bounds& bounds);
+
+/**
+ * @brief Orders the rays of the stream by their keys with a counting sort.
+ * Rays with the same key keep the order they were added in, order[i] is the
+ * index ray i had before.
+ */
+void sortRayStream(RayStream& stream, const Bounds& bounds);
+
+#endif // STREAMS
@@ -0,0 +1,98 @@
+#include "threadpool.hpp"
+#include <algorithm>
+#include <chrono>
+
+
+ThreadPool::ThreadPool(int workerCount) : busyNanoseconds(0) {
+
+  if (workerCount < 0) {
+    workerCount = std::max(int(std::thread::hardware_concurrency()) - 1, 0);
+  }
+
+  for (int i = 0; i < workerCount; i++) {
+    workers.emplace_back(&ThreadPool::workerLoop, this);
+  }
+}
+
+ThreadPool::~ThreadPool() {
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  taskAvailable.notify_all();
+
+  for (std::thread& worker : workers) {
+    worker.join();
+  }
+}
+
+void ThreadPool::submit(TaskGroup& group, std::function<void()> task) {
+
+  group.pending++;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    queue.push_back({ std::move(task), &group });
+  }
+  taskAvailable.notify_one();
+}
+
+// Pops and runs the oldest queued task, the lock is released while it runs
+bool ThreadPool::runOne(std::unique_lock<std::mutex>& lock) {
+
+  if (queue.empty()) {
+    return false;
+  }
+
+  Task task = std::move(queue.front());
+  queue.pop_front();
+  lock.unlock();
+
+  auto t1 = std::chrono::high_resolution_clock::now();
+  task.function();
+  auto t2 = std::chrono::high_resolution_clock::now();
+  busyNanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(t2 - t1).count();
+
+  lock.lock();
+  task.group->pending--;
+  taskFinished.notify_all();
+  return true;
+}
+
+void ThreadPool::wait(TaskGroup& group) {
+
+  std::unique_lock<std::mutex> lock(mutex);
+
+  while (group.pending > 0) {
+    if (!runOne(lock)) {
+      taskFinished.wait(lock);
+    }
+  }
+}
+
+void ThreadPool::workerLoop() {
+
+  std::unique_lock<std::mutex> lock(mutex);
+
+  while (true) {
+
+    taskAvailable.wait(lock, [this] { return stopping || !queue.empty(); });
+
+    if (stopping && queue.empty()) {
+      return;
+    }
+    runOne(lock);
+  }
+}
+
+void ThreadPool::parallelFor(int begin, int end, int chunkSize, const std::function<void(int, int)>& body) {
+
+  TaskGroup group;
+
+  for (int chunk = begin; chunk < end; chunk += chunkSize) {
+    int chunkEnd = std::min(chunk + chunkSize, end);
+    submit(group, [&body, chunk, chunkEnd] { body(chunk, chunkEnd); });
+  }
+
+  wait(group);
+}
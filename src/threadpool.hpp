@@ -0,0 +1,75 @@
+#ifndef __THREADPOOL__
+#define __THREADPOOL__
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Counts the unfinished tasks submitted under it, so a caller can wait for
+// its own tasks while other tasks keep running
+struct TaskGroup {
+	std::atomic<int> pending;
+
+	TaskGroup(void) : pending(0) {}
+};
+
+class ThreadPool {
+public:
+
+	/**
+	 * @brief Starts the workers, by default one less than the hardware threads
+	 * since the thread calling wait helps with the queued tasks
+	 */
+	explicit ThreadPool(int workerCount = -1);
+
+	~ThreadPool();
+
+	void submit(TaskGroup& group, std::function<void()> task);
+
+	/**
+	 * @brief Runs queued tasks on the calling thread until every task of the group is done
+	 */
+	void wait(TaskGroup& group);
+
+	/**
+	 * @brief Number of threads working on tasks, including the waiting thread
+	 */
+	int size() const { return int(workers.size()) + 1; }
+
+	/**
+	 * @brief Seconds spent running tasks on all threads since the last reset
+	 */
+	double busySeconds() const { return busyNanoseconds.load() / 1e9; }
+
+	void resetBusyTime() { busyNanoseconds = 0; }
+
+	/**
+	 * @brief Calls body(chunkBegin, chunkEnd) for chunks of [begin, end) in parallel
+	 */
+	void parallelFor(int begin, int end, int chunkSize, const std::function<void(int, int)>& body);
+
+private:
+
+	struct Task {
+		std::function<void()> function;
+		TaskGroup* group;
+	};
+
+	bool runOne(std::unique_lock<std::mutex>& lock);
+
+	void workerLoop();
+
+	std::vector<std::thread> workers;
+	std::deque<Task> queue;
+	std::mutex mutex;
+	std::condition_variable taskAvailable;
+	std::condition_variable taskFinished;
+	std::atomic<long long> busyNanoseconds;
+	bool stopping = false;
+};
+
+#endif // THREADPOOL
@@ -0,0 +1,273 @@
+#include "treelet.hpp"
+
+// The hierarchy as an array of nodes, so treelets can be rewired in place and
+// every node keeps the cost and height of its subtree
+struct TreeletNode {
+  Bounds bounds;
+  int children[2];
+  // index into TreeletTree::leaves for leaves, -1 for interior nodes
+  int leaf;
+  // SAH cost of the subtree, not yet divided by the root area
+  float cost;
+  int height;
+};
+
+struct TreeletTree {
+  std::vector<TreeletNode> nodes;
+  std::vector<BoundingBox> leaves;
+};
+
+static void updateNode(TreeletNode& node, const TreeletNode& left, const TreeletNode& right) {
+
+  node.bounds = left.bounds;
+  node.bounds.grow(right.bounds);
+  node.cost = SAH_TRAVERSAL_COST * node.bounds.surfaceArea() + left.cost + right.cost;
+  node.height = 1 + std::max(left.height, right.height);
+}
+
+//===========================================================================
+//============================= Conversion ==================================
+//===========================================================================
+
+// Moves the leaves of the hierarchy into the tree, children are always added
+// after their parent
+static int addNode(TreeletTree& tree, BoundingBox& box) {
+
+  int index = int(tree.nodes.size());
+  tree.nodes.emplace_back();
+
+  TreeletNode node;
+  node.bounds = box.getBounds();
+
+  if (box.children.empty()) {
+    node.children[0] = node.children[1] = -1;
+    node.leaf = int(tree.leaves.size());
+    node.cost = SAH_INTERSECTION_COST * box.faces.size() * node.bounds.surfaceArea();
+    node.height = 0;
+    tree.leaves.push_back(std::move(box));
+  }
+  else {
+    node.children[0] = addNode(tree, box.children[0]);
+    node.children[1] = addNode(tree, box.children[1]);
+    node.leaf = -1;
+    updateNode(node, tree.nodes[node.children[0]], tree.nodes[node.children[1]]);
+  }
+
+  // the recursion may have reallocated the array, so write the node last
+  tree.nodes[index] = node;
+  return index;
+}
+
+static BoundingBox assembleNode(TreeletTree& tree, int index) {
+
+  const TreeletNode& node = tree.nodes[index];
+  if (node.leaf >= 0) {
+    return std::move(tree.leaves[node.leaf]);
+  }
+
+  BoundingBox box;
+  box.children.resize(2);
+  box.children[0] = assembleNode(tree, node.children[0]);
+  box.children[1] = assembleNode(tree, node.children[1]);
+  box.setBounds(node.bounds);
+  return box;
+}
+
+//===========================================================================
+//============================ Restructuring ================================
+//===========================================================================
+
+static int lowestBit(int mask) {
+
+  int bit = 0;
+  while (!(mask & (1 << bit))) {
+    bit++;
+  }
+  return bit;
+}
+
+// Finds the cheapest binary tree over the leaves of the treelet rooted at
+// index and rebuilds the treelet with it when that lowers the cost. The
+// interior nodes of the treelet are reused, so nothing above it changes.
+static void restructureNode(TreeletTree& tree, int index, int depth) {
+
+  int leaves[TREELET_SIZE];
+  int interior[TREELET_SIZE - 1];
+  int leafCount = 0;
+  int interiorCount = 0;
+
+  TreeletNode& root = tree.nodes[index];
+  interior[interiorCount++] = index;
+  leaves[leafCount++] = root.children[0];
+  leaves[leafCount++] = root.children[1];
+
+  // keep opening the treelet leaf with the largest surface area
+  while (leafCount < TREELET_SIZE) {
+
+    int best = -1;
+    float bestArea = -1.0f;
+    for (int i = 0; i < leafCount; i++) {
+      const TreeletNode& candidate = tree.nodes[leaves[i]];
+      float area = candidate.bounds.surfaceArea();
+      if (candidate.leaf < 0 && area > bestArea) {
+        best = i;
+        bestArea = area;
+      }
+    }
+
+    if (best == -1) {
+      break;
+    }
+
+    const TreeletNode& open = tree.nodes[leaves[best]];
+    interior[interiorCount++] = leaves[best];
+    leaves[best] = open.children[0];
+    leaves[leafCount++] = open.children[1];
+  }
+
+  // two leaves only have a single topology
+  if (leafCount < 3) {
+    return;
+  }
+
+  // cost and height of the best subtree over every subset of the leaves
+  const int subsets = 1 << leafCount;
+  Bounds bounds[1 << TREELET_SIZE];
+  float cost[1 << TREELET_SIZE];
+  int height[1 << TREELET_SIZE];
+  int partition[1 << TREELET_SIZE];
+
+  for (int i = 0; i < leafCount; i++) {
+    const TreeletNode& leaf = tree.nodes[leaves[i]];
+    bounds[1 << i] = leaf.bounds;
+    cost[1 << i] = leaf.cost;
+    height[1 << i] = leaf.height;
+  }
+
+  // subsets are visited in increasing order, so all their parts are done
+  for (int subset = 1; subset < subsets; subset++) {
+
+    if ((subset & (subset - 1)) == 0) {
+      continue;
+    }
+
+    int lowest = subset & -subset;
+    bounds[subset] = bounds[lowest];
+    bounds[subset].grow(bounds[subset ^ lowest]);
+
+    // every split once: the part holding the lowest leaf goes left
+    float bestCost = FLT_MAX;
+    int bestPart = 0;
+    for (int part = (subset - 1) & subset; part > 0; part = (part - 1) & subset) {
+      if (!(part & lowest)) {
+        continue;
+      }
+      float partCost = cost[part] + cost[subset ^ part];
+      if (partCost < bestCost) {
+        bestCost = partCost;
+        bestPart = part;
+      }
+    }
+
+    cost[subset] = SAH_TRAVERSAL_COST * bounds[subset].surfaceArea() + bestCost;
+    height[subset] = 1 + std::max(height[bestPart], height[subset ^ bestPart]);
+    partition[subset] = bestPart;
+  }
+
+  int all = subsets - 1;
+
+  // a deeper treelet must still fit the traversal stack
+  if (cost[all] >= root.cost * (1.0f - 1e-6f) || depth + height[all] > BVH_MAX_DEPTH - 1) {
+    return;
+  }
+
+  // rebuild top down, the root keeps its index and the other interior nodes
+  // are handed out again in any order
+  int next = 1;
+  int pending[TREELET_SIZE - 1];
+  int pendingNodes[TREELET_SIZE - 1];
+  int pendingCount = 0;
+  pending[pendingCount] = all;
+  pendingNodes[pendingCount++] = index;
+
+  int order[TREELET_SIZE - 1];
+  int orderCount = 0;
+
+  while (pendingCount > 0) {
+
+    pendingCount--;
+    int subset = pending[pendingCount];
+    int nodeIndex = pendingNodes[pendingCount];
+    order[orderCount++] = nodeIndex;
+
+    int parts[2] = { partition[subset], subset ^ partition[subset] };
+    for (int side = 0; side < 2; side++) {
+
+      int part = parts[side];
+      int child;
+      if ((part & (part - 1)) == 0) {
+        child = leaves[lowestBit(part)];
+      }
+      else {
+        child = interior[next++];
+        pending[pendingCount] = part;
+        pendingNodes[pendingCount++] = child;
+      }
+      tree.nodes[nodeIndex].children[side] = child;
+    }
+  }
+
+  // parents were emitted before their children, update them the other way
+  for (int i = orderCount - 1; i >= 0; i--) {
+    TreeletNode& node = tree.nodes[order[i]];
+    updateNode(node, tree.nodes[node.children[0]], tree.nodes[node.children[1]]);
+  }
+}
+
+// One bottom up pass, the treelets of both children are restructured before
+// the treelet of the node. Nodes above parallelDepth run one child as a task.
+static void restructureSubtree(TreeletTree& tree, int index, int depth, int parallelDepth, ThreadPool& pool) {
+
+  TreeletNode& node = tree.nodes[index];
+  if (node.leaf >= 0) {
+    return;
+  }
+
+  if (depth < parallelDepth) {
+    TaskGroup group;
+    pool.submit(group, [&] { restructureSubtree(tree, node.children[0], depth + 1, parallelDepth, pool); });
+    restructureSubtree(tree, node.children[1], depth + 1, parallelDepth, pool);
+    pool.wait(group);
+  }
+  else {
+    restructureSubtree(tree, node.children[0], depth + 1, parallelDepth, pool);
+    restructureSubtree(tree, node.children[1], depth + 1, parallelDepth, pool);
+  }
+
+  updateNode(node, tree.nodes[node.children[0]], tree.nodes[node.children[1]]);
+  restructureNode(tree, index, depth);
+}
+
+void restructureTreelets(BoundingBox& root, ThreadPool& pool) {
+
+  if (root.children.empty()) {
+    return;
+  }
+
+  std::vector<Sphere> spheres = std::move(root.spheres);
+
+  TreeletTree tree;
+  addNode(tree, root);
+
+  int parallelDepth = 0;
+  while ((1 << parallelDepth) < 4 * pool.size()) {
+    parallelDepth++;
+  }
+
+  for (int pass = 0; pass < TREELET_PASSES; pass++) {
+    restructureSubtree(tree, 0, 0, pool.size() > 1 ? parallelDepth : 0, pool);
+  }
+
+  root = assembleNode(tree, 0);
+  root.spheres = std::move(spheres);
+}
@@ -0,0 +1,26 @@
+#ifndef __TREELET__
+#define __TREELET__
+
+#include "bvh.hpp"
+
+// Treelet restructuring settings. Every pass visits all nodes bottom up, so
+// later passes build on the topology the earlier ones found. Restructuring is
+// meant for static scenes that are built once, so it is off by default and
+// never runs after the LBVH builder, which exists for fast rebuilds.
+static const bool BUILD_RESTRUCTURE = false;
+static const int TREELET_SIZE = 7;
+static const int TREELET_PASSES = 3;
+
+static_assert(TREELET_SIZE >= 3 && TREELET_SIZE <= 8, "Treelets must have between 3 and 8 leaves");
+
+/**
+ * @brief Lowers the SAH cost of a hierarchy built by any builder. Every node
+ * is the root of a treelet grown to TREELET_SIZE leaves by opening the largest
+ * ones, and the treelet is rebuilt with the topology over those leaves that
+ * has the lowest SAH cost, found by dynamic programming over all subsets.
+ * Treelets of disjoint subtrees are restructured in parallel. The leaves of
+ * the hierarchy keep their faces.
+ */
+void restructureTreelets(BoundingBox& root, ThreadPool& pool);
+
+#endif // TREELET
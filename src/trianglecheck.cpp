@@ -0,0 +1,120 @@
+#include "triangles.hpp"
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+// Checks that every triangle kernel the CPU supports returns exactly the hits
+// of the scalar kernel on the given OBJ files. The segments of leafSegments
+// aim at a random point inside, a point on an edge and a vertex of every face,
+// so the lanes that fall back to the scalar test are exercised as well. Exits with 1 on any disagreement and with 2 when a file
+// cannot be read.
+
+//===========================================================================
+//================================ Loading ==================================
+//===========================================================================
+
+// Faces of an OBJ file, polygons are split into fans. Only positions are
+// read, the normals are computed from the winding.
+static bool loadFaces(const std::string& path, std::vector<face>& faces) {
+
+  std::ifstream in(path);
+  if (!in) {
+    return false;
+  }
+
+  std::vector<vectorThree> vertices;
+  std::string line;
+  while (std::getline(in, line)) {
+
+    std::istringstream tokens(line);
+    std::string type;
+    tokens >> type;
+
+    if (type == "v") {
+      vectorThree vertex;
+      tokens >> vertex.x >> vertex.y >> vertex.z;
+      vertices.push_back(vertex);
+    }
+    else if (type == "f") {
+
+      // indices may carry texture and normal indices after a slash, and
+      // count back from the last vertex when negative
+      std::vector<int> ids;
+      std::string corner;
+      while (tokens >> corner) {
+        int id = std::stoi(corner.substr(0, corner.find('/')));
+        ids.push_back(id < 0 ? int(vertices.size()) + id : id - 1);
+      }
+
+      for (int i = 1; i + 1 < int(ids.size()); i++) {
+        if (ids[0] < 0 || ids[i + 1] >= int(vertices.size())) {
+          return false;
+        }
+
+        face currentFace;
+        currentFace.vertex1 = vertices[ids[0]];
+        currentFace.vertex2 = vertices[ids[i]];
+        currentFace.vertex3 = vertices[ids[i + 1]];
+        currentFace.normal = (currentFace.vertex2 - currentFace.vertex1).cross(currentFace.vertex3 - currentFace.vertex1).normalize();
+        currentFace.material_id = 0;
+        faces.push_back(currentFace);
+      }
+    }
+  }
+
+  return true;
+}
+
+//===========================================================================
+//================================ Checking =================================
+//===========================================================================
+
+// Returns the disagreements of all SIMD kernels with the scalar one
+static long long checkModel(const std::string& path, const std::vector<face>& faces) {
+
+  LinearBVH bvh = flattenBVH(buildBVH(faces, BUILD_SAH));
+  TriangleLeaves triangles = buildTriangleLeaves(bvh);
+  LeafSegments segments = leafSegments(bvh, int(bvh.faces.size()), true);
+
+  long long total = 0;
+  std::vector<RayHit> reference = closestInLeaves(bvh, triangles, segments, TRIANGLE_KERNEL_SCALAR);
+
+  for (int kernel = TRIANGLE_KERNEL_SCALAR; kernel <= bestTriangleKernel(); kernel++) {
+
+    std::vector<RayHit> hits = closestInLeaves(bvh, triangles, segments, TriangleKernel(kernel));
+
+    int hitCount = 0;
+    long long disagreements = 0;
+    for (std::size_t j = 0; j < hits.size(); j++) {
+      hitCount += hits[j].face >= 0;
+      disagreements += !sameHit(hits[j], reference[j]);
+    }
+
+    std::cout << path << ": " << triangleKernelName(TriangleKernel(kernel)) << ", " << hits.size() << " segments, "
+      << hitCount << " hits, " << disagreements << " disagreements" << std::endl;
+    total += disagreements;
+  }
+
+  return total;
+}
+
+int main(int argc, char** argv) {
+
+  if (argc < 2) {
+    std::cout << "Usage: " << argv[0] << " model.obj..." << std::endl;
+    return 2;
+  }
+
+  long long disagreements = 0;
+  for (int i = 1; i < argc; i++) {
+
+    std::vector<face> faces;
+    if (!loadFaces(argv[i], faces)) {
+      std::cout << argv[i] << ": cannot be read" << std::endl;
+      return 2;
+    }
+    disagreements += checkModel(argv[i], faces);
+  }
+
+  return disagreements > 0 ? 1 : 0;
+}
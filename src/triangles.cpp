@@ -0,0 +1,766 @@
+#include "triangles.hpp"
+#include "widebvh.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <immintrin.h>
+#include <random>
+
+// The 8 wide kernel is compiled for AVX regardless of the global compiler
+// flags and only runs after checking the CPU. FMA is left out on purpose: a
+// fused product rounds differently depending on which face an edge belongs
+// to, and the lanes have to round exactly like the scalar test.
+#if defined(__GNUC__)
+#define TARGET_AVX __attribute__((target("avx")))
+#else
+#define TARGET_AVX
+#endif
+
+//===========================================================================
+//============================== Packing ====================================
+//===========================================================================
+
+static float centroidOn(const face& currentFace, int axis) {
+  return currentFace.vertex1[axis] + currentFace.vertex2[axis] + currentFace.vertex3[axis];
+}
+
+static void setVertices(TriangleBlock& block, int lane, const face& currentFace) {
+
+  const vectorThree& v0 = currentFace.vertex1;
+  const vectorThree& v1 = currentFace.vertex2;
+  const vectorThree& v2 = currentFace.vertex3;
+
+  block.v0x[lane] = v0.x;
+  block.v0y[lane] = v0.y;
+  block.v0z[lane] = v0.z;
+  block.v1x[lane] = v1.x;
+  block.v1y[lane] = v1.y;
+  block.v1z[lane] = v1.z;
+  block.v2x[lane] = v2.x;
+  block.v2y[lane] = v2.y;
+  block.v2z[lane] = v2.z;
+}
+
+static void setLane(TriangleBlock& block, int lane, const face& currentFace, int index) {
+
+  setVertices(block, lane, currentFace);
+  block.face[lane] = index;
+  block.cull[lane] = DEFAULT_CULL_MODE;
+}
+
+// Unused lanes get a degenerate triangle, so they never hit
+static void clearLane(TriangleBlock& block, int lane) {
+
+  block.v0x[lane] = block.v0y[lane] = block.v0z[lane] = 0.0f;
+  block.v1x[lane] = block.v1y[lane] = block.v1z[lane] = 0.0f;
+  block.v2x[lane] = block.v2y[lane] = block.v2z[lane] = 0.0f;
+  block.face[lane] = -1;
+  block.cull[lane] = DEFAULT_CULL_MODE;
+}
+
+void appendTriangleBlocks(const face* faces, const int* indices, int count, TriangleBlockArray& blocks) {
+
+  for (int j = 0; j < count; j += TRIANGLE_BLOCK_SIZE) {
+
+    TriangleBlock block;
+    for (int lane = 0; lane < TRIANGLE_BLOCK_SIZE; lane++) {
+      if (j + lane < count) {
+        setLane(block, lane, faces[indices[j + lane]], indices[j + lane]);
+      }
+      else {
+        clearLane(block, lane);
+      }
+    }
+    blocks.push_back(block);
+  }
+}
+
+void refitTriangleBlocks(TriangleBlockArray& blocks, const face* faces) {
+
+  for (TriangleBlock& block : blocks) {
+    for (int lane = 0; lane < TRIANGLE_BLOCK_SIZE; lane++) {
+      if (block.face[lane] >= 0) {
+        setVertices(block, lane, faces[block.face[lane]]);
+      }
+    }
+  }
+}
+
+void applyCullModes(TriangleBlockArray& blocks, const face* faces, const std::vector<CullMode>& modes) {
+
+  for (TriangleBlock& block : blocks) {
+    for (int lane = 0; lane < TRIANGLE_BLOCK_SIZE; lane++) {
+
+      if (block.face[lane] < 0) {
+        continue;
+      }
+      int material = faces[block.face[lane]].material_id;
+      block.cull[lane] = material >= 0 && material < int(modes.size()) ? modes[material] : DEFAULT_CULL_MODE;
+    }
+  }
+}
+
+const char* cullModeName(CullMode mode) {
+
+  switch (mode) {
+  case CULL_NONE: return "none";
+  case CULL_BACK: return "back faces";
+  case CULL_FRONT: return "front faces";
+  }
+  return "unknown";
+}
+
+TriangleLeaves buildTriangleLeaves(const LinearBVH& bvh) {
+
+  TriangleLeaves leaves;
+  leaves.firstBlock.assign(bvh.nodes.size(), -1);
+
+  std::vector<int> order;
+
+  for (int i = 0; i < bvh.nodes.size(); i++) {
+
+    const LinearNode& node = bvh.nodes[i];
+    if (!node.isLeaf()) {
+      continue;
+    }
+
+    order.resize(node.count);
+    for (int j = 0; j < node.count; j++) {
+      order[j] = node.offset + j;
+    }
+
+    int axis = node.getBounds().maxAxis();
+    std::sort(order.begin(), order.end(), [&bvh, axis](int a, int b) {
+      return centroidOn(bvh.faces[a], axis) < centroidOn(bvh.faces[b], axis);
+    });
+
+    leaves.firstBlock[i] = int(leaves.blocks.size());
+    appendTriangleBlocks(bvh.faces.data(), order.data(), node.count, leaves.blocks);
+  }
+
+  return leaves;
+}
+
+//===========================================================================
+//============================= Intersection ================================
+//===========================================================================
+
+ShearedRay::ShearedRay(const vectorThree& origin, const vectorThree& dir, int cull) : origin(origin), cull(cull) {
+
+  float x = std::abs(dir.x);
+  float y = std::abs(dir.y);
+  float z = std::abs(dir.z);
+  kz = x > y ? (x > z ? 0 : 2) : (y > z ? 1 : 2);
+  kx = (kz + 1) % 3;
+  ky = (kx + 1) % 3;
+  if (dir[kz] < 0.0f) {
+    std::swap(kx, ky);
+  }
+
+  sx = dir[kx] / dir[kz];
+  sy = dir[ky] / dir[kz];
+  sz = 1.0f / dir[kz];
+}
+
+bool rayTriangleWatertight(const ShearedRay& ray, const vectorThree& a, const vectorThree& b, const vectorThree& c,
+  int cull, RayHit& hit) {
+
+  rayTriangleChecks++;
+
+  // the vertices relative to the origin, sheared so the segment runs along z
+  float az = a[ray.kz] - ray.origin[ray.kz];
+  float bz = b[ray.kz] - ray.origin[ray.kz];
+  float cz = c[ray.kz] - ray.origin[ray.kz];
+  float ax = a[ray.kx] - ray.origin[ray.kx] - ray.sx * az;
+  float ay = a[ray.ky] - ray.origin[ray.ky] - ray.sy * az;
+  float bx = b[ray.kx] - ray.origin[ray.kx] - ray.sx * bz;
+  float by = b[ray.ky] - ray.origin[ray.ky] - ray.sy * bz;
+  float cx = c[ray.kx] - ray.origin[ray.kx] - ray.sx * cz;
+  float cy = c[ray.ky] - ray.origin[ray.ky] - ray.sy * cz;
+
+  // twice the signed areas of the triangles the segment forms with each edge
+  float u = cx * by - cy * bx;
+  float v = ax * cy - ay * cx;
+  float w = bx * ay - by * ax;
+
+  // a segment exactly through an edge is decided in double precision, so the
+  // faces on either side agree on which of them it passes
+  if (u == 0.0f || v == 0.0f || w == 0.0f) {
+    u = float(double(cx) * double(by) - double(cy) * double(bx));
+    v = float(double(ax) * double(cy) - double(ay) * double(cx));
+    w = float(double(bx) * double(ay) - double(by) * double(ax));
+  }
+
+  if ((u < 0.0f || v < 0.0f || w < 0.0f) && (u > 0.0f || v > 0.0f || w > 0.0f)) {
+    return false;
+  }
+
+  float determinant = u + v + w;
+  if (determinant == 0.0f) {
+    return false;
+  }
+
+  // the front side winds counter clockwise around the direction of approach
+  bool front = determinant > 0.0f;
+  if ((cull == CULL_BACK && !front) || (cull == CULL_FRONT && front)) {
+    return false;
+  }
+
+  float t = (u * az + v * bz + w * cz) * ray.sz / determinant;
+  if (t <= 0.0f) {
+    return false;
+  }
+
+  rayTriangleIntersections++;
+  hit.t = t;
+  hit.front = front;
+  hit.u = v / determinant;
+  hit.v = w / determinant;
+  return true;
+}
+
+bool rayLaneIntersection(const TriangleBlock& block, int lane, const ShearedRay& ray, RayHit& hit) {
+
+  vectorThree a = { block.v0x[lane], block.v0y[lane], block.v0z[lane] };
+  vectorThree b = { block.v1x[lane], block.v1y[lane], block.v1z[lane] };
+  vectorThree c = { block.v2x[lane], block.v2y[lane], block.v2z[lane] };
+
+  if (!rayTriangleWatertight(ray, a, b, c, ray.cull == CULL_BY_LANE ? block.cull[lane] : ray.cull, hit)) {
+    return false;
+  }
+  hit.face = block.face[lane];
+  return true;
+}
+
+int rayBlockIntersection(const TriangleBlock& block, const ShearedRay& ray, RayHit hits[TRIANGLE_BLOCK_SIZE]) {
+
+  int mask = 0;
+
+  for (int lane = 0; lane < TRIANGLE_BLOCK_SIZE; lane++) {
+    if (block.face[lane] >= 0 && rayLaneIntersection(block, lane, ray, hits[lane])) {
+      mask |= 1 << lane;
+    }
+  }
+
+  return mask;
+}
+
+// Keeps the closest hit of the scalar test in the block
+static bool closestInBlockScalar(const TriangleBlock& block, const ShearedRay& ray, float tMin, RayHit& hit) {
+
+  bool closer = false;
+
+  RayHit hits[TRIANGLE_BLOCK_SIZE];
+  int mask = rayBlockIntersection(block, ray, hits);
+
+  for (int lane = 0; lane < TRIANGLE_BLOCK_SIZE; lane++) {
+
+    // faces referenced from several leaves are hit at the same t from
+    // every one of them, the strict comparison keeps only the first
+    if (!(mask & (1 << lane)) || hits[lane].t <= tMin || hits[lane].t >= hit.t) {
+      continue;
+    }
+
+    hit = hits[lane];
+    closer = true;
+  }
+
+  return closer;
+}
+
+static int countLanes(int mask) {
+
+  int count = 0;
+  for (; mask; mask &= mask - 1) {
+    count++;
+  }
+  return count;
+}
+
+static int lowestLane(int mask) {
+
+  int lane = 0;
+  while (!(mask & (1 << lane))) {
+    lane++;
+  }
+  return lane;
+}
+
+// Copies the lane of the SIMD test into hit, u and v are the edge functions
+// of the second and third vertex
+static void setHit(RayHit& hit, int face, float t, float u, float v, float determinant) {
+
+  hit.t = t;
+  hit.face = face;
+  hit.front = determinant > 0.0f;
+  hit.u = u / determinant;
+  hit.v = v / determinant;
+}
+
+// Same as rayTriangleWatertight for the four lanes of the block, the
+// operations are the same and in the same order so every lane rounds alike.
+// Returns the lanes hit with t > 0 on a side their cull mode keeps. Lanes in
+// use with an edge function of exactly zero are returned in uncertain
+// instead, the caller decides them with the scalar test.
+static __m128 blockHits4(const TriangleBlock& block, const ShearedRay& ray, __m128& t, __m128& u, __m128& v,
+  __m128& determinant, int& uncertain) {
+
+  const float* v0[3] = { block.v0x, block.v0y, block.v0z };
+  const float* v1[3] = { block.v1x, block.v1y, block.v1z };
+  const float* v2[3] = { block.v2x, block.v2y, block.v2z };
+
+  __m128 ox = _mm_set1_ps(ray.origin[ray.kx]);
+  __m128 oy = _mm_set1_ps(ray.origin[ray.ky]);
+  __m128 oz = _mm_set1_ps(ray.origin[ray.kz]);
+  __m128 sx = _mm_set1_ps(ray.sx);
+  __m128 sy = _mm_set1_ps(ray.sy);
+
+  __m128 az = _mm_sub_ps(_mm_load_ps(v0[ray.kz]), oz);
+  __m128 bz = _mm_sub_ps(_mm_load_ps(v1[ray.kz]), oz);
+  __m128 cz = _mm_sub_ps(_mm_load_ps(v2[ray.kz]), oz);
+  __m128 ax = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(v0[ray.kx]), ox), _mm_mul_ps(sx, az));
+  __m128 ay = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(v0[ray.ky]), oy), _mm_mul_ps(sy, az));
+  __m128 bx = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(v1[ray.kx]), ox), _mm_mul_ps(sx, bz));
+  __m128 by = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(v1[ray.ky]), oy), _mm_mul_ps(sy, bz));
+  __m128 cx = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(v2[ray.kx]), ox), _mm_mul_ps(sx, cz));
+  __m128 cy = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(v2[ray.ky]), oy), _mm_mul_ps(sy, cz));
+
+  __m128 w = _mm_sub_ps(_mm_mul_ps(bx, ay), _mm_mul_ps(by, ax));
+  u = _mm_sub_ps(_mm_mul_ps(cx, by), _mm_mul_ps(cy, bx));
+  v = _mm_sub_ps(_mm_mul_ps(ax, cy), _mm_mul_ps(ay, cx));
+
+  __m128i face = _mm_load_si128(reinterpret_cast<const __m128i*>(block.face));
+  __m128 used = _mm_castsi128_ps(_mm_cmpgt_epi32(face, _mm_set1_epi32(-1)));
+
+  __m128 zero = _mm_setzero_ps();
+  __m128 onEdge = _mm_or_ps(_mm_or_ps(_mm_cmpeq_ps(u, zero), _mm_cmpeq_ps(v, zero)), _mm_cmpeq_ps(w, zero));
+  uncertain = _mm_movemask_ps(_mm_and_ps(onEdge, used));
+
+  __m128 negative = _mm_or_ps(_mm_or_ps(_mm_cmplt_ps(u, zero), _mm_cmplt_ps(v, zero)), _mm_cmplt_ps(w, zero));
+  __m128 positive = _mm_or_ps(_mm_or_ps(_mm_cmpgt_ps(u, zero), _mm_cmpgt_ps(v, zero)), _mm_cmpgt_ps(w, zero));
+  __m128 inside = _mm_andnot_ps(_mm_and_ps(negative, positive), used);
+
+  determinant = _mm_add_ps(_mm_add_ps(u, v), w);
+  inside = _mm_and_ps(inside, _mm_cmpneq_ps(determinant, zero));
+
+  __m128i cull = ray.cull == CULL_BY_LANE ? _mm_load_si128(reinterpret_cast<const __m128i*>(block.cull)) : _mm_set1_epi32(ray.cull);
+  __m128 cullBack = _mm_castsi128_ps(_mm_cmpeq_epi32(cull, _mm_set1_epi32(CULL_BACK)));
+  __m128 cullFront = _mm_castsi128_ps(_mm_cmpeq_epi32(cull, _mm_set1_epi32(CULL_FRONT)));
+  __m128 front = _mm_cmpgt_ps(determinant, zero);
+  __m128 culled = _mm_or_ps(_mm_andnot_ps(front, cullBack), _mm_and_ps(front, cullFront));
+
+  __m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(u, az), _mm_mul_ps(v, bz)), _mm_mul_ps(w, cz));
+  t = _mm_div_ps(_mm_mul_ps(distance, _mm_set1_ps(ray.sz)), determinant);
+
+  // u and v are returned as the edge functions of the second and third vertex
+  u = v;
+  v = w;
+  return _mm_and_ps(_mm_andnot_ps(culled, inside), _mm_cmpgt_ps(t, zero));
+}
+
+static bool closestInBlock4(const TriangleBlock& block, const ShearedRay& ray, float tMin, RayHit& hit) {
+
+  __m128 t, u, v, determinant;
+  int uncertain;
+  __m128 hits = blockHits4(block, ray, t, u, v, determinant, uncertain);
+
+  if (uncertain) {
+    return closestInBlockScalar(block, ray, tMin, hit);
+  }
+
+  rayTriangleChecks += countLanes(_mm_movemask_ps(_mm_castsi128_ps(
+    _mm_cmpgt_epi32(_mm_load_si128(reinterpret_cast<const __m128i*>(block.face)), _mm_set1_epi32(-1)))));
+  rayTriangleIntersections += countLanes(_mm_movemask_ps(hits));
+
+  hits = _mm_and_ps(hits, _mm_and_ps(_mm_cmpgt_ps(t, _mm_set1_ps(tMin)), _mm_cmplt_ps(t, _mm_set1_ps(hit.t))));
+  if (!_mm_movemask_ps(hits)) {
+    return false;
+  }
+
+  // masked reduction, lanes that missed count as infinitely far and ties go
+  // to the lowest lane like in the scalar loop
+  __m128 masked = _mm_or_ps(_mm_and_ps(hits, t), _mm_andnot_ps(hits, _mm_set1_ps(INFINITY)));
+  __m128 closest = _mm_min_ps(masked, _mm_shuffle_ps(masked, masked, _MM_SHUFFLE(2, 3, 0, 1)));
+  closest = _mm_min_ps(closest, _mm_shuffle_ps(closest, closest, _MM_SHUFFLE(1, 0, 3, 2)));
+  int lane = lowestLane(_mm_movemask_ps(_mm_and_ps(hits, _mm_cmpeq_ps(masked, closest))));
+
+  alignas(16) float lanes[4][TRIANGLE_BLOCK_SIZE];
+  _mm_store_ps(lanes[0], t);
+  _mm_store_ps(lanes[1], u);
+  _mm_store_ps(lanes[2], v);
+  _mm_store_ps(lanes[3], determinant);
+  setHit(hit, block.face[lane], lanes[0][lane], lanes[1][lane], lanes[2][lane], lanes[3][lane]);
+  return true;
+}
+
+// Four lanes of two blocks side by side in one AVX register
+TARGET_AVX static inline __m256 loadPair(const float* first, const float* second) {
+  return _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_load_ps(first)), _mm_load_ps(second), 1);
+}
+
+TARGET_AVX static inline __m256 loadPair(const int* first, const int* second) {
+  __m128i low = _mm_load_si128(reinterpret_cast<const __m128i*>(first));
+  __m128i high = _mm_load_si128(reinterpret_cast<const __m128i*>(second));
+  return _mm256_cvtepi32_ps(_mm256_insertf128_si256(_mm256_castsi128_si256(low), high, 1));
+}
+
+// Same as blockHits4 for the eight lanes of two blocks, lanes 0 to 3 belong
+// to the first block. AVX has no 8 wide integer compares, so the face
+// indices and cull modes are compared as floats.
+TARGET_AVX static __m256 blockHits8(const TriangleBlock& first, const TriangleBlock& second, const ShearedRay& ray,
+  __m256& t, __m256& u, __m256& v, __m256& determinant, int& uncertain) {
+
+  const float* v0[2][3] = { { first.v0x, first.v0y, first.v0z }, { second.v0x, second.v0y, second.v0z } };
+  const float* v1[2][3] = { { first.v1x, first.v1y, first.v1z }, { second.v1x, second.v1y, second.v1z } };
+  const float* v2[2][3] = { { first.v2x, first.v2y, first.v2z }, { second.v2x, second.v2y, second.v2z } };
+
+  __m256 ox = _mm256_set1_ps(ray.origin[ray.kx]);
+  __m256 oy = _mm256_set1_ps(ray.origin[ray.ky]);
+  __m256 oz = _mm256_set1_ps(ray.origin[ray.kz]);
+  __m256 sx = _mm256_set1_ps(ray.sx);
+  __m256 sy = _mm256_set1_ps(ray.sy);
+
+  __m256 az = _mm256_sub_ps(loadPair(v0[0][ray.kz], v0[1][ray.kz]), oz);
+  __m256 bz = _mm256_sub_ps(loadPair(v1[0][ray.kz], v1[1][ray.kz]), oz);
+  __m256 cz = _mm256_sub_ps(loadPair(v2[0][ray.kz], v2[1][ray.kz]), oz);
+  __m256 ax = _mm256_sub_ps(_mm256_sub_ps(loadPair(v0[0][ray.kx], v0[1][ray.kx]), ox), _mm256_mul_ps(sx, az));
+  __m256 ay = _mm256_sub_ps(_mm256_sub_ps(loadPair(v0[0][ray.ky], v0[1][ray.ky]), oy), _mm256_mul_ps(sy, az));
+  __m256 bx = _mm256_sub_ps(_mm256_sub_ps(loadPair(v1[0][ray.kx], v1[1][ray.kx]), ox), _mm256_mul_ps(sx, bz));
+  __m256 by = _mm256_sub_ps(_mm256_sub_ps(loadPair(v1[0][ray.ky], v1[1][ray.ky]), oy), _mm256_mul_ps(sy, bz));
+  __m256 cx = _mm256_sub_ps(_mm256_sub_ps(loadPair(v2[0][ray.kx], v2[1][ray.kx]), ox), _mm256_mul_ps(sx, cz));
+  __m256 cy = _mm256_sub_ps(_mm256_sub_ps(loadPair(v2[0][ray.ky], v2[1][ray.ky]), oy), _mm256_mul_ps(sy, cz));
+
+  __m256 w = _mm256_sub_ps(_mm256_mul_ps(bx, ay), _mm256_mul_ps(by, ax));
+  u = _mm256_sub_ps(_mm256_mul_ps(cx, by), _mm256_mul_ps(cy, bx));
+  v = _mm256_sub_ps(_mm256_mul_ps(ax, cy), _mm256_mul_ps(ay, cx));
+
+  __m256 zero = _mm256_setzero_ps();
+  __m256 used = _mm256_cmp_ps(loadPair(first.face, second.face), zero, _CMP_GE_OQ);
+
+  __m256 onEdge = _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(u, zero, _CMP_EQ_OQ), _mm256_cmp_ps(v, zero, _CMP_EQ_OQ)),
+    _mm256_cmp_ps(w, zero, _CMP_EQ_OQ));
+  uncertain = _mm256_movemask_ps(_mm256_and_ps(onEdge, used));
+
+  __m256 negative = _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(u, zero, _CMP_LT_OQ), _mm256_cmp_ps(v, zero, _CMP_LT_OQ)),
+    _mm256_cmp_ps(w, zero, _CMP_LT_OQ));
+  __m256 positive = _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(u, zero, _CMP_GT_OQ), _mm256_cmp_ps(v, zero, _CMP_GT_OQ)),
+    _mm256_cmp_ps(w, zero, _CMP_GT_OQ));
+  __m256 inside = _mm256_andnot_ps(_mm256_and_ps(negative, positive), used);
+
+  determinant = _mm256_add_ps(_mm256_add_ps(u, v), w);
+  inside = _mm256_and_ps(inside, _mm256_cmp_ps(determinant, zero, _CMP_NEQ_UQ));
+
+  __m256 cull = ray.cull == CULL_BY_LANE ? loadPair(first.cull, second.cull) : _mm256_set1_ps(float(ray.cull));
+  __m256 cullBack = _mm256_cmp_ps(cull, _mm256_set1_ps(float(CULL_BACK)), _CMP_EQ_OQ);
+  __m256 cullFront = _mm256_cmp_ps(cull, _mm256_set1_ps(float(CULL_FRONT)), _CMP_EQ_OQ);
+  __m256 front = _mm256_cmp_ps(determinant, zero, _CMP_GT_OQ);
+  __m256 culled = _mm256_or_ps(_mm256_andnot_ps(front, cullBack), _mm256_and_ps(front, cullFront));
+
+  __m256 distance = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(u, az), _mm256_mul_ps(v, bz)), _mm256_mul_ps(w, cz));
+  t = _mm256_div_ps(_mm256_mul_ps(distance, _mm256_set1_ps(ray.sz)), determinant);
+
+  u = v;
+  v = w;
+  return _mm256_and_ps(_mm256_andnot_ps(culled, inside), _mm256_cmp_ps(t, zero, _CMP_GT_OQ));
+}
+
+TARGET_AVX static bool closestInBlockPair8(const TriangleBlock& first, const TriangleBlock& second, const ShearedRay& ray,
+  float tMin, RayHit& hit) {
+
+  __m256 t, u, v, determinant;
+  int uncertain;
+  __m256 hits = blockHits8(first, second, ray, t, u, v, determinant, uncertain);
+
+  if (uncertain) {
+    bool closer = closestInBlockScalar(first, ray, tMin, hit);
+    return closestInBlockScalar(second, ray, tMin, hit) || closer;
+  }
+
+  rayTriangleChecks += countLanes(_mm256_movemask_ps(_mm256_cmp_ps(loadPair(first.face, second.face), _mm256_setzero_ps(), _CMP_GE_OQ)));
+  rayTriangleIntersections += countLanes(_mm256_movemask_ps(hits));
+
+  hits = _mm256_and_ps(hits, _mm256_and_ps(_mm256_cmp_ps(t, _mm256_set1_ps(tMin), _CMP_GT_OQ),
+    _mm256_cmp_ps(t, _mm256_set1_ps(hit.t), _CMP_LT_OQ)));
+  if (!_mm256_movemask_ps(hits)) {
+    return false;
+  }
+
+  __m256 masked = _mm256_blendv_ps(_mm256_set1_ps(INFINITY), t, hits);
+  __m256 closest = _mm256_min_ps(masked, _mm256_permute_ps(masked, _MM_SHUFFLE(2, 3, 0, 1)));
+  closest = _mm256_min_ps(closest, _mm256_permute_ps(closest, _MM_SHUFFLE(1, 0, 3, 2)));
+  closest = _mm256_min_ps(closest, _mm256_permute2f128_ps(closest, closest, 1));
+  int lane = lowestLane(_mm256_movemask_ps(_mm256_and_ps(hits, _mm256_cmp_ps(masked, closest, _CMP_EQ_OQ))));
+
+  alignas(32) float lanes[4][2 * TRIANGLE_BLOCK_SIZE];
+  _mm256_store_ps(lanes[0], t);
+  _mm256_store_ps(lanes[1], u);
+  _mm256_store_ps(lanes[2], v);
+  _mm256_store_ps(lanes[3], determinant);
+  const TriangleBlock& block = lane < TRIANGLE_BLOCK_SIZE ? first : second;
+  setHit(hit, block.face[lane % TRIANGLE_BLOCK_SIZE], lanes[0][lane], lanes[1][lane], lanes[2][lane], lanes[3][lane]);
+  return true;
+}
+
+TriangleKernel bestTriangleKernel() {
+
+  // every CPU with AVX2 has AVX
+  static const TriangleKernel best = cpuSupportsAVX2() ? TRIANGLE_KERNEL_AVX : TRIANGLE_KERNEL_SSE;
+  return best;
+}
+
+const char* triangleKernelName(TriangleKernel kernel) {
+
+  switch (kernel) {
+  case TRIANGLE_KERNEL_SCALAR: return "scalar";
+  case TRIANGLE_KERNEL_SSE: return "4 wide (SSE)";
+  case TRIANGLE_KERNEL_AVX: return "8 wide (AVX)";
+  }
+  return "unknown";
+}
+
+bool closestInBlocks(const TriangleBlock* blocks, int blockCount, const ShearedRay& ray, float tMin, RayHit& hit,
+  TriangleKernel kernel) {
+
+  bool closer = false;
+  int b = 0;
+
+  if (kernel == TRIANGLE_KERNEL_AVX) {
+    for (; b + 1 < blockCount; b += 2) {
+      if (closestInBlockPair8(blocks[b], blocks[b + 1], ray, tMin, hit)) {
+        closer = true;
+      }
+    }
+  }
+
+  for (; b < blockCount; b++) {
+    bool blockCloser = kernel == TRIANGLE_KERNEL_SCALAR ? closestInBlockScalar(blocks[b], ray, tMin, hit)
+      : closestInBlock4(blocks[b], ray, tMin, hit);
+    if (blockCloser) {
+      closer = true;
+    }
+  }
+
+  return closer;
+}
+
+LeafSegments leafSegments(const LinearBVH& bvh, int targets, bool edges) {
+
+  LeafSegments segments;
+  int faceCount = int(bvh.faces.size());
+  if (bvh.nodes.empty() || faceCount == 0 || targets <= 0) {
+    return segments;
+  }
+
+  // leaves hold consecutive ranges of the faces
+  std::vector<int> leafOfFace(faceCount);
+  for (int i = 0; i < int(bvh.nodes.size()); i++) {
+    const LinearNode& node = bvh.nodes[i];
+    if (node.isLeaf()) {
+      std::fill(leafOfFace.begin() + node.offset, leafOfFace.begin() + node.offset + node.count, i);
+    }
+  }
+
+  Bounds bounds = bvh.nodes[0].getBounds();
+  std::mt19937 generator(1);
+  std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+
+  for (int i = 0; i < targets; i++) {
+
+    int f = int(std::int64_t(i) * faceCount / targets);
+    const face& target = bvh.faces[f];
+
+    float u = unit(generator);
+    float v = unit(generator);
+    if (u + v > 1.0f) {
+      u = 1.0f - u;
+      v = 1.0f - v;
+    }
+    float s = unit(generator);
+
+    vectorThree points[] = {
+      target.vertex1 * (1.0f - u - v) + target.vertex2 * u + target.vertex3 * v,
+      target.vertex2 * (1.0f - s) + target.vertex3 * s,
+      target.vertex1 };
+
+    for (int p = 0; p < (edges ? 3 : 1); p++) {
+      vectorThree origin = {
+        bounds.min.x + unit(generator) * (bounds.max.x - bounds.min.x),
+        bounds.min.y + unit(generator) * (bounds.max.y - bounds.min.y),
+        bounds.min.z + unit(generator) * (bounds.max.z - bounds.min.z) };
+
+      segments.leaves.push_back(leafOfFace[f]);
+      segments.origins.push_back(origin);
+      segments.dirs.push_back((points[p] - origin) * 2.0f);
+    }
+  }
+
+  return segments;
+}
+
+std::vector<RayHit> closestInLeaves(const LinearBVH& bvh, const TriangleLeaves& triangles, const LeafSegments& segments,
+  TriangleKernel kernel) {
+
+  std::vector<RayHit> hits(segments.leaves.size());
+  for (int j = 0; j < int(hits.size()); j++) {
+
+    int leaf = segments.leaves[j];
+    int blockCount = (bvh.nodes[leaf].count + TRIANGLE_BLOCK_SIZE - 1) / TRIANGLE_BLOCK_SIZE;
+    closestInBlocks(triangles.blocks.data() + triangles.firstBlock[leaf], blockCount, ShearedRay(segments.origins[j], segments.dirs[j]),
+      0.0f, hits[j], kernel);
+  }
+  return hits;
+}
+
+bool sameHit(const RayHit& a, const RayHit& b) {
+  return a.face == b.face && a.t == b.t && a.front == b.front && a.u == b.u && a.v == b.v;
+}
+
+bool intersectBlocks(const TriangleBlock* blocks, int blockCount, const vectorThree& origin, const vectorThree& dir,
+  float tMin, RayHit& hit, int cull) {
+
+  return closestInBlocks(blocks, blockCount, ShearedRay(origin, dir, cull), tMin, hit, bestTriangleKernel());
+}
+
+bool occludedBlocks(const TriangleBlock* blocks, int blockCount, const vectorThree& origin, const vectorThree& dir,
+  float tMin, float tMax, int cull) {
+
+  ShearedRay ray(origin, dir, cull);
+
+  for (int b = 0; b < blockCount; b++) {
+
+    // the first hit ends the query, so four lanes at a time are enough
+    RayHit hit;
+    hit.t = tMax;
+    if (closestInBlock4(blocks[b], ray, tMin, hit)) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+int filterBlocks(const TriangleBlock* blocks, int first, int blockCount, const int* faceIds, Mailbox* mailboxes, int rays,
+  TriangleBlock* filtered, int& filteredCount) {
+
+  filteredCount = 0;
+  int b = first;
+  for (; b < blockCount && filteredCount < MAILBOX_BLOCKS; b++) {
+
+    TriangleBlock& block = filtered[filteredCount];
+    block = blocks[b];
+
+    bool used = false;
+    for (int lane = 0; lane < TRIANGLE_BLOCK_SIZE; lane++) {
+      if (block.face[lane] < 0) {
+        continue;
+      }
+      // every ray marks the face, so none of them tests it again
+      bool visited = true;
+      for (int r = 0; r < MAILBOX_RAYS; r++) {
+        if (rays & (1 << r)) {
+          visited &= mailboxes[r].visited(faceIds[block.face[lane]]);
+        }
+      }
+      if (visited) {
+        clearLane(block, lane);
+      }
+      else {
+        used = true;
+      }
+    }
+    if (used) {
+      filteredCount++;
+    }
+  }
+
+  return b;
+}
+
+bool intersectLeaf(const LinearBVH& bvh, const TriangleLeaves& triangles, int leaf, const vectorThree& origin, const vectorThree& dir,
+  float tMin, RayHit& hit, Mailbox& mailbox, int cull) {
+
+  const TriangleBlock* blocks = triangles.blocks.data() + triangles.firstBlock[leaf];
+  int blockCount = (bvh.nodes[leaf].count + TRIANGLE_BLOCK_SIZE - 1) / TRIANGLE_BLOCK_SIZE;
+
+  if (bvh.faceIds.empty()) {
+    return intersectBlocks(blocks, blockCount, origin, dir, tMin, hit, cull);
+  }
+
+  // faces split by the SBVH are referenced by several leaves, test them once
+  ShearedRay ray(origin, dir, cull);
+  TriangleKernel kernel = bestTriangleKernel();
+  TriangleBlock filtered[MAILBOX_BLOCKS];
+  bool closer = false;
+
+  for (int b = 0; b < blockCount;) {
+    int filteredCount;
+    b = filterBlocks(blocks, b, blockCount, bvh.faceIds.data(), &mailbox, 1, filtered, filteredCount);
+    if (closestInBlocks(filtered, filteredCount, ray, tMin, hit, kernel)) {
+      closer = true;
+    }
+  }
+
+  return closer;
+}
+
+void closestHit(const LinearBVH& bvh, const TriangleLeaves& triangles, const vectorThree& origin, const vectorThree& dir,
+  float tMin, RayHit& hit, int cull) {
+
+  Mailbox mailbox;
+  traverseNearToFar(bvh, origin, dir, hit.t, [&](int leaf) {
+    intersectLeaf(bvh, triangles, leaf, origin, dir, tMin, hit, mailbox, cull);
+  });
+}
+
+bool occludedLeaf(const LinearBVH& bvh, const TriangleLeaves& triangles, int leaf, const vectorThree& origin, const vectorThree& dir,
+  float tMin, float tMax, Mailbox& mailbox, int cull) {
+
+  const TriangleBlock* blocks = triangles.blocks.data() + triangles.firstBlock[leaf];
+  int blockCount = (bvh.nodes[leaf].count + TRIANGLE_BLOCK_SIZE - 1) / TRIANGLE_BLOCK_SIZE;
+
+  if (bvh.faceIds.empty()) {
+    return occludedBlocks(blocks, blockCount, origin, dir, tMin, tMax, cull);
+  }
+
+  TriangleBlock filtered[MAILBOX_BLOCKS];
+  for (int b = 0; b < blockCount;) {
+    int filteredCount;
+    b = filterBlocks(blocks, b, blockCount, bvh.faceIds.data(), &mailbox, 1, filtered, filteredCount);
+    if (occludedBlocks(filtered, filteredCount, origin, dir, tMin, tMax, cull)) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+bool anyHit(const LinearBVH& bvh, const TriangleLeaves& triangles, const vectorThree& origin, const vectorThree& dir,
+  float tMin, float tMax, int cull) {
+
+  Mailbox mailbox;
+  return traverseAnyHit(bvh, origin, dir, tMax, [&](int leaf) {
+    return occludedLeaf(bvh, triangles, leaf, origin, dir, tMin, tMax, mailbox, cull);
+  });
+}
+
+face sidedFace(const face& currentFace, bool front) {
+
+  face result = currentFace;
+  if (!front) {
+    std::swap(result.vertex2, result.vertex3);
+  }
+  return result;
+}
+
+bool rayFaceIntersection(vectorThree& origin, vectorThree& dest, const face& currentFace, vectorThree& point, face& hitFace) {
+
+  vectorThree dir = dest - origin;
+  RayHit hit;
+  if (!rayTriangleWatertight(ShearedRay(origin, dir), currentFace.vertex1, currentFace.vertex2, currentFace.vertex3, CULL_NONE, hit)) {
+    return false;
+  }
+
+  point = origin + dir * hit.t;
+  hitFace = sidedFace(currentFace, hit.front);
+  return true;
+}
@@ -0,0 +1,264 @@
+#ifndef __TRIANGLES__
+#define __TRIANGLES__
+
+#include "bvh.hpp"
+
+// Triangles per block, one SSE register per coordinate
+static const int TRIANGLE_BLOCK_SIZE = 4;
+
+// Sides of a face a ray ignores, the front side winds counter clockwise
+// around the direction the ray approaches from
+enum CullMode {
+	CULL_NONE,
+	CULL_BACK,
+	CULL_FRONT
+};
+
+// Cull mode of materials without one of their own, the scenes rely on
+// double sided faces
+static const CullMode DEFAULT_CULL_MODE = CULL_NONE;
+
+// Cull override of a ray that keeps the cull mode of every lane
+static const int CULL_BY_LANE = -1;
+
+// Triangles of a leaf stored as structure of arrays. The vertices are kept
+// as they are instead of as edges, so faces sharing an edge compute it from
+// the same two vertices and the test stays watertight.
+struct alignas(16) TriangleBlock {
+	float v0x[TRIANGLE_BLOCK_SIZE];
+	float v0y[TRIANGLE_BLOCK_SIZE];
+	float v0z[TRIANGLE_BLOCK_SIZE];
+	float v1x[TRIANGLE_BLOCK_SIZE];
+	float v1y[TRIANGLE_BLOCK_SIZE];
+	float v1z[TRIANGLE_BLOCK_SIZE];
+	float v2x[TRIANGLE_BLOCK_SIZE];
+	float v2y[TRIANGLE_BLOCK_SIZE];
+	float v2z[TRIANGLE_BLOCK_SIZE];
+	// index into LinearBVH::faces for shading, -1 for unused lanes
+	int face[TRIANGLE_BLOCK_SIZE];
+	// CullMode of every lane, from the material of its face
+	int cull[TRIANGLE_BLOCK_SIZE];
+};
+
+static_assert(sizeof(TriangleBlock) % 16 == 0, "TriangleBlock must keep every lane array 16 byte aligned");
+
+typedef std::vector<TriangleBlock, AlignedAllocator<TriangleBlock, 16>> TriangleBlockArray;
+
+struct TriangleLeaves {
+	TriangleBlockArray blocks;
+	// first block of every leaf, indexed like LinearBVH::nodes. A leaf with
+	// count faces has (count + TRIANGLE_BLOCK_SIZE - 1) / TRIANGLE_BLOCK_SIZE
+	// blocks.
+	std::vector<int> firstBlock;
+};
+
+// Kernels for the closest hit among the triangles of a leaf. All of them
+// return the same hits, down to the last bit of t.
+enum TriangleKernel {
+	// one lane after another with rayTriangleWatertight
+	TRIANGLE_KERNEL_SCALAR,
+	// the four lanes of a block at once
+	TRIANGLE_KERNEL_SSE,
+	// the eight lanes of two blocks at once, needs a CPU with AVX
+	TRIANGLE_KERNEL_AVX
+};
+
+// Closest hit of a segment found so far, t is relative to the segment
+struct RayHit {
+	// hits beyond t are ignored, starts at the end of the segment
+	float t = 1.0f;
+	// index into LinearBVH::faces, -1 while nothing was hit
+	int face = -1;
+	bool front = true;
+	// barycentrics of the hit, the point is (1 - u - v) * vertex1 + u *
+	// vertex2 + v * vertex3
+	float u = 0.0f;
+	float v = 0.0f;
+};
+
+// A segment sheared and scaled so it runs from the origin along +z over unit
+// length, set up once per query. Triangles translated to the origin then
+// only need their 2D edge functions for the watertight test.
+struct ShearedRay {
+	vectorThree origin;
+	// the axis the segment is longest along becomes z, x and y are swapped
+	// when it points down z so the winding of the faces is kept
+	int kx, ky, kz;
+	float sx, sy, sz;
+	// CullMode every lane is tested with instead of its own, so instances
+	// with a material override share the triangle blocks of their mesh
+	int cull = CULL_BY_LANE;
+
+	ShearedRay() = default;
+	ShearedRay(const vectorThree& origin, const vectorThree& dir, int cull = CULL_BY_LANE);
+};
+
+// Segments aimed at faces of a hierarchy for comparing the triangle kernels,
+// each one is tested against the triangle blocks of the leaf of its face
+struct LeafSegments {
+	std::vector<int> leaves;
+	std::vector<vectorThree> origins;
+	std::vector<vectorThree> dirs;
+};
+
+/**
+ * @brief Packs the faces at the given indices into blocks of
+ * TRIANGLE_BLOCK_SIZE triangles, the last one padded with unused lanes
+ */
+void appendTriangleBlocks(const face* faces, const int* indices, int count, TriangleBlockArray& blocks);
+
+/**
+ * @brief Packs the faces of every leaf into triangle blocks, sorted along the
+ * longest axis of the leaf so neighbouring triangles share a block
+ */
+TriangleLeaves buildTriangleLeaves(const LinearBVH& bvh);
+
+/**
+ * @brief Copies the vertices of the faces the lanes index into back into the
+ * blocks after the faces moved. Lanes keep their face and cull mode, so
+ * refitted meshes need no repacking.
+ */
+void refitTriangleBlocks(TriangleBlockArray& blocks, const face* faces);
+
+/**
+ * @brief Sets the cull mode of every lane from the material of its face,
+ * faces is the array the lanes index into. Materials beyond the end of modes
+ * get DEFAULT_CULL_MODE.
+ */
+void applyCullModes(TriangleBlockArray& blocks, const face* faces, const std::vector<CullMode>& modes);
+
+const char* cullModeName(CullMode mode);
+
+/**
+ * @brief Watertight test of the triangle (a, b, c) with both sides in a single
+ * pass: a segment through an edge or vertex shared by several faces hits at
+ * least one of them. Fills t, front and the barycentrics of hit for hits with
+ * t > 0 on a side the cull mode keeps.
+ */
+bool rayTriangleWatertight(const ShearedRay& ray, const vectorThree& a, const vectorThree& b, const vectorThree& c,
+	int cull, RayHit& hit);
+
+/**
+ * @brief Tests the sheared segment against every triangle of the block.
+ * Returns the triangles hit as a bit mask, with t, front, the barycentrics and
+ * the face of each hit in hits.
+ */
+int rayBlockIntersection(const TriangleBlock& block, const ShearedRay& ray, RayHit hits[TRIANGLE_BLOCK_SIZE]);
+
+/**
+ * @brief Same as rayBlockIntersection for a single lane of the block, which
+ * must be in use
+ */
+bool rayLaneIntersection(const TriangleBlock& block, int lane, const ShearedRay& ray, RayHit& hit);
+
+/**
+ * @brief Widest triangle kernel the CPU supports
+ */
+TriangleKernel bestTriangleKernel();
+
+const char* triangleKernelName(TriangleKernel kernel);
+
+/**
+ * @brief Keeps the closest hit of the blocks in (tMin, hit.t) in hit with the
+ * given kernel. The SIMD kernels reduce the lanes they hit to the closest one
+ * without branching and leave lanes a segment passes exactly through an edge
+ * of to the scalar test. Returns true when hit.t shrank.
+ */
+bool closestInBlocks(const TriangleBlock* blocks, int blockCount, const ShearedRay& ray, float tMin, RayHit& hit,
+	TriangleKernel kernel);
+
+/**
+ * @brief Segments from random points of the root bounds through targets faces
+ * spread evenly over the leaves, passing a random point inside every face
+ * halfway. With edges set every face is also aimed at through a point on an
+ * edge and through its first vertex, the lanes the SIMD kernels leave to the
+ * scalar test.
+ */
+LeafSegments leafSegments(const LinearBVH& bvh, int targets, bool edges);
+
+/**
+ * @brief Closest hit of every segment among the triangles of its leaf with the
+ * given kernel
+ */
+std::vector<RayHit> closestInLeaves(const LinearBVH& bvh, const TriangleLeaves& triangles, const LeafSegments& segments,
+	TriangleKernel kernel);
+
+/**
+ * @brief Whether both hits are the same down to the last bit, which all
+ * triangle kernels guarantee
+ */
+bool sameHit(const RayHit& a, const RayHit& b);
+
+// Blocks of a leaf are filtered this many at a time
+static const int MAILBOX_BLOCKS = 8;
+// Most rays whose mailboxes a block is filtered through at once
+static const int MAILBOX_RAYS = 4;
+
+/**
+ * @brief Copies blocks from block first on into filtered with the lanes
+ * cleared whose faces all rays have seen, dropping blocks with no lane left,
+ * until filtered holds MAILBOX_BLOCKS blocks. rays is a bit mask of the
+ * mailboxes in use. Returns the block to continue from.
+ */
+int filterBlocks(const TriangleBlock* blocks, int first, int blockCount, const int* faceIds, Mailbox* mailboxes, int rays,
+	TriangleBlock* filtered, int& filteredCount);
+
+/**
+ * @brief Keeps the closest hit of the blocks in (tMin, hit.t) in hit with the
+ * best kernel. Returns true when hit.t shrank.
+ */
+bool intersectBlocks(const TriangleBlock* blocks, int blockCount, const vectorThree& origin, const vectorThree& dir,
+	float tMin, RayHit& hit, int cull = CULL_BY_LANE);
+
+/**
+ * @brief Whether any triangle of the blocks is hit with t in (tMin, tMax)
+ */
+bool occludedBlocks(const TriangleBlock* blocks, int blockCount, const vectorThree& origin, const vectorThree& dir,
+	float tMin, float tMax, int cull = CULL_BY_LANE);
+
+/**
+ * @brief Intersects the triangles of a leaf and keeps the closest hit in
+ * (tMin, hit.t) in hit. Returns true when hit.t shrank. When the hierarchy
+ * references faces from several leaves, faces the mailbox of the ray has seen
+ * are skipped.
+ */
+bool intersectLeaf(const LinearBVH& bvh, const TriangleLeaves& triangles, int leaf, const vectorThree& origin, const vectorThree& dir,
+	float tMin, RayHit& hit, Mailbox& mailbox, int cull = CULL_BY_LANE);
+
+/**
+ * @brief Closest face hit by origin + t * dir with t in (tMin, hit.t). Leaves
+ * are intersected as soon as they are reached near to far, every hit shortens
+ * the segment so nodes behind it are never opened.
+ * @param cull CullMode overriding the one of every face, CULL_BY_LANE keeps them
+ */
+void closestHit(const LinearBVH& bvh, const TriangleLeaves& triangles, const vectorThree& origin, const vectorThree& dir,
+	float tMin, RayHit& hit, int cull = CULL_BY_LANE);
+
+/**
+ * @brief Whether any triangle of the leaf is hit with t in (tMin, tMax),
+ * stops at the first one. Skips faces the mailbox has seen like intersectLeaf.
+ */
+bool occludedLeaf(const LinearBVH& bvh, const TriangleLeaves& triangles, int leaf, const vectorThree& origin, const vectorThree& dir,
+	float tMin, float tMax, Mailbox& mailbox, int cull = CULL_BY_LANE);
+
+/**
+ * @brief Whether any face is hit by origin + t * dir with t in (tMin, tMax).
+ * Returns on the first hit found, which is all shadow rays need.
+ */
+bool anyHit(const LinearBVH& bvh, const TriangleLeaves& triangles, const vectorThree& origin, const vectorThree& dir,
+	float tMin, float tMax, int cull = CULL_BY_LANE);
+
+/**
+ * @brief The face as rayFaceIntersection reports it, with the second and
+ * third vertex swapped when the back side was hit
+ */
+face sidedFace(const face& currentFace, bool front);
+
+/**
+ * @brief Double sided triangle test of the ray from origin through dest,
+ * hitFace is set to the face or to its flipped copy, depending on the side
+ * that was hit
+ */
+bool rayFaceIntersection(vectorThree& origin, vectorThree& dest, const face& currentFace, vectorThree& point, face& hitFace);
+
+#endif // TRIANGLES
@@ -0,0 +1,849 @@
+#include "widebvh.hpp"
+#include <cmath>
+#include <cstring>
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// The AVX2 kernels are compiled for AVX2 regardless of the global compiler
+// flags and only run after checking the CPU at runtime
+#if defined(__GNUC__)
+#define TARGET_AVX2 __attribute__((target("avx2,fma")))
+#else
+#define TARGET_AVX2
+#endif
+
+
+//===========================================================================
+//============================= Collapsing ==================================
+//===========================================================================
+
+template <int Width>
+static void setEmptySlot(WideNode<Width>& node, int slot) {
+
+  node.minX[slot] = node.minY[slot] = node.minZ[slot] = FLT_MAX;
+  node.maxX[slot] = node.maxY[slot] = node.maxZ[slot] = -FLT_MAX;
+  node.child[slot] = -1;
+  node.count[slot] = 0;
+}
+
+template <int Width>
+static int collapseNode(const LinearBVH& bvh, int index, WideBVH<Width>& wide) {
+
+  int wideIndex = int(wide.nodes.size());
+  wide.nodes.emplace_back();
+
+  int slots[Width];
+  int slotCount = 0;
+  const LinearNode& node = bvh.nodes[index];
+
+  if (node.isLeaf()) {
+    slots[slotCount++] = index;
+  }
+  else {
+
+    slots[slotCount++] = index + 1;
+    slots[slotCount++] = node.offset;
+
+    // keep replacing the largest interior child by its two children
+    while (slotCount < Width) {
+
+      int best = -1;
+      float bestArea = -1.0f;
+      for (int i = 0; i < slotCount; i++) {
+        const LinearNode& candidate = bvh.nodes[slots[i]];
+        float area = candidate.getBounds().surfaceArea();
+        if (!candidate.isLeaf() && area > bestArea) {
+          best = i;
+          bestArea = area;
+        }
+      }
+
+      if (best == -1) {
+        break;
+      }
+
+      const LinearNode& open = bvh.nodes[slots[best]];
+      slots[slotCount++] = open.offset;
+      slots[best] = slots[best] + 1;
+    }
+  }
+
+  WideNode<Width> wideNode;
+  for (int i = 0; i < Width; i++) {
+
+    if (i >= slotCount) {
+      setEmptySlot(wideNode, i);
+      continue;
+    }
+
+    const LinearNode& child = bvh.nodes[slots[i]];
+    wideNode.minX[i] = child.min[0];
+    wideNode.minY[i] = child.min[1];
+    wideNode.minZ[i] = child.min[2];
+    wideNode.maxX[i] = child.max[0];
+    wideNode.maxY[i] = child.max[1];
+    wideNode.maxZ[i] = child.max[2];
+
+    if (child.isLeaf()) {
+      wideNode.child[i] = slots[i];
+      wideNode.count[i] = child.count;
+    }
+    else {
+      wideNode.child[i] = collapseNode(bvh, slots[i], wide);
+      wideNode.count[i] = 0;
+    }
+  }
+
+  // the recursion may have reallocated the array, so write the node last
+  wide.nodes[wideIndex] = wideNode;
+  return wideIndex;
+}
+
+BVH4 collapseBVH4(const LinearBVH& bvh) {
+
+  BVH4 wide;
+
+  if (!bvh.nodes.empty()) {
+    collapseNode(bvh, 0, wide);
+  }
+
+  return wide;
+}
+
+BVH8 collapseBVH8(const LinearBVH& bvh) {
+
+  BVH8 wide;
+
+  if (!bvh.nodes.empty()) {
+    collapseNode(bvh, 0, wide);
+  }
+
+  return wide;
+}
+
+// Wide nodes are stored before their children, so walking backwards copies
+// the refitted leaf bounds up the hierarchy
+template <int Width>
+static void refitWide(WideBVH<Width>& wide, const LinearBVH& bvh) {
+
+  for (int index = int(wide.nodes.size()) - 1; index >= 0; index--) {
+
+    WideNode<Width>& node = wide.nodes[index];
+    for (int i = 0; i < Width; i++) {
+
+      if (node.child[i] == -1) {
+        continue;
+      }
+
+      Bounds bounds;
+      if (node.count[i] > 0) {
+        bounds = bvh.nodes[node.child[i]].getBounds();
+      }
+      else {
+        const WideNode<Width>& child = wide.nodes[node.child[i]];
+        for (int j = 0; j < Width; j++) {
+          if (child.child[j] != -1) {
+            bounds.grow(vectorThree{ child.minX[j], child.minY[j], child.minZ[j] });
+            bounds.grow(vectorThree{ child.maxX[j], child.maxY[j], child.maxZ[j] });
+          }
+        }
+      }
+
+      node.minX[i] = bounds.min.x;
+      node.minY[i] = bounds.min.y;
+      node.minZ[i] = bounds.min.z;
+      node.maxX[i] = bounds.max.x;
+      node.maxY[i] = bounds.max.y;
+      node.maxZ[i] = bounds.max.z;
+    }
+  }
+}
+
+void refitBVH4(BVH4& wide, const LinearBVH& bvh) {
+  refitWide(wide, bvh);
+}
+
+void refitBVH8(BVH8& wide, const LinearBVH& bvh) {
+  refitWide(wide, bvh);
+}
+
+//===========================================================================
+//================================ BVH4 =====================================
+//===========================================================================
+
+// The segment of a BVH4 traversal, both as scalars and broadcast to all four
+// lanes
+struct Segment4 {
+  float origin[3];
+  float inverse[3];
+  __m128 originLanes[3];
+  __m128 inverseLanes[3];
+
+  Segment4(const vectorThree& from, const vectorThree& dir)
+    : origin{ from.x, from.y, from.z }, inverse{ safeInverse(dir.x), safeInverse(dir.y), safeInverse(dir.z) } {
+    for (int axis = 0; axis < 3; axis++) {
+      originLanes[axis] = _mm_set1_ps(origin[axis]);
+      inverseLanes[axis] = _mm_set1_ps(inverse[axis]);
+    }
+  }
+};
+
+// Slab test of the segment origin + t * dir, t in [0, tLimit], against four
+// boxes at once, given as minX, minY, minZ, maxX, maxY, maxZ. Returns a bit
+// mask of the boxes that are hit, with where the segment enters and leaves
+// them in tNear and tFar.
+static int slabTest4(const __m128 bounds[6], const Segment4& segment, float tLimit, __m128& tNear, __m128& tFar) {
+
+  const __m128* origin = segment.originLanes;
+  const __m128* inverse = segment.inverseLanes;
+
+  __m128 t0 = _mm_mul_ps(_mm_sub_ps(bounds[0], origin[0]), inverse[0]);
+  __m128 t1 = _mm_mul_ps(_mm_sub_ps(bounds[3], origin[0]), inverse[0]);
+  __m128 tMin = _mm_min_ps(t0, t1);
+  __m128 tMax = _mm_max_ps(t0, t1);
+
+  t0 = _mm_mul_ps(_mm_sub_ps(bounds[1], origin[1]), inverse[1]);
+  t1 = _mm_mul_ps(_mm_sub_ps(bounds[4], origin[1]), inverse[1]);
+  tMin = _mm_max_ps(tMin, _mm_min_ps(t0, t1));
+  tMax = _mm_min_ps(tMax, _mm_max_ps(t0, t1));
+
+  t0 = _mm_mul_ps(_mm_sub_ps(bounds[2], origin[2]), inverse[2]);
+  t1 = _mm_mul_ps(_mm_sub_ps(bounds[5], origin[2]), inverse[2]);
+  tMin = _mm_max_ps(tMin, _mm_min_ps(t0, t1));
+  tMax = _mm_min_ps(tMax, _mm_max_ps(t0, t1));
+
+  tMin = _mm_max_ps(tMin, _mm_setzero_ps());
+  tMax = _mm_min_ps(tMax, _mm_set1_ps(tLimit));
+
+  tNear = tMin;
+  tFar = tMax;
+  return _mm_movemask_ps(_mm_cmple_ps(tMin, tMax));
+}
+
+static int intersectNode4(const BVH4Node& node, const Segment4& segment, float tLimit, __m128& tNear, __m128& tFar) {
+
+  __m128 bounds[6] = {
+    _mm_load_ps(node.minX), _mm_load_ps(node.minY), _mm_load_ps(node.minZ),
+    _mm_load_ps(node.maxX), _mm_load_ps(node.maxY), _mm_load_ps(node.maxZ) };
+
+  return slabTest4(bounds, segment, tLimit, tNear, tFar);
+}
+
+static bool isLeafSlot(const BVH4Node& node, int slot) {
+  return node.count[slot] > 0;
+}
+
+// Widens four 8-bit offsets to floats
+static __m128 widenOffsets4(const std::uint8_t* offsets) {
+
+  int packed;
+  std::memcpy(&packed, offsets, 4);
+
+  __m128i zero = _mm_setzero_si128();
+  return _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(packed), zero), zero));
+}
+
+// 2^exponent, built from the bits so it is exact for every stored exponent
+static float exponentScale(int exponent) {
+
+  std::uint32_t bits = std::uint32_t(exponent + 127) << 23;
+  float scale;
+  std::memcpy(&scale, &bits, 4);
+  return scale;
+}
+
+// Same slab test as for BVH4Node, with the decode folded into it: the plane
+// origin + q * scale is hit at (origin - o) * inverse + q * (scale * inverse),
+// so every plane costs a single multiply add on the raw offsets
+static int intersectNode4(const QuantizedNode4& node, const Segment4& segment, float tLimit, __m128& tNear, __m128& tFar) {
+
+  const std::uint8_t* mins[3] = { node.minX, node.minY, node.minZ };
+  const std::uint8_t* maxs[3] = { node.maxX, node.maxY, node.maxZ };
+
+  __m128 tMin = _mm_setzero_ps();
+  __m128 tMax = _mm_set1_ps(tLimit);
+
+  for (int axis = 0; axis < 3; axis++) {
+
+    __m128 base = _mm_set1_ps((node.origin[axis] - segment.origin[axis]) * segment.inverse[axis]);
+    __m128 step = _mm_set1_ps(exponentScale(node.exponent[axis]) * segment.inverse[axis]);
+
+    __m128 t0 = _mm_add_ps(base, _mm_mul_ps(widenOffsets4(mins[axis]), step));
+    __m128 t1 = _mm_add_ps(base, _mm_mul_ps(widenOffsets4(maxs[axis]), step));
+    tMin = _mm_max_ps(tMin, _mm_min_ps(t0, t1));
+    tMax = _mm_min_ps(tMax, _mm_max_ps(t0, t1));
+  }
+
+  tNear = tMin;
+  tFar = tMax;
+  return _mm_movemask_ps(_mm_cmple_ps(tMin, tMax));
+}
+
+static bool isLeafSlot(const QuantizedNode4& node, int slot) {
+  return (node.leafMask & (1 << slot)) != 0;
+}
+
+// Shared by the plain and the quantized BVH4, which only differ in how the
+// node bounds are loaded. Leaves are handed to intersectLeaf near to far and
+// it may lower tMax, nodes entered beyond it are skipped.
+template <typename Node, typename LeafFunction>
+static void traverse4(const Node* nodes, std::size_t nodeCount, const vectorThree& origin, const vectorThree& dir,
+  const float& tMax, LeafFunction intersectLeaf) {
+
+  if (nodeCount == 0) {
+    return;
+  }
+
+  Segment4 segment(origin, dir);
+
+  struct Entry {
+    int node;
+    float tNear;
+  };
+  Entry stack[3 * BVH_MAX_DEPTH + 1];
+  int stackSize = 0;
+  stack[stackSize++] = { 0, 0.0f };
+
+  while (stackSize > 0) {
+
+    Entry entry = stack[--stackSize];
+    if (entry.tNear > tMax) {
+      continue;
+    }
+    const Node& node = nodes[entry.node];
+
+    __m128 tNear, tFar;
+    int mask = intersectNode4(node, segment, tMax, tNear, tFar);
+
+    alignas(16) float distances[4];
+    _mm_store_ps(distances, tNear);
+
+    // sort the hit children near to far
+    int order[4];
+    int hits = 0;
+    for (int i = 0; i < 4; i++) {
+
+      if (node.child[i] < 0) {
+        continue;
+      }
+      rayBoxChecks++;
+
+      if (!(mask & (1 << i))) {
+        continue;
+      }
+      rayBoxIntersections++;
+
+      int j = hits++;
+      while (j > 0 && distances[order[j - 1]] > distances[i]) {
+        order[j] = order[j - 1];
+        j--;
+      }
+      order[j] = i;
+    }
+
+    // leaves are intersected right away, interior nodes are pushed far to
+    // near
+    for (int i = 0; i < hits; i++) {
+      if (isLeafSlot(node, order[i]) && distances[order[i]] <= tMax) {
+        intersectLeaf(node.child[order[i]]);
+      }
+    }
+    for (int i = hits - 1; i >= 0; i--) {
+      if (!isLeafSlot(node, order[i]) && distances[order[i]] <= tMax) {
+        stack[stackSize++] = { node.child[order[i]], distances[order[i]] };
+      }
+    }
+  }
+}
+
+void intersectingChildren4(const BVH4& wide, vectorThree& origin, vectorThree& dest, std::vector<int>& leaves) {
+
+  float tMax = 1.0f;
+  traverse4(wide.nodes.data(), wide.nodes.size(), origin, dest - origin, tMax, [&leaves](int leaf) { leaves.push_back(leaf); });
+}
+
+void intersectingChildrenQ4(const QBVH4& quantized, vectorThree& origin, vectorThree& dest, std::vector<int>& leaves) {
+
+  float tMax = 1.0f;
+  traverse4(quantized.nodes.data(), quantized.nodes.size(), origin, dest - origin, tMax, [&leaves](int leaf) { leaves.push_back(leaf); });
+}
+
+void closestHit4(const BVH4& wide, const LinearBVH& bvh, const TriangleLeaves& triangles, const vectorThree& origin, const vectorThree& dir,
+  float tMin, RayHit& hit, int cull) {
+
+  Mailbox mailbox;
+  traverse4(wide.nodes.data(), wide.nodes.size(), origin, dir, hit.t, [&](int leaf) {
+    intersectLeaf(bvh, triangles, leaf, origin, dir, tMin, hit, mailbox, cull);
+  });
+}
+
+void closestHitQ4(const QBVH4& quantized, const LinearBVH& bvh, const TriangleLeaves& triangles, const vectorThree& origin, const vectorThree& dir,
+  float tMin, RayHit& hit, int cull) {
+
+  Mailbox mailbox;
+  traverse4(quantized.nodes.data(), quantized.nodes.size(), origin, dir, hit.t, [&](int leaf) {
+    intersectLeaf(bvh, triangles, leaf, origin, dir, tMin, hit, mailbox, cull);
+  });
+}
+
+// Any hit traversal of the plain and the quantized BVH4. Children are opened
+// in order of the length of the segment inside them, longest first, and the
+// traversal stops as soon as intersectLeaf returns true.
+template <typename Node, typename LeafFunction>
+static bool traverseAnyHit4(const Node* nodes, std::size_t nodeCount, const vectorThree& origin, const vectorThree& dir,
+  float tMax, LeafFunction intersectLeaf) {
+
+  if (nodeCount == 0) {
+    return false;
+  }
+
+  Segment4 segment(origin, dir);
+
+  int stack[3 * BVH_MAX_DEPTH + 1];
+  int stackSize = 0;
+  stack[stackSize++] = 0;
+
+  while (stackSize > 0) {
+
+    const Node& node = nodes[stack[--stackSize]];
+
+    __m128 tNear, tFar;
+    int mask = intersectNode4(node, segment, tMax, tNear, tFar);
+
+    alignas(16) float lengths[4];
+    _mm_store_ps(lengths, _mm_sub_ps(tFar, tNear));
+
+    int order[4];
+    int hits = 0;
+    for (int i = 0; i < 4; i++) {
+
+      if (node.child[i] < 0) {
+        continue;
+      }
+      rayBoxChecks++;
+
+      if (!(mask & (1 << i))) {
+        continue;
+      }
+      rayBoxIntersections++;
+
+      int j = hits++;
+      while (j > 0 && lengths[order[j - 1]] < lengths[i]) {
+        order[j] = order[j - 1];
+        j--;
+      }
+      order[j] = i;
+    }
+
+    for (int i = 0; i < hits; i++) {
+      if (isLeafSlot(node, order[i]) && intersectLeaf(node.child[order[i]])) {
+        return true;
+      }
+    }
+    for (int i = hits - 1; i >= 0; i--) {
+      if (!isLeafSlot(node, order[i])) {
+        stack[stackSize++] = node.child[order[i]];
+      }
+    }
+  }
+
+  return false;
+}
+
+bool anyHit4(const BVH4& wide, const LinearBVH& bvh, const TriangleLeaves& triangles, const vectorThree& origin, const vectorThree& dir,
+  float tMin, float tMax, int cull) {
+
+  Mailbox mailbox;
+  return traverseAnyHit4(wide.nodes.data(), wide.nodes.size(), origin, dir, tMax, [&](int leaf) {
+    return occludedLeaf(bvh, triangles, leaf, origin, dir, tMin, tMax, mailbox, cull);
+  });
+}
+
+bool anyHitQ4(const QBVH4& quantized, const LinearBVH& bvh, const TriangleLeaves& triangles, const vectorThree& origin, const vectorThree& dir,
+  float tMin, float tMax, int cull) {
+
+  Mailbox mailbox;
+  return traverseAnyHit4(quantized.nodes.data(), quantized.nodes.size(), origin, dir, tMax, [&](int leaf) {
+    return occludedLeaf(bvh, triangles, leaf, origin, dir, tMin, tMax, mailbox, cull);
+  });
+}
+
+//===========================================================================
+//=========================== Quantized BVH4 ================================
+//===========================================================================
+
+// Smallest exponent whose 255 steps span the extent
+static int frameExponent(float extent) {
+
+  if (!(extent > 0.0f)) {
+    return -126;
+  }
+
+  int exponent;
+  std::frexp(extent / 255.0f, &exponent);
+  return std::min(std::max(exponent, -126), 127);
+}
+
+// Offsets of the child interval [low, high] in the frame, rounded outwards and
+// checked against the exact decode. Returns false when the float addition
+// rounds past the last step, then the caller retries with a coarser exponent.
+static bool quantizeInterval(float low, float high, float origin, int exponent, std::uint8_t& qLow, std::uint8_t& qHigh) {
+
+  float scale = exponentScale(exponent);
+
+  int lower = std::min(std::max(int(std::floor((low - origin) / scale)), 0), 255);
+  while (lower > 0 && origin + float(lower) * scale > low) {
+    lower--;
+  }
+
+  int upper = std::min(std::max(int(std::ceil((high - origin) / scale)), 0), 255);
+  while (upper < 255 && origin + float(upper) * scale < high) {
+    upper++;
+  }
+
+  if (origin + float(lower) * scale > low || origin + float(upper) * scale < high) {
+    return false;
+  }
+
+  qLow = std::uint8_t(lower);
+  qHigh = std::uint8_t(upper);
+  return true;
+}
+
+static QuantizedNode4 quantizeNode(const BVH4Node& node) {
+
+  const float* mins[3] = { node.minX, node.minY, node.minZ };
+  const float* maxs[3] = { node.maxX, node.maxY, node.maxZ };
+
+  QuantizedNode4 quantized;
+  std::uint8_t* qMins[3] = { quantized.minX, quantized.minY, quantized.minZ };
+  std::uint8_t* qMaxs[3] = { quantized.maxX, quantized.maxY, quantized.maxZ };
+
+  quantized.leafMask = 0;
+  for (int i = 0; i < 4; i++) {
+    quantized.child[i] = node.child[i];
+    if (node.child[i] >= 0 && node.count[i] > 0) {
+      quantized.leafMask |= std::uint8_t(1 << i);
+    }
+  }
+
+  for (int axis = 0; axis < 3; axis++) {
+
+    float low = FLT_MAX;
+    float high = -FLT_MAX;
+    for (int i = 0; i < 4; i++) {
+      if (node.child[i] >= 0) {
+        low = std::min(low, mins[axis][i]);
+        high = std::max(high, maxs[axis][i]);
+      }
+    }
+    if (low > high) {
+      low = high = 0.0f;
+    }
+
+    int exponent = frameExponent(high - low);
+    bool fits = false;
+    while (!fits) {
+
+      fits = true;
+      for (int i = 0; i < 4 && fits; i++) {
+        if (node.child[i] < 0) {
+          // unused slots are skipped by the child index, any box will do
+          qMins[axis][i] = 0;
+          qMaxs[axis][i] = 0;
+        }
+        else {
+          fits = quantizeInterval(mins[axis][i], maxs[axis][i], low, exponent, qMins[axis][i], qMaxs[axis][i]);
+        }
+      }
+      if (!fits) {
+        exponent++;
+      }
+    }
+
+    quantized.origin[axis] = low;
+    quantized.exponent[axis] = std::int8_t(exponent);
+  }
+
+  return quantized;
+}
+
+QBVH4 quantizeBVH4(const BVH4& wide) {
+
+  QBVH4 quantized;
+  quantized.nodes.resize(wide.nodes.size());
+
+  for (int i = 0; i < wide.nodes.size(); i++) {
+    quantized.nodes[i] = quantizeNode(wide.nodes[i]);
+  }
+
+  return quantized;
+}
+
+void requantizeBVH4(QBVH4& quantized, const BVH4& wide) {
+
+  for (int i = 0; i < wide.nodes.size(); i++) {
+    quantized.nodes[i] = quantizeNode(wide.nodes[i]);
+  }
+}
+
+//===========================================================================
+//================================ BVH8 =====================================
+//===========================================================================
+
+// Distance of a child sort key, rounded down by the slot bits
+static float keyDistance(int key) {
+
+  float distance;
+  key &= ~7;
+  std::memcpy(&distance, &key, 4);
+  return distance;
+}
+
+// Slab test against all eight children, origin * inverse is precomputed so
+// every slab is a single fused multiply subtract
+TARGET_AVX2 static int intersectNode8(const BVH8Node& node, const __m256 inverse[3], const __m256 scaledOrigin[3], float tLimit,
+  __m256& tNear, __m256& tFar) {
+
+  __m256 t0 = _mm256_fmsub_ps(_mm256_load_ps(node.minX), inverse[0], scaledOrigin[0]);
+  __m256 t1 = _mm256_fmsub_ps(_mm256_load_ps(node.maxX), inverse[0], scaledOrigin[0]);
+  __m256 tMin = _mm256_min_ps(t0, t1);
+  __m256 tMax = _mm256_max_ps(t0, t1);
+
+  t0 = _mm256_fmsub_ps(_mm256_load_ps(node.minY), inverse[1], scaledOrigin[1]);
+  t1 = _mm256_fmsub_ps(_mm256_load_ps(node.maxY), inverse[1], scaledOrigin[1]);
+  tMin = _mm256_max_ps(tMin, _mm256_min_ps(t0, t1));
+  tMax = _mm256_min_ps(tMax, _mm256_max_ps(t0, t1));
+
+  t0 = _mm256_fmsub_ps(_mm256_load_ps(node.minZ), inverse[2], scaledOrigin[2]);
+  t1 = _mm256_fmsub_ps(_mm256_load_ps(node.maxZ), inverse[2], scaledOrigin[2]);
+  tMin = _mm256_max_ps(tMin, _mm256_min_ps(t0, t1));
+  tMax = _mm256_min_ps(tMax, _mm256_max_ps(t0, t1));
+
+  tMin = _mm256_max_ps(tMin, _mm256_setzero_ps());
+  tMax = _mm256_min_ps(tMax, _mm256_set1_ps(tLimit));
+
+  tNear = tMin;
+  tFar = tMax;
+  return _mm256_movemask_ps(_mm256_cmp_ps(tMin, tMax, _CMP_LE_OQ));
+}
+
+// Same as traverse4 with eight children per node
+template <typename LeafFunction>
+TARGET_AVX2 static void traverse8(const BVH8& wide, const vectorThree& origin, const vectorThree& dir, const float& tMax, LeafFunction intersectLeaf) {
+
+  if (wide.nodes.empty()) {
+    return;
+  }
+
+  float inverseX = safeInverse(dir.x);
+  float inverseY = safeInverse(dir.y);
+  float inverseZ = safeInverse(dir.z);
+  __m256 rayInverse[3] = { _mm256_set1_ps(inverseX), _mm256_set1_ps(inverseY), _mm256_set1_ps(inverseZ) };
+  __m256 rayScaledOrigin[3] = { _mm256_set1_ps(origin.x * inverseX), _mm256_set1_ps(origin.y * inverseY), _mm256_set1_ps(origin.z * inverseZ) };
+
+  // Hit children are ordered by a single integer key: tNear is clamped to be
+  // non negative, so its bits sort like the float, and the lowest three
+  // mantissa bits are replaced by the child slot
+  const __m256i slotBits = _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0);
+  const __m256i distanceBits = _mm256_set1_epi32(~7);
+
+  // the key without its slot bits is a distance at most tNear, so pruning
+  // with it never drops a node that is still needed
+  struct Entry {
+    int node;
+    float tNear;
+  };
+  Entry stack[7 * BVH_MAX_DEPTH + 1];
+  int stackSize = 0;
+  stack[stackSize++] = { 0, 0.0f };
+
+  while (stackSize > 0) {
+
+    Entry entry = stack[--stackSize];
+    if (entry.tNear > tMax) {
+      continue;
+    }
+    const BVH8Node& node = wide.nodes[entry.node];
+
+    __m256 tNear, tFar;
+    int mask = intersectNode8(node, rayInverse, rayScaledOrigin, tMax, tNear, tFar);
+
+    __m256i keys = _mm256_or_si256(_mm256_and_si256(_mm256_castps_si256(tNear), distanceBits), slotBits);
+    alignas(32) int packed[8];
+    _mm256_store_si256((__m256i*)packed, keys);
+
+    // sort the keys of the hit children near to far
+    int order[8];
+    int hits = 0;
+    for (int i = 0; i < 8; i++) {
+
+      if (node.child[i] < 0) {
+        continue;
+      }
+      rayBoxChecks++;
+
+      if (!(mask & (1 << i))) {
+        continue;
+      }
+      rayBoxIntersections++;
+
+      int key = packed[i];
+      int j = hits++;
+      while (j > 0 && order[j - 1] > key) {
+        order[j] = order[j - 1];
+        j--;
+      }
+      order[j] = key;
+    }
+
+    // leaves are intersected right away, interior nodes are pushed far to
+    // near
+    for (int i = 0; i < hits; i++) {
+      int slot = order[i] & 7;
+      if (node.count[slot] > 0 && keyDistance(order[i]) <= tMax) {
+        intersectLeaf(node.child[slot]);
+      }
+    }
+    for (int i = hits - 1; i >= 0; i--) {
+      int slot = order[i] & 7;
+      float distance = keyDistance(order[i]);
+      if (node.count[slot] == 0 && distance <= tMax) {
+        stack[stackSize++] = { node.child[slot], distance };
+      }
+    }
+  }
+}
+
+TARGET_AVX2 void intersectingChildren8(const BVH8& wide, vectorThree& origin, vectorThree& dest, std::vector<int>& leaves) {
+
+  float tMax = 1.0f;
+  traverse8(wide, origin, dest - origin, tMax, [&leaves](int leaf) { leaves.push_back(leaf); });
+}
+
+TARGET_AVX2 void closestHit8(const BVH8& wide, const LinearBVH& bvh, const TriangleLeaves& triangles, const vectorThree& origin, const vectorThree& dir,
+  float tMin, RayHit& hit, int cull) {
+
+  Mailbox mailbox;
+  traverse8(wide, origin, dir, hit.t, [&](int leaf) {
+    intersectLeaf(bvh, triangles, leaf, origin, dir, tMin, hit, mailbox, cull);
+  });
+}
+
+// Same as traverseAnyHit4 with eight children per node
+TARGET_AVX2 bool anyHit8(const BVH8& wide, const LinearBVH& bvh, const TriangleLeaves& triangles, const vectorThree& origin, const vectorThree& dir,
+  float tMin, float tMax, int cull) {
+
+  if (wide.nodes.empty()) {
+    return false;
+  }
+
+  float inverseX = safeInverse(dir.x);
+  float inverseY = safeInverse(dir.y);
+  float inverseZ = safeInverse(dir.z);
+  __m256 rayInverse[3] = { _mm256_set1_ps(inverseX), _mm256_set1_ps(inverseY), _mm256_set1_ps(inverseZ) };
+  __m256 rayScaledOrigin[3] = { _mm256_set1_ps(origin.x * inverseX), _mm256_set1_ps(origin.y * inverseY), _mm256_set1_ps(origin.z * inverseZ) };
+
+  Mailbox mailbox;
+  int stack[7 * BVH_MAX_DEPTH + 1];
+  int stackSize = 0;
+  stack[stackSize++] = 0;
+
+  while (stackSize > 0) {
+
+    const BVH8Node& node = wide.nodes[stack[--stackSize]];
+
+    __m256 tNear, tFar;
+    int mask = intersectNode8(node, rayInverse, rayScaledOrigin, tMax, tNear, tFar);
+
+    alignas(32) float lengths[8];
+    _mm256_store_ps(lengths, _mm256_sub_ps(tFar, tNear));
+
+    int order[8];
+    int hits = 0;
+    for (int i = 0; i < 8; i++) {
+
+      if (node.child[i] < 0) {
+        continue;
+      }
+      rayBoxChecks++;
+
+      if (!(mask & (1 << i))) {
+        continue;
+      }
+      rayBoxIntersections++;
+
+      int j = hits++;
+      while (j > 0 && lengths[order[j - 1]] < lengths[i]) {
+        order[j] = order[j - 1];
+        j--;
+      }
+      order[j] = i;
+    }
+
+    for (int i = 0; i < hits; i++) {
+      int slot = order[i];
+      if (node.count[slot] > 0 && occludedLeaf(bvh, triangles, node.child[slot], origin, dir, tMin, tMax, mailbox, cull)) {
+        return true;
+      }
+    }
+    for (int i = hits - 1; i >= 0; i--) {
+      int slot = order[i];
+      if (node.count[slot] == 0) {
+        stack[stackSize++] = node.child[slot];
+      }
+    }
+  }
+
+  return false;
+}
+
+//===========================================================================
+
+bool cpuSupportsAVX2() {
+
+#if defined(_MSC_VER)
+  int info[4];
+  __cpuid(info, 0);
+  if (info[0] < 7) {
+    return false;
+  }
+
+  // FMA and OS support for saving the YMM registers
+  __cpuid(info, 1);
+  bool fma = (info[2] & (1 << 12)) != 0;
+  bool osxsave = (info[2] & (1 << 27)) != 0;
+  if (!fma || !osxsave || (_xgetbv(0) & 6) != 6) {
+    return false;
+  }
+
+  __cpuidex(info, 7, 0);
+  return (info[1] & (1 << 5)) != 0;
+#else
+  return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#endif
+}
+
+TraversalMode bestTraversalMode() {
+
+  if (cpuSupportsAVX2()) {
+    return TRAVERSAL_BVH8;
+  }
+  return TRAVERSAL_BVH4;
+}
+
+const char* traversalModeName(TraversalMode mode) {
+
+  switch (mode) {
+  case TRAVERSAL_BINARY: return "binary";
+  case TRAVERSAL_BVH4: return "BVH4 (SSE)";
+  case TRAVERSAL_BVH8: return "BVH8 (AVX2)";
+  case TRAVERSAL_QBVH4: return "quantized BVH4 (SSE)";
+  case TRAVERSAL_STACKLESS: return "binary (stackless)";
+  case TRAVERSAL_KDTREE: return "kd-tree";
+  case TRAVERSAL_GRID: return "hierarchical grid";
+  }
+  return "unknown";
+}
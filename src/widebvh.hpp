@@ -0,0 +1,161 @@
+#ifndef __WIDEBVH__
+#define __WIDEBVH__
+
+#include "triangles.hpp"
+#include <cstdint>
+
+enum TraversalMode {
+	TRAVERSAL_BINARY,
+	TRAVERSAL_BVH4,
+	TRAVERSAL_BVH8,
+	TRAVERSAL_QBVH4,
+	TRAVERSAL_STACKLESS,
+	TRAVERSAL_KDTREE,
+	TRAVERSAL_GRID
+};
+
+// Also build the quantized BVH4
+static const bool BUILD_QUANTIZED = true;
+// Time the traversal kernels against each other on random segments right
+// after building, which costs several passes over TRAVERSAL_COMPARE_RAYS rays
+static const bool TRAVERSAL_COMPARE = false;
+static const int TRAVERSAL_COMPARE_RAYS = 100000;
+
+// A node of a wide hierarchy with the bounds of its children stored as
+// structure of arrays, so one SIMD register holds one coordinate of all of them
+template <int Width>
+struct alignas(Width * 4) WideNode {
+	float minX[Width];
+	float minY[Width];
+	float minZ[Width];
+	float maxX[Width];
+	float maxY[Width];
+	float maxZ[Width];
+	// wide node for interior children, leaf node of the binary hierarchy for
+	// leaves and -1 for unused slots
+	int child[Width];
+	// number of faces for leaves, zero otherwise
+	int count[Width];
+};
+
+typedef WideNode<4> BVH4Node;
+typedef WideNode<8> BVH8Node;
+
+static_assert(sizeof(BVH4Node) == 128, "BVH4Node must fill exactly two cache lines");
+static_assert(sizeof(BVH8Node) == 256, "BVH8Node must fill exactly four cache lines");
+
+template <int Width>
+struct WideBVH {
+	std::vector<WideNode<Width>, AlignedAllocator<WideNode<Width>, Width * 4>> nodes;
+};
+
+typedef WideBVH<4> BVH4;
+typedef WideBVH<8> BVH8;
+
+// A BVH4 node with the bounds of its children stored as 8-bit offsets from
+// origin, the minimum of the node bounds, in steps of 2^exponent per axis.
+// Power of two steps decode exactly, and the offsets are rounded outwards, so
+// the decoded boxes always contain the children.
+struct alignas(64) QuantizedNode4 {
+	float origin[3];
+	std::int8_t exponent[3];
+	// bit i is set when child i is a leaf of the binary hierarchy
+	std::uint8_t leafMask;
+	std::uint8_t minX[4];
+	std::uint8_t minY[4];
+	std::uint8_t minZ[4];
+	std::uint8_t maxX[4];
+	std::uint8_t maxY[4];
+	std::uint8_t maxZ[4];
+	// same as WideNode::child
+	int child[4];
+};
+
+static_assert(sizeof(QuantizedNode4) == 64, "QuantizedNode4 must fill exactly one cache line");
+
+struct QBVH4 {
+	std::vector<QuantizedNode4, AlignedAllocator<QuantizedNode4, 64>> nodes;
+};
+
+/**
+ * @brief Collapses the binary hierarchy into a 4-ary one by repeatedly opening
+ * the child with the largest surface area. Leaves keep referencing the leaves
+ * and faces of the binary hierarchy.
+ */
+BVH4 collapseBVH4(const LinearBVH& bvh);
+
+/**
+ * @brief Collects the leaves of the binary hierarchy overlapped by the segment
+ * from origin to dest, testing four children at a time in near to far order
+ */
+void intersectingChildren4(const BVH4& wide, vectorThree& origin, vectorThree& dest, std::vector<int>& leaves);
+
+/**
+ * @brief Closest face hit by origin + t * dir with t in (tMin, hit.t), see
+ * closestHit. Children are visited near to far and the leaves reference the
+ * binary hierarchy and its triangle blocks.
+ */
+void closestHit4(const BVH4& wide, const LinearBVH& bvh, const TriangleLeaves& triangles, const vectorThree& origin, const vectorThree& dir,
+	float tMin, RayHit& hit, int cull = CULL_BY_LANE);
+
+/**
+ * @brief Whether any face is hit by origin + t * dir with t in (tMin, tMax),
+ * see anyHit
+ */
+bool anyHit4(const BVH4& wide, const LinearBVH& bvh, const TriangleLeaves& triangles, const vectorThree& origin, const vectorThree& dir,
+	float tMin, float tMax, int cull = CULL_BY_LANE);
+
+/**
+ * @brief Collapses the binary hierarchy into an 8-ary one, see collapseBVH4
+ */
+BVH8 collapseBVH8(const LinearBVH& bvh);
+
+/**
+ * @brief Same as intersectingChildren4 with eight children per AVX2 slab test,
+ * only call when cpuSupportsAVX2 returns true
+ */
+void intersectingChildren8(const BVH8& wide, vectorThree& origin, vectorThree& dest, std::vector<int>& leaves);
+void closestHit8(const BVH8& wide, const LinearBVH& bvh, const TriangleLeaves& triangles, const vectorThree& origin, const vectorThree& dir,
+	float tMin, RayHit& hit, int cull = CULL_BY_LANE);
+bool anyHit8(const BVH8& wide, const LinearBVH& bvh, const TriangleLeaves& triangles, const vectorThree& origin, const vectorThree& dir,
+	float tMin, float tMax, int cull = CULL_BY_LANE);
+
+/**
+ * @brief Quantizes the child bounds of every node of the BVH4, keeping its
+ * node order, so the quantized hierarchy needs half the memory
+ */
+QBVH4 quantizeBVH4(const BVH4& wide);
+
+/**
+ * @brief Quantizes the refitted BVH4 again into the nodes it was quantized
+ * into before, the topology has to be unchanged
+ */
+void requantizeBVH4(QBVH4& quantized, const BVH4& wide);
+
+/**
+ * @brief Same as intersectingChildren4, decoding the quantized child bounds
+ * in SSE registers as part of the slab test
+ */
+void intersectingChildrenQ4(const QBVH4& quantized, vectorThree& origin, vectorThree& dest, std::vector<int>& leaves);
+void closestHitQ4(const QBVH4& quantized, const LinearBVH& bvh, const TriangleLeaves& triangles, const vectorThree& origin, const vectorThree& dir,
+	float tMin, RayHit& hit, int cull = CULL_BY_LANE);
+bool anyHitQ4(const QBVH4& quantized, const LinearBVH& bvh, const TriangleLeaves& triangles, const vectorThree& origin, const vectorThree& dir,
+	float tMin, float tMax, int cull = CULL_BY_LANE);
+
+/**
+ * @brief Copies the bounds of a refitted binary hierarchy into the wide
+ * hierarchy collapsed from it
+ */
+void refitBVH4(BVH4& wide, const LinearBVH& bvh);
+void refitBVH8(BVH8& wide, const LinearBVH& bvh);
+
+bool cpuSupportsAVX2();
+
+/**
+ * @brief Widest traversal kernel the current CPU can run
+ */
+TraversalMode bestTraversalMode();
+
+const char* traversalModeName(TraversalMode mode);
+
+#endif // WIDEBVH